@@ -0,0 +1,469 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Writing and reading access traces, see access_trace.h for the format
+ *
+ * Tracing is meant to stay on for days, so an operation costs one lookup
+ * of its path in a hash table and a few bytes appended to a buffer, which
+ * is written out once it fills up, or with the first operation more than a
+ * second after the last write; there is no timer, so the tail of a burst
+ * stays buffered until the next operation or access_trace_close(). Paths
+ * and process names are written only the first time they are seen. The
+ * names are read from /proc without the lock held, as that takes a few
+ * system calls.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_trace.h"
+#include "nica/hashmap.h"
+#include "nica/util.h"
+
+#define TRACE_BUFFER_SIZE (256 * 1024)
+#define TRACE_FLUSH_SIZE (192 * 1024)
+#define TRACE_FLUSH_NS 1000000000ULL
+
+/* Processes whose name was written, by pid modulo this */
+#define PROC_CACHE_SIZE 1024
+
+#define COMM_SIZE 32
+#define VARINT_MAX 10
+
+static const char *op_names[ACCESS_N_OPS] = { "getattr", "readlink", "open", "read" };
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool tracing = false;
+static int trace_fd = -1;
+static uint8_t trace_buf[TRACE_BUFFER_SIZE];
+static size_t trace_used = 0;
+static uint64_t trace_base = 0; /* monotonic_ns() when the trace began */
+static uint64_t last_us = 0;    /* Start of the previous operation */
+static uint64_t last_flush = 0;
+static NcHashmap *path_ids = NULL;
+static uint64_t next_path_id = 1;
+static int procs[PROC_CACHE_SIZE];
+
+static uint64_t monotonic_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v)
+{
+        size_t n = 0;
+
+        while (v >= 0x80) {
+                p[n++] = (uint8_t)(v | 0x80);
+                v >>= 7;
+        }
+        p[n++] = (uint8_t)v;
+        return n;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/**
+ * Write out the buffer, with trace_mutex held, giving up tracing if that
+ * fails
+ */
+static void trace_flush(void)
+{
+        size_t done = 0;
+
+        while (done < trace_used) {
+                ssize_t r = write(trace_fd, trace_buf + done, trace_used - done);
+
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (r <= 0) {
+                        fprintf(stderr, "Access trace stopped: %s\n", strerror(errno));
+                        __atomic_store_n(&tracing, false, __ATOMIC_RELAXED);
+                        break;
+                }
+                done += (size_t)r;
+        }
+        trace_used = 0;
+        last_flush = monotonic_ns();
+}
+
+/**
+ * Make room for @len more bytes in the buffer, with trace_mutex held
+ */
+static inline uint8_t *trace_reserve(size_t len)
+{
+        if (trace_used + len > TRACE_BUFFER_SIZE) {
+                trace_flush();
+        }
+        return trace_buf + trace_used;
+}
+
+/**
+ * Append a definition of @kind for @id named @name, with trace_mutex held
+ */
+static void trace_define(uint8_t kind, uint64_t id, const char *name)
+{
+        size_t len = strlen(name);
+        uint8_t *p = trace_reserve(1 + 2 * VARINT_MAX + len);
+        size_t n = 0;
+
+        p[n++] = kind;
+        n += put_varint(p + n, id);
+        n += put_varint(p + n, len);
+        memcpy(p + n, name, len);
+        trace_used += n + len;
+}
+
+/**
+ * Get the name of process @pid into @comm, "" if it is gone
+ */
+static void read_comm(int pid, char *comm)
+{
+        char file[64];
+        ssize_t len = 0;
+        int fd;
+
+        snprintf(file, sizeof(file), "/proc/%d/comm", pid);
+        fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+                len = read(fd, comm, COMM_SIZE - 1);
+                close(fd);
+        }
+        if (len < 0) {
+                len = 0;
+        }
+        if (len > 0 && comm[len - 1] == '\n') {
+                len--;
+        }
+        comm[len] = '\0';
+}
+
+bool access_trace_open(const char *prefix)
+{
+        const char *env = getenv("CLR_DEBUGINFO_ACCESS_TRACE");
+        autofree(char) *file = NULL;
+        struct timespec now;
+        uint8_t *p;
+        size_t n;
+
+        if (!env || !*env) {
+                return false;
+        }
+        if (asprintf(&file, "%s.%s.%d", env, prefix, (int)getpid()) < 0) {
+                return false;
+        }
+        trace_fd = open(file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 00600);
+        if (trace_fd < 0) {
+                fprintf(stderr, "Cannot create access trace %s: %s\n", file, strerror(errno));
+                return false;
+        }
+        path_ids = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!path_ids) {
+                close(trace_fd);
+                return false;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        trace_base = last_flush = monotonic_ns();
+
+        p = trace_buf;
+        memcpy(p, ACCESS_MAGIC, 8);
+        n = 8;
+        n += put_varint(p + n, (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec);
+        n += put_varint(p + n, strlen(prefix));
+        memcpy(p + n, prefix, strlen(prefix));
+        trace_used = n + strlen(prefix);
+
+        __atomic_store_n(&tracing, true, __ATOMIC_RELAXED);
+        return true;
+}
+
+void access_trace(AccessOp op, const char *path, int pid, uint64_t start, off_t offset,
+                  size_t size, int result)
+{
+        size_t slot = (size_t)(unsigned)pid % PROC_CACHE_SIZE;
+        uint64_t now, start_us, id;
+        char comm[COMM_SIZE] = "";
+        bool known_proc;
+        uint8_t *p;
+        size_t n = 0;
+
+        if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+                return;
+        }
+        now = monotonic_ns();
+
+        known_proc = __atomic_load_n(&procs[slot], __ATOMIC_RELAXED) == pid;
+        if (!known_proc) {
+                read_comm(pid, comm);
+        }
+
+        pthread_mutex_lock(&trace_mutex);
+        if (!tracing) {
+                goto out;
+        }
+
+        if (procs[slot] != pid) {
+                if (known_proc) {
+                        /* another process took the slot meanwhile */
+                        read_comm(pid, comm);
+                }
+                trace_define(ACCESS_DEF_PROC, (uint64_t)(unsigned)pid, comm);
+                __atomic_store_n(&procs[slot], pid, __ATOMIC_RELAXED);
+        }
+
+        id = (uint64_t)(uintptr_t)nc_hashmap_get(path_ids, path);
+        if (!id) {
+                char *key = strdup(path);
+
+                if (!key || !nc_hashmap_put(path_ids, key, NC_HASH_VALUE(next_path_id))) {
+                        free(key);
+                        goto out;
+                }
+                id = next_path_id++;
+                trace_define(ACCESS_DEF_PATH, id, path);
+        }
+
+        start_us = (start - trace_base) / 1000;
+        p = trace_reserve(1 + 7 * VARINT_MAX);
+        p[n++] = (uint8_t)op;
+        n += put_varint(p + n, zigzag((int64_t)start_us - (int64_t)last_us));
+        n += put_varint(p + n, (now - start) / 1000);
+        n += put_varint(p + n, (uint64_t)(unsigned)pid);
+        n += put_varint(p + n, id);
+        n += put_varint(p + n, zigzag(result));
+        if (op == ACCESS_READ) {
+                n += put_varint(p + n, (uint64_t)offset);
+                n += put_varint(p + n, size);
+        }
+        trace_used += n;
+        last_us = start_us;
+
+        if (trace_used > TRACE_FLUSH_SIZE || now - last_flush > TRACE_FLUSH_NS) {
+                trace_flush();
+        }
+out:
+        pthread_mutex_unlock(&trace_mutex);
+}
+
+void access_trace_close(void)
+{
+        pthread_mutex_lock(&trace_mutex);
+        if (tracing) {
+                trace_flush();
+        }
+        __atomic_store_n(&tracing, false, __ATOMIC_RELAXED);
+        if (trace_fd >= 0) {
+                close(trace_fd);
+                trace_fd = -1;
+        }
+        if (path_ids) {
+                nc_hashmap_free(path_ids);
+                path_ids = NULL;
+        }
+        pthread_mutex_unlock(&trace_mutex);
+}
+
+const char *access_op_name(AccessOp op)
+{
+        return op < ACCESS_N_OPS ? op_names[op] : "unknown";
+}
+
+static bool get_varint(FILE *f, uint64_t *v)
+{
+        *v = 0;
+        for (int shift = 0; shift < 7 * VARINT_MAX; shift += 7) {
+                int c = getc(f);
+
+                if (c == EOF) {
+                        return false;
+                }
+                *v |= (uint64_t)(c & 0x7f) << shift;
+                if (!(c & 0x80)) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Read a length and that many bytes from @f
+ *
+ * @return The newly allocated string, or NULL if malformed
+ */
+static char *get_string(FILE *f)
+{
+        uint64_t len;
+        char *s;
+
+        if (!get_varint(f, &len) || len > PATH_MAX) {
+                return NULL;
+        }
+        s = malloc((size_t)len + 1);
+        if (!s) {
+                return NULL;
+        }
+        if (fread(s, 1, (size_t)len, f) != (size_t)len) {
+                free(s);
+                return NULL;
+        }
+        s[len] = '\0';
+        return s;
+}
+
+bool access_trace_parse(FILE *f, char **prefix, bool (*fn)(const AccessRecord *, void *),
+                        void *data)
+{
+        char magic[8];
+        char **paths = NULL;
+        size_t n_paths = 0;
+        NcHashmap *comms = NULL;
+        uint64_t base_ns;
+        int64_t time_us = 0;
+        bool ret = false;
+        char *mount;
+        int kind;
+
+        if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+            memcmp(magic, ACCESS_MAGIC, sizeof(magic)) != 0 || !get_varint(f, &base_ns) ||
+            !(mount = get_string(f))) {
+                return false;
+        }
+        if (prefix) {
+                *prefix = mount;
+        } else {
+                free(mount);
+        }
+        /* keyed by pid + 1, as a NULL key won't do */
+        comms = nc_hashmap_new_full(nc_simple_hash, nc_simple_compare, NULL, free);
+        if (!comms) {
+                return false;
+        }
+
+        while ((kind = getc(f)) != EOF) {
+                uint64_t id, v[5];
+                AccessRecord record = { 0 };
+                char *name;
+
+                if (kind == ACCESS_DEF_PATH || kind == ACCESS_DEF_PROC) {
+                        if (!get_varint(f, &id) || !(name = get_string(f))) {
+                                goto out;
+                        }
+                        if (kind == ACCESS_DEF_PROC) {
+                                /* a pid seen again is a new process */
+                                nc_hashmap_remove(comms, NC_HASH_KEY(id + 1));
+                                if (!nc_hashmap_put(comms, NC_HASH_KEY(id + 1), name)) {
+                                        free(name);
+                                        goto out;
+                                }
+                                continue;
+                        }
+                        if (id == 0 || id > n_paths + 1) {
+                                free(name);
+                                goto out;
+                        }
+                        if (id > n_paths) {
+                                char **grown = realloc(paths, (n_paths + 1) * sizeof(char *));
+
+                                if (!grown) {
+                                        free(name);
+                                        goto out;
+                                }
+                                paths = grown;
+                                paths[n_paths++] = NULL;
+                        }
+                        free(paths[id - 1]);
+                        paths[id - 1] = name;
+                        continue;
+                }
+
+                if (kind >= ACCESS_N_OPS) {
+                        goto out;
+                }
+                for (size_t i = 0; i < ARRAY_SIZE(v); i++) {
+                        if (!get_varint(f, &v[i])) {
+                                goto out;
+                        }
+                }
+                record.op = (AccessOp)kind;
+                time_us += unzigzag(v[0]);
+                record.time_ns = base_ns + (uint64_t)time_us * 1000;
+                record.duration_us = v[1];
+                record.pid = (int)v[2];
+                record.comm = nc_hashmap_get(comms, NC_HASH_KEY(v[2] + 1));
+                if (!record.comm) {
+                        record.comm = "";
+                }
+                if (v[3] == 0 || v[3] > n_paths) {
+                        goto out;
+                }
+                record.path = paths[v[3] - 1];
+                record.result = (int)unzigzag(v[4]);
+                if (record.op == ACCESS_READ &&
+                    (!get_varint(f, &record.offset) || !get_varint(f, &record.size))) {
+                        goto out;
+                }
+                if (!fn(&record, data)) {
+                        break;
+                }
+        }
+        ret = true;
+
+out:
+        for (size_t i = 0; i < n_paths; i++) {
+                free(paths[i]);
+        }
+        free(paths);
+        nc_hashmap_free(comms);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,126 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Access traces
+ *
+ * With CLR_DEBUGINFO_ACCESS_TRACE set to a path, each clr_debug_fuse
+ * process appends every getattr, readlink, open and read to the file
+ * PATH.PREFIX.PID. A trace is the 8 byte ACCESS_MAGIC, then varints: the
+ * wall clock time it started at in nanoseconds, the length of the mount
+ * prefix and the prefix. Records follow, each a kind byte and varints:
+ *
+ *   ACCESS_DEF_PATH  id, length, path
+ *   ACCESS_DEF_PROC  pid, length, comm
+ *   AccessOp         signed microseconds since the previous operation
+ *                    started, duration in microseconds, pid, path id,
+ *                    signed result; for reads then offset and size
+ *
+ * A path or process is defined once, before the first operation that
+ * refers to it. Signed varints are zigzag encoded. Most records take less
+ * than 10 bytes.
+ */
+
+#define ACCESS_MAGIC "CDBGACC1"
+
+#define ACCESS_DEF_PATH 0x80
+#define ACCESS_DEF_PROC 0x81
+
+typedef enum {
+        ACCESS_GETATTR,
+        ACCESS_READLINK,
+        ACCESS_OPEN,
+        ACCESS_READ,
+        ACCESS_N_OPS
+} AccessOp;
+
+/**
+ * One operation read back from a trace
+ */
+typedef struct AccessRecord {
+        AccessOp op;
+        uint64_t time_ns; /**<Wall clock time it started at */
+        uint64_t duration_us;
+        int pid;
+        const char *comm; /**<Name of the process, "" if it exited too soon */
+        const char *path; /**<Below the mount */
+        uint64_t offset;  /**<Of reads only */
+        uint64_t size;    /**<Of reads only */
+        int result;       /**<Bytes read, 0, or a negative errno */
+} AccessRecord;
+
+/**
+ * Start tracing the operations on the mount of @prefix if the
+ * CLR_DEBUGINFO_ACCESS_TRACE environment variable asks to
+ *
+ * @return true if tracing
+ */
+bool access_trace_open(const char *prefix);
+
+/**
+ * Append an operation on @path by @pid that began at @start, in
+ * nanoseconds of CLOCK_MONOTONIC like latency_start(), to the trace
+ *
+ * @param offset Offset of a read
+ * @param size Size of a read
+ * @param result Bytes read, 0, or a negative errno
+ */
+void access_trace(AccessOp op, const char *path, int pid, uint64_t start, off_t offset,
+                  size_t size, int result);
+
+/**
+ * Write out what is buffered and stop tracing
+ */
+void access_trace_close(void);
+
+/**
+ * Name of @op, e.g. "getattr"
+ */
+const char *access_op_name(AccessOp op);
+
+/**
+ * Call @fn with each operation in the trace @f, until it returns false
+ *
+ * @param prefix Set to the mount prefix of the trace, a newly allocated
+ * string, unless NULL
+ *
+ * @return true if the whole trace was well formed
+ */
+bool access_trace_parse(FILE *f, char **prefix, bool (*fn)(const AccessRecord *, void *),
+                        void *data);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,427 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Size-bounded cache eviction
+ *
+ * Every object below CACHE_DIR/lib and CACHE_DIR/src is kept in a list
+ * ordered by last access. Lookups move an object to the front and bump
+ * its atime, so the order survives the daemon exiting when idle; the
+ * list is rebuilt from the atimes by a background scan at startup. Once
+ * the disk usage exceeds the quota, a low priority thread unlinks objects
+ * from the back of the list, a batch at a time, until usage is down to
+ * CACHE_LOW_WATERMARK percent of the quota.
+ *
+ * The quota is set with CLR_DEBUGINFO_CACHE_QUOTA, in bytes with an
+ * optional K, M, G or T suffix; 0 disables eviction, leaving only the
+ * ages in debuginfo.conf. Pinned objects, see pins.c, and objects still
+ * being filled in are never evicted: once they reach the back of the list
+ * they are taken off it and no longer counted, until looked up again.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "nica/hashmap.h"
+#include "nica/util.h"
+#include "seekable.h"
+
+#include "config.h"
+
+#define CACHE_DEFAULT_QUOTA (2ULL * 1024 * 1024 * 1024)
+#define CACHE_LOW_WATERMARK 90 /* percent of the quota */
+#define CACHE_EVICT_BATCH 32
+#define CACHE_EVICT_PAUSE 10000 /* microseconds between batches */
+#define CACHE_CHECK_INTERVAL 60 /* seconds */
+
+/**
+ * A cached object, linked into the access-ordered list
+ */
+typedef struct CacheEntry {
+        char *key;               /**<Path relative to CACHE_DIR, e.g. "lib/usr/..." */
+        unsigned long long size; /**<Disk usage in bytes */
+        time_t atime;            /**<Last access */
+        bool kept;               /**<Pinned or partial, off the list and out of the usage */
+        struct CacheEntry *prev; /**<More recently used neighbour */
+        struct CacheEntry *next; /**<Less recently used neighbour */
+} CacheEntry;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static NcHashmap *entries = NULL;
+static CacheEntry *mru = NULL;
+static CacheEntry *lru = NULL;
+static unsigned long long cache_usage = 0;
+static unsigned long long cache_quota = CACHE_DEFAULT_QUOTA;
+
+/* Objects found by the startup scan, see cache_scan() */
+static CacheEntry **found = NULL;
+static size_t n_found = 0;
+static size_t found_alloc = 0;
+
+static void cache_entry_free(void *p)
+{
+        CacheEntry *entry = p;
+
+        free(entry->key);
+        free(entry);
+}
+
+static void list_unlink(CacheEntry *entry)
+{
+        if (entry->prev) {
+                entry->prev->next = entry->next;
+        } else {
+                mru = entry->next;
+        }
+        if (entry->next) {
+                entry->next->prev = entry->prev;
+        } else {
+                lru = entry->prev;
+        }
+        entry->prev = entry->next = NULL;
+}
+
+static void list_push_front(CacheEntry *entry)
+{
+        entry->prev = NULL;
+        entry->next = mru;
+        if (mru) {
+                mru->prev = entry;
+        } else {
+                lru = entry;
+        }
+        mru = entry;
+}
+
+static void list_push_back(CacheEntry *entry)
+{
+        entry->next = NULL;
+        entry->prev = lru;
+        if (lru) {
+                lru->next = entry;
+        } else {
+                mru = entry;
+        }
+        lru = entry;
+}
+
+static unsigned long long disk_usage(const struct stat *st)
+{
+        unsigned long long usage = (unsigned long long)st->st_blocks * 512;
+
+        /* deduplicated files are shared by all the paths linking to them,
+         * besides the stored copy itself, see cas.c */
+        if (st->st_nlink > 2) {
+                usage /= st->st_nlink - 1;
+        }
+        return usage;
+}
+
+/**
+ * Parse a size with an optional K, M, G or T suffix
+ */
+static bool parse_size(const char *s, unsigned long long *size)
+{
+        char *end = NULL;
+        unsigned long long value;
+
+        errno = 0;
+        value = strtoull(s, &end, 10);
+        if (errno || end == s) {
+                return false;
+        }
+        switch (*end) {
+        case 'T':
+        case 't':
+                value *= 1024;
+                /* fallthrough */
+        case 'G':
+        case 'g':
+                value *= 1024;
+                /* fallthrough */
+        case 'M':
+        case 'm':
+                value *= 1024;
+                /* fallthrough */
+        case 'K':
+        case 'k':
+                value *= 1024;
+                end++;
+                break;
+        default:
+                break;
+        }
+        if (*end) {
+                return false;
+        }
+        *size = value;
+        return true;
+}
+
+void cache_note_access(const char *prefix, const char *path)
+{
+        const struct timespec times[2] = { { .tv_nsec = UTIME_NOW }, { .tv_nsec = UTIME_OMIT } };
+        autofree(char) *key = NULL;
+        autofree(char) *local = NULL;
+        CacheEntry *entry;
+        struct stat st;
+        bool over;
+
+        if (!cache_quota || asprintf(&key, "%s%s", prefix, path) < 0 ||
+            asprintf(&local, "%s/%s", CACHE_DIR, key) < 0) {
+                return;
+        }
+        if (lstat(local, &st) != 0 || S_ISDIR(st.st_mode)) {
+                return;
+        }
+        /* relatime or noatime mounts don't keep the order for us */
+        utimensat(AT_FDCWD, local, times, AT_SYMLINK_NOFOLLOW);
+
+        pthread_mutex_lock(&cache_mutex);
+        entry = nc_hashmap_get(entries, key);
+        if (entry && entry->kept) {
+                entry->kept = false;
+        } else if (entry) {
+                list_unlink(entry);
+                cache_usage -= entry->size;
+        } else {
+                entry = calloc(1, sizeof(CacheEntry));
+                if (!entry) {
+                        pthread_mutex_unlock(&cache_mutex);
+                        return;
+                }
+                entry->key = key;
+                key = NULL;
+                nc_hashmap_put(entries, entry->key, entry);
+        }
+        entry->size = disk_usage(&st);
+        entry->atime = time(NULL);
+        cache_usage += entry->size;
+        list_push_front(entry);
+        over = cache_usage > cache_quota;
+        pthread_mutex_unlock(&cache_mutex);
+
+        if (over) {
+                pthread_cond_signal(&cache_cond);
+        }
+}
+
+static int cache_scan(const char *fpath, const struct stat *sb, int typeflag,
+                      __nc_unused__ struct FTW *ftwbuf)
+{
+        CacheEntry *entry;
+
+        if (typeflag != FTW_F && typeflag != FTW_SL) {
+                return 0;
+        }
+        if (n_found == found_alloc) {
+                size_t alloc = found_alloc ? found_alloc * 2 : 4096;
+                CacheEntry **grown = realloc(found, alloc * sizeof(CacheEntry *));
+                if (!grown) {
+                        return 1;
+                }
+                found = grown;
+                found_alloc = alloc;
+        }
+
+        entry = calloc(1, sizeof(CacheEntry));
+        if (!entry) {
+                return 1;
+        }
+        entry->key = strdup(fpath + sizeof(CACHE_DIR));
+        if (!entry->key) {
+                free(entry);
+                return 1;
+        }
+        entry->size = disk_usage(sb);
+        entry->atime = sb->st_atime;
+        found[n_found++] = entry;
+        return 0;
+}
+
+static int compare_newest_first(const void *l, const void *r)
+{
+        const CacheEntry *a = *(CacheEntry *const *)l;
+        const CacheEntry *b = *(CacheEntry *const *)r;
+
+        return (a->atime < b->atime) - (a->atime > b->atime);
+}
+
+/**
+ * Add everything already on disk behind the objects looked up since the
+ * daemon started, oldest at the back
+ */
+static void cache_load(void)
+{
+        nftw(CACHE_DIR "/lib", cache_scan, 16, FTW_PHYS);
+        nftw(CACHE_DIR "/src", cache_scan, 16, FTW_PHYS);
+        qsort(found, n_found, sizeof(CacheEntry *), compare_newest_first);
+
+        pthread_mutex_lock(&cache_mutex);
+        for (size_t i = 0; i < n_found; i++) {
+                CacheEntry *entry = found[i];
+
+                if (nc_hashmap_contains(entries, entry->key)) {
+                        cache_entry_free(entry);
+                        continue;
+                }
+                nc_hashmap_put(entries, entry->key, entry);
+                cache_usage += entry->size;
+                list_push_back(entry);
+        }
+        pthread_mutex_unlock(&cache_mutex);
+
+        free(found);
+        found = NULL;
+        n_found = found_alloc = 0;
+}
+
+/**
+ * Unlink up to CACHE_EVICT_BATCH of the least recently used objects
+ *
+ * @return true if usage is still above the low watermark
+ */
+static bool cache_evict_batch(void)
+{
+        unsigned long long low = cache_quota / 100 * CACHE_LOW_WATERMARK;
+        bool more;
+
+        pthread_mutex_lock(&cache_mutex);
+        for (int i = 0; i < CACHE_EVICT_BATCH && lru && cache_usage > low; i++) {
+                CacheEntry *entry = lru;
+                autofree(char) *local = NULL;
+                autofree(char) *map = NULL;
+                struct stat st;
+
+                list_unlink(entry);
+                cache_usage -= entry->size;
+                if (asprintf(&local, "%s/%s", CACHE_DIR, entry->key) < 0 ||
+                    asprintf(&map, "%s/%s/%s", CACHE_DIR, PARTIAL_SUBDIR, entry->key) < 0) {
+                        nc_hashmap_remove(entries, entry->key);
+                        continue;
+                }
+                /* partial files are still being filled in, and are used; pinned
+                 * objects are kept whatever their age, outside of the quota */
+                if (lstat(map, &st) == 0 || pins_match(entry->key)) {
+                        entry->kept = true;
+                        continue;
+                }
+                if (unlink(local) != 0 && errno != ENOENT) {
+                        fprintf(stderr, "Failed to evict %s: %s\n", local, strerror(errno));
+                }
+                nc_hashmap_remove(entries, entry->key);
+        }
+        more = lru && cache_usage > low;
+        pthread_mutex_unlock(&cache_mutex);
+
+        return more;
+}
+
+static void *cache_thread(__nc_unused__ void *arg)
+{
+        /* eviction is housekeeping, don't compete with lookups */
+        setpriority(PRIO_PROCESS, (id_t)gettid(), 19);
+
+        cache_load();
+        cas_prune();
+
+        while (1) {
+                struct timespec deadline;
+                bool over;
+
+                pthread_mutex_lock(&cache_mutex);
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += CACHE_CHECK_INTERVAL;
+                while (cache_usage <= cache_quota) {
+                        if (pthread_cond_timedwait(&cache_cond, &cache_mutex, &deadline) ==
+                            ETIMEDOUT) {
+                                break;
+                        }
+                }
+                over = cache_usage > cache_quota;
+                pthread_mutex_unlock(&cache_mutex);
+
+                while (cache_evict_batch()) {
+                        usleep(CACHE_EVICT_PAUSE);
+                }
+                /* the space of deduplicated files is only freed with their last link */
+                if (over) {
+                        cas_prune();
+                }
+        }
+
+        return NULL;
+}
+
+unsigned long long cache_init(void)
+{
+        const char *env = getenv("CLR_DEBUGINFO_CACHE_QUOTA");
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        if (env && !parse_size(env, &cache_quota)) {
+                fprintf(stderr, "Invalid CLR_DEBUGINFO_CACHE_QUOTA %s, using the default\n", env);
+                cache_quota = CACHE_DEFAULT_QUOTA;
+        }
+        if (!cache_quota) {
+                return 0;
+        }
+
+        entries = nc_hashmap_new_full(nc_string_hash, nc_string_compare, NULL, cache_entry_free);
+        if (!entries) {
+                cache_quota = 0;
+                return 0;
+        }
+        if (pthread_attr_init(&attr) != 0) {
+                cache_quota = 0;
+                return 0;
+        }
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, cache_thread, NULL) != 0) {
+                cache_quota = 0;
+        }
+        pthread_attr_destroy(&attr);
+
+        return cache_quota;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
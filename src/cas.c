@@ -0,0 +1,199 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Content-addressed deduplication
+ *
+ * Many cached files are byte-identical: headers vendored into several
+ * packages, and objects republished unchanged by a new release. Every
+ * extracted file of at least CAS_MIN_SIZE bytes is hashed on its way into
+ * the cache and looked up in CACHE_DIR/CAS_SUBDIR by hash, size and mtime.
+ * A match is compared byte for byte and, if equal, the cached path becomes
+ * a hardlink to the stored copy and the new copy is dropped; otherwise the
+ * new file becomes the stored copy.
+ *
+ * Hardlinks rather than reflinks, as they work on any filesystem and their
+ * link count tells when a stored copy is no longer used by any cached path,
+ * see cas_prune(). Linked paths share their inode, including the mtime,
+ * which clr_debug_fuse sends as If-Modified-Since, and a shared inode is
+ * never touched: changing its mtime would answer the revalidations of every
+ * path linked to it with the wrong validator. Hence the mtime in the key:
+ * each version of some content is stored once and shared by the copies of
+ * that version, and a republished object with a new mtime starts a new
+ * stored copy, which the next copies of it are linked to.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "nica/util.h"
+
+#include "config.h"
+
+/* Smaller files take no more than the block a link would save */
+#define CAS_MIN_SIZE 4096
+
+/**
+ * Hash @len bytes at @data, 64 bits at a time
+ */
+static uint64_t cas_hash(const unsigned char *data, size_t len)
+{
+        uint64_t hash = 0xcbf29ce484222325ULL ^ len;
+        size_t i = 0;
+
+        for (; i + 8 <= len; i += 8) {
+                uint64_t word;
+
+                memcpy(&word, data + i, sizeof(word));
+                hash = (hash ^ word) * 0x100000001b3ULL;
+                hash ^= hash >> 29;
+        }
+        for (; i < len; i++) {
+                hash = (hash ^ data[i]) * 0x100000001b3ULL;
+        }
+        hash ^= hash >> 32;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 29;
+        return hash;
+}
+
+/**
+ * Map the whole regular file @path read-only
+ *
+ * @return The mapping, or MAP_FAILED
+ */
+static void *map_file(const char *path, size_t size)
+{
+        void *map;
+        int fd;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return MAP_FAILED;
+        }
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        return map;
+}
+
+/**
+ * Determine whether the file @path holds exactly the @size bytes at @data
+ */
+static bool same_content(const char *path, const void *data, size_t size)
+{
+        void *map = map_file(path, size);
+        bool ret;
+
+        if (map == MAP_FAILED) {
+                return false;
+        }
+        ret = memcmp(map, data, size) == 0;
+        munmap(map, size);
+        return ret;
+}
+
+bool cas_publish(const char *src, const char *dst, const struct stat *st)
+{
+        autofree(char) *dir = NULL;
+        autofree(char) *stored = NULL;
+        autofree(char) *tmp = NULL;
+        struct stat stored_st;
+        size_t size = (size_t)st->st_size;
+        uint64_t hash;
+        void *map;
+
+        if (!S_ISREG(st->st_mode) || st->st_size < CAS_MIN_SIZE) {
+                return rename(src, dst) == 0;
+        }
+        map = map_file(src, size);
+        if (map == MAP_FAILED) {
+                return rename(src, dst) == 0;
+        }
+        hash = cas_hash(map, size);
+
+        if (asprintf(&dir, "%s/%s/%02x", CACHE_DIR, CAS_SUBDIR, (unsigned)(hash >> 56)) < 0 ||
+            asprintf(&stored, "%s/%016llx-%zu-%lld", dir, (unsigned long long)hash, size,
+                     (long long)st->st_mtim.tv_sec) < 0 ||
+            asprintf(&tmp, "%s.cas", src) < 0) {
+                munmap(map, size);
+                return rename(src, dst) == 0;
+        }
+
+        if (lstat(stored, &stored_st) == 0) {
+                if (S_ISREG(stored_st.st_mode) && (size_t)stored_st.st_size == size &&
+                    stored_st.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+                    stored_st.st_mtim.tv_nsec == st->st_mtim.tv_nsec &&
+                    same_content(stored, map, size) && link(stored, tmp) == 0) {
+                        munmap(map, size);
+                        if (rename(tmp, dst) == 0) {
+                                unlink(src);
+                                return true;
+                        }
+                        unlink(tmp);
+                        return rename(src, dst) == 0;
+                }
+                /* a hash collision, a broken copy, or a copy whose mtime only
+                 * differs below the second: leave it be */
+        } else if (mkdir(dir, 00755) == 0 || errno == EEXIST) {
+                if (link(src, stored) != 0 && errno != EEXIST) {
+                        fprintf(stderr, "Failed to store %s: %s\n", stored, strerror(errno));
+                }
+        }
+        munmap(map, size);
+
+        return rename(src, dst) == 0;
+}
+
+static int cas_prune_one(const char *fpath, const struct stat *sb, int typeflag,
+                         __nc_unused__ struct FTW *ftwbuf)
+{
+        /* no cached path links to it anymore */
+        if (typeflag == FTW_F && sb->st_nlink == 1) {
+                unlink(fpath);
+        }
+        return 0;
+}
+
+void cas_prune(void)
+{
+        nftw(CACHE_DIR "/" CAS_SUBDIR, cas_prune_one, 16, FTW_PHYS);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,194 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Bulk revalidation from change logs
+ *
+ * Every run of clr_debug_prepare that regenerates tarballs publishes their
+ * names, e.g. "/lib/usr/lib64/libc.so.6.debug", in changes/<serial>.log,
+ * and the newest serial in changes/latest. Rather than revalidating each
+ * cached object with a conditional request when it is next looked up, the
+ * daemon fetches the logs published since the last one it applied, marks
+ * everything in the validator index validated since then as current, and
+ * invalidates exactly the objects named in the logs.
+ *
+ * The logs only tell what changed between two serials, so the first sync,
+ * and one after more than CHANGES_MAX logs or a missing one, invalidates
+ * the whole index, records the latest serial and leaves revalidation to
+ * the individual lookups.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "nica/util.h"
+
+#include "config.h"
+
+#define CHANGES_MAX 64
+#define CHANGES_INTERVAL 600 /* seconds between checks */
+
+static pthread_mutex_t changes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool syncing = false;
+
+/**
+ * Fetch the change log @serial, or "latest" if 0
+ */
+static int changes_get(uint64_t serial, char **data)
+{
+        autofree(char) *url = NULL;
+        size_t len = 0;
+        int ret;
+
+        if (serial) {
+                ret = asprintf(&url,
+                               "%schanges/%llu.log",
+                               urls[urlcounter % urls_size],
+                               (unsigned long long)serial);
+        } else {
+                ret = asprintf(&url, "%schanges/latest", urls[urlcounter % urls_size]);
+        }
+        if (ret < 0) {
+                return 418;
+        }
+        return curl_get_buffer(url, data, &len, NULL);
+}
+
+static void changes_sync(void)
+{
+        autofree(char) *latest_data = NULL;
+        char *logs[CHANGES_MAX] = { NULL };
+        uint64_t applied, latest;
+        time_t synced, now;
+        int n_logs = 0, changed = 0;
+
+        if (changes_get(0, &latest_data) != 200) {
+                return;
+        }
+        now = time(NULL);
+        latest = strtoull(latest_data, NULL, 10);
+        applied = index_serial(&synced);
+        if (!latest || latest == applied) {
+                return;
+        }
+        if (!applied || latest < applied || latest - applied > CHANGES_MAX) {
+                /* nothing to go by, the lookups revalidate one at a time */
+                index_invalidate_all();
+                index_set_serial(latest, now);
+                return;
+        }
+
+        /* all of them or nothing, a gap would leave changes unnoticed */
+        for (uint64_t serial = applied + 1; serial <= latest; serial++) {
+                if (changes_get(serial, &logs[n_logs]) != 200) {
+                        index_invalidate_all();
+                        index_set_serial(latest, now);
+                        goto out;
+                }
+                n_logs++;
+        }
+
+        /* answers from before the last sync predate changes the logs don't cover */
+        index_refresh_all(synced, now);
+        for (int i = 0; i < n_logs; i++) {
+                char *line, *saveptr = NULL;
+
+                for (line = strtok_r(logs[i], "\n", &saveptr); line;
+                     line = strtok_r(NULL, "\n", &saveptr)) {
+                        if (strncmp(line, "/lib/", 5) == 0 || strncmp(line, "/src/", 5) == 0) {
+                                index_invalidate(line + 1);
+                                changed++;
+                        }
+                }
+        }
+        index_set_serial(latest, now);
+        fprintf(stderr,
+                "Applied change logs %llu to %llu, %i objects changed\n",
+                (unsigned long long)applied + 1,
+                (unsigned long long)latest,
+                changed);
+
+out:
+        for (int i = 0; i < n_logs; i++) {
+                free(logs[i]);
+        }
+}
+
+static void *changes_thread(__nc_unused__ void *arg)
+{
+        setpriority(PRIO_PROCESS, (id_t)gettid(), 19);
+
+        while (1) {
+                pthread_mutex_lock(&changes_mutex);
+                syncing = true;
+                pthread_mutex_unlock(&changes_mutex);
+
+                changes_sync();
+
+                pthread_mutex_lock(&changes_mutex);
+                syncing = false;
+                pthread_mutex_unlock(&changes_mutex);
+                sleep(CHANGES_INTERVAL);
+        }
+
+        return NULL;
+}
+
+void changes_init(void)
+{
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        if (pthread_attr_init(&attr) != 0) {
+                return;
+        }
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_create(&thread, &attr, changes_thread, NULL);
+        pthread_attr_destroy(&attr);
+}
+
+bool changes_busy(void)
+{
+        bool busy;
+
+        pthread_mutex_lock(&changes_mutex);
+        busy = syncing;
+        pthread_mutex_unlock(&changes_mutex);
+        return busy;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -26,6 +26,7 @@
 
 #include "nica/util.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,34 +38,39 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "latency.h"
+#include "seekable.h"
+#include "trace.h"
 
 /* 0.75 seconds timeout */
 #define TIMEOUT 75000
 #define TIMEOUT2 1500
 #define TIMEOUT3 500
 
+/* Seconds to wait for the frames covering a read of a partial file */
+#define RANGE_TIMEOUT 120
+
 char *prefix = "src";
 
 time_t deadtime;
 
-void try_to_get(const char *path, int pid, time_t timestamp)
+/**
+ * Connect to the daemon, refusing to talk to ourselves when the daemon is
+ * the process doing the lookup
+ *
+ * @return The connected socket, or -1
+ */
+static int daemon_connect(int pid)
 {
         int sockfd;
         struct sockaddr_un sun;
         int ret;
         socklen_t len;
-        char *command;
-        fd_set rfds;
-        struct timeval tv;
         struct ucred cred;
-        int shorttime = 0;
-        __nc_unused__ size_t wr = -1;
-
-        // printf("Trying to aquire %s\n", path);
 
         sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
         if (sockfd < 0) {
-                return;
+                return -1;
         }
 
         sun.sun_family = AF_UNIX;
@@ -76,7 +82,7 @@ void try_to_get(const char *path, int pid, time_t timestamp)
         if (ret < 0) {
                 printf("Cannot connect to %s: %s\n", SOCKET_PATH, strerror(errno));
                 close(sockfd);
-                return;
+                return -1;
         }
 
         len = sizeof(cred);
@@ -86,15 +92,39 @@ void try_to_get(const char *path, int pid, time_t timestamp)
         if (ret == 0 && cred.pid == pid) {
                 printf("Recursion\n");
                 close(sockfd);
-                return;
+                return -1;
+        }
+
+        return sockfd;
+}
+
+LatencyOutcome try_to_get(const char *path, int pid, time_t timestamp, uint64_t id)
+{
+        int sockfd;
+        int ret;
+        char *command;
+        fd_set rfds;
+        struct timeval tv;
+        int shorttime = 0;
+        __nc_unused__ size_t wr = -1;
+
+        // printf("Trying to aquire %s\n", path);
+
+        TRACE(client__connect, id);
+        sockfd = daemon_connect(pid);
+        if (sockfd < 0) {
+                return timestamp ? LATENCY_HIT : LATENCY_UNREACHABLE;
         }
 
+        /* the request ID follows the timestamp, where older daemons ignore it */
         command = NULL;
-        if (asprintf(&command, "%llu:%s:%s", (unsigned long long)timestamp, prefix, path) < 0) {
+        if (asprintf(&command, "%llu/%llu:%s:%s", (unsigned long long)timestamp,
+                     (unsigned long long)id, prefix, path) < 0) {
                 close(sockfd);
-                return;
+                return timestamp ? LATENCY_HIT : LATENCY_UNREACHABLE;
         }
         wr = write(sockfd, command, strlen(command) + 1);
+        TRACE(client__sent, id);
 
         FD_ZERO(&rfds);
         FD_SET(sockfd, &rfds);
@@ -114,12 +144,106 @@ void try_to_get(const char *path, int pid, time_t timestamp)
         if (!timestamp) {
                 ret = select(sockfd + 1, &rfds, NULL, &rfds, &tv);
         }
+        /* 0 if the daemon didn't answer in time */
+        TRACE(client__reply, id, ret);
         if (ret == 0 && !shorttime) {
                 printf("timeout for %s\n", path);
                 deadtime = time(NULL) + 4;
         }
 
         close(sockfd);
+
+        /* a refresh doesn't wait for the answer */
+        if (timestamp) {
+                return LATENCY_HIT;
+        }
+        return ret > 0 ? LATENCY_DAEMON : LATENCY_TIMEOUT;
+}
+
+/**
+ * Check whether the frames covering @size bytes at @offset of the partial
+ * file open at @fd are present
+ *
+ * @return 1 if they are, 0 if not, or a negative errno
+ */
+static int range_present(int fd, off_t offset, size_t size)
+{
+        SeekTable *table = NULL;
+        PartialHeader header;
+        bool present;
+
+        table = partial_load(fd, &header);
+        if (!table) {
+                return -EIO;
+        }
+        present = partial_range_present(fd, table, (uint64_t)offset, size);
+        seekable_free(table);
+        return present ? 1 : 0;
+}
+
+int ensure_range(const char *path, int pid, off_t offset, size_t size, uint64_t id,
+                 LatencyOutcome *outcome)
+{
+        autofree(char) *map = NULL;
+        autofree(char) *command = NULL;
+        fd_set rfds;
+        struct timeval tv;
+        char reply[3];
+        int map_fd, sockfd;
+        int ret;
+        __nc_unused__ ssize_t wr = -1;
+
+        *outcome = LATENCY_HIT;
+        if (asprintf(&map, "%s/%s/%s%s", CACHE_DIR, PARTIAL_SUBDIR, prefix, path) < 0) {
+                return -ENOMEM;
+        }
+        map_fd = open(map, O_RDONLY);
+        if (map_fd < 0) {
+                /* not a partial file, or complete by now */
+                return 0;
+        }
+
+        ret = range_present(map_fd, offset, size);
+        if (ret != 0) {
+                goto out;
+        }
+
+        if (asprintf(&command, "@%llu+%zu/%llu:%s:%s", (unsigned long long)offset, size,
+                     (unsigned long long)id, prefix, path) < 0) {
+                ret = -ENOMEM;
+                goto out;
+        }
+        sockfd = daemon_connect(pid);
+        if (sockfd < 0) {
+                *outcome = LATENCY_UNREACHABLE;
+                ret = -EIO;
+                goto out;
+        }
+        wr = write(sockfd, command, strlen(command) + 1);
+        TRACE(range__sent, id, offset, size);
+
+        /* unlike a lookup the read can't proceed without the data */
+        FD_ZERO(&rfds);
+        FD_SET(sockfd, &rfds);
+        tv.tv_sec = RANGE_TIMEOUT;
+        tv.tv_usec = 0;
+        *outcome = LATENCY_TIMEOUT;
+        if (select(sockfd + 1, &rfds, NULL, NULL, &tv) > 0) {
+                wr = read(sockfd, reply, sizeof(reply));
+                *outcome = LATENCY_DAEMON;
+        }
+        close(sockfd);
+
+        /* still valid if the map was dropped meanwhile, as it is kept open */
+        ret = range_present(map_fd, offset, size);
+        TRACE(range__reply, id, ret);
+
+out:
+        close(map_fd);
+        if (ret == 0) {
+                return -EIO;
+        }
+        return ret < 0 ? ret : 0;
 }
 
 /*
@@ -0,0 +1,119 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Compressed-at-rest cache
+ *
+ * Extracted .debug files take several times the space of their tarballs,
+ * which is what makes the cache quota evict so much on small disks. With
+ * CLR_DEBUGINFO_COMPRESS set to a zstd level, extracted files of at least
+ * COMPRESS_MIN_SIZE bytes are rewritten as seekable zstd before they are
+ * published and marked with COMPRESSED_MODE. The FUSE layer reports their
+ * uncompressed size and decompresses only the frames a read covers, see
+ * compressed.c, so nothing but the disk usage changes for debuggers.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "nica/util.h"
+#include "seekable.h"
+
+#include "config.h"
+
+/* Smaller files save too little to be worth decompressing on every read */
+#define COMPRESS_MIN_SIZE (64 * 1024)
+
+static int compress_level = 0;
+
+bool compress_init(void)
+{
+        const char *env = getenv("CLR_DEBUGINFO_COMPRESS");
+
+        if (env) {
+                compress_level = atoi(env);
+                if (compress_level < 0) {
+                        compress_level = 0;
+                } else if (compress_level > 19) {
+                        compress_level = 19;
+                }
+        }
+        return compress_level > 0;
+}
+
+bool compress_file(const char *path, struct stat *st)
+{
+        autofree(char) *tmp = NULL;
+        struct timespec times[2] = { st->st_atim, st->st_mtim };
+        struct stat out_st;
+        int in_fd, out_fd;
+        bool ret;
+
+        if (!compress_level || !S_ISREG(st->st_mode) || (st->st_mode & COMPRESSED_MODE) ||
+            st->st_size < COMPRESS_MIN_SIZE) {
+                return false;
+        }
+        if (asprintf(&tmp, "%s.zst", path) < 0) {
+                return false;
+        }
+        in_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) {
+                return false;
+        }
+        out_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00600);
+        if (out_fd < 0) {
+                close(in_fd);
+                return false;
+        }
+
+        ret = seekable_compress(in_fd, out_fd, COMPRESSED_FRAME_SIZE, compress_level) &&
+              fstat(out_fd, &out_st) == 0 && out_st.st_size < st->st_size &&
+              fchmod(out_fd, (st->st_mode & 07777) | COMPRESSED_MODE) == 0 &&
+              futimens(out_fd, times) == 0;
+        close(out_fd);
+        close(in_fd);
+
+        /* incompressible content stays as it is */
+        if (!ret || rename(tmp, path) != 0) {
+                unlink(tmp);
+                return false;
+        }
+        return lstat(path, st) == 0;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
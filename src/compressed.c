@@ -0,0 +1,350 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Reading compressed-at-rest files
+ *
+ * Every getattr() and read() of a compressed file needs its seek table, and
+ * debuggers read the same few frames over and over, a few KiB at a time.
+ * Both the tables and the decompressed frames of recently used files are
+ * therefore kept in small caches, keyed by inode and mtime, so a replaced
+ * file is never served from a stale entry.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "nica/util.h"
+#include "seekable.h"
+
+#define TABLE_CACHE_SIZE 32
+#define FRAME_CACHE_SIZE 32 /* 8 MiB of COMPRESSED_FRAME_SIZE frames */
+
+/* Frames are never larger unless the file is broken */
+#define FRAME_MAX_SIZE (64 * 1024 * 1024)
+
+/**
+ * Identifies one version of a file
+ */
+typedef struct FileKey {
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+        off_t size; /**<Compressed size */
+} FileKey;
+
+typedef struct CachedTable {
+        FileKey key;
+        SeekTable *table; /**<NULL for an unused entry */
+        uint64_t used;    /**<Value of tick when last used */
+} CachedTable;
+
+typedef struct CachedFrame {
+        FileKey key;
+        uint32_t frame;
+        char *data; /**<Decompressed frame, NULL for an unused entry */
+        size_t len;
+        uint64_t used; /**<Value of tick when last used */
+} CachedFrame;
+
+/**
+ * Where a frame is, and what it holds
+ */
+typedef struct FrameRef {
+        uint32_t frame;
+        uint64_t c_offset;
+        uint64_t c_len;
+        uint64_t d_offset;
+        uint64_t d_len;
+} FrameRef;
+
+static pthread_mutex_t compressed_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CachedTable tables[TABLE_CACHE_SIZE];
+static CachedFrame frames[FRAME_CACHE_SIZE];
+static uint64_t tick = 0;
+
+static void file_key(const struct stat *st, FileKey *key)
+{
+        memset(key, 0, sizeof(*key));
+        key->dev = st->st_dev;
+        key->ino = st->st_ino;
+        key->mtime = st->st_mtim;
+        key->size = st->st_size;
+}
+
+static bool file_key_equal(const FileKey *a, const FileKey *b)
+{
+        return a->dev == b->dev && a->ino == b->ino && a->mtime.tv_sec == b->mtime.tv_sec &&
+               a->mtime.tv_nsec == b->mtime.tv_nsec && a->size == b->size;
+}
+
+/**
+ * Find the cached seek table of @key, with compressed_mutex held
+ */
+static SeekTable *table_lookup(const FileKey *key)
+{
+        for (size_t i = 0; i < TABLE_CACHE_SIZE; i++) {
+                if (tables[i].table && file_key_equal(&tables[i].key, key)) {
+                        tables[i].used = ++tick;
+                        return tables[i].table;
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Cache @table for @key in place of the least recently used one, with
+ * compressed_mutex held
+ */
+static void table_insert(const FileKey *key, SeekTable *table)
+{
+        CachedTable *victim = &tables[0];
+
+        for (size_t i = 0; i < TABLE_CACHE_SIZE; i++) {
+                if (!tables[i].table) {
+                        victim = &tables[i];
+                        break;
+                }
+                if (tables[i].used < victim->used) {
+                        victim = &tables[i];
+                }
+        }
+        seekable_free(victim->table);
+        victim->key = *key;
+        victim->table = table;
+        victim->used = ++tick;
+}
+
+/**
+ * Run @fn on the seek table of the file open at @fd with compressed_mutex
+ * held, loading the table first if it isn't cached
+ *
+ * @return What @fn returned, or a negative errno
+ */
+static int with_table(int fd, const struct stat *st, int (*fn)(const SeekTable *, void *),
+                      void *data)
+{
+        SeekTable *table = NULL;
+        FileKey key;
+        int ret;
+
+        file_key(st, &key);
+
+        pthread_mutex_lock(&compressed_mutex);
+        if (table_lookup(&key)) {
+                goto found;
+        }
+        pthread_mutex_unlock(&compressed_mutex);
+
+        /* not under the lock, it takes a couple of reads */
+        table = seekable_read_table(fd);
+        if (!table) {
+                return -EIO;
+        }
+
+        pthread_mutex_lock(&compressed_mutex);
+        if (table_lookup(&key)) {
+                /* another thread was quicker */
+                seekable_free(table);
+        } else {
+                table_insert(&key, table);
+        }
+
+found:
+        ret = fn(table_lookup(&key), data);
+        pthread_mutex_unlock(&compressed_mutex);
+        return ret;
+}
+
+static int table_size(const SeekTable *table, void *data)
+{
+        *(off_t *)data = (off_t)table->d_offsets[table->n_frames];
+        return 0;
+}
+
+int compressed_size(int fd, const struct stat *st, off_t *size)
+{
+        return with_table(fd, st, table_size, size);
+}
+
+/**
+ * Describe the frame holding the uncompressed offset in @data->d_offset
+ *
+ * @return 1 if there is one, 0 at the end of the file
+ */
+static int table_locate(const SeekTable *table, void *data)
+{
+        FrameRef *ref = data;
+        int frame = seekable_find_frame(table, ref->d_offset);
+
+        if (frame < 0) {
+                return 0;
+        }
+        ref->frame = (uint32_t)frame;
+        ref->c_offset = table->c_offsets[frame];
+        ref->c_len = table->c_offsets[frame + 1] - table->c_offsets[frame];
+        ref->d_offset = table->d_offsets[frame];
+        ref->d_len = table->d_offsets[frame + 1] - table->d_offsets[frame];
+        return 1;
+}
+
+/**
+ * Copy up to @size bytes at @offset of the cached @frame of @key to @buf,
+ * with compressed_mutex held
+ *
+ * @return The number of bytes copied, or -1 if the frame isn't cached
+ */
+static ssize_t frame_copy(const FileKey *key, const FrameRef *ref, char *buf, size_t size,
+                          uint64_t offset)
+{
+        for (size_t i = 0; i < FRAME_CACHE_SIZE; i++) {
+                CachedFrame *cached = &frames[i];
+                size_t skip = (size_t)(offset - ref->d_offset);
+                size_t len;
+
+                if (!cached->data || cached->frame != ref->frame ||
+                    !file_key_equal(&cached->key, key)) {
+                        continue;
+                }
+                cached->used = ++tick;
+                len = cached->len - skip;
+                if (len > size) {
+                        len = size;
+                }
+                memcpy(buf, cached->data + skip, len);
+                return (ssize_t)len;
+        }
+        return -1;
+}
+
+/**
+ * Cache the decompressed @data of @frame of @key in place of the least
+ * recently used frame, with compressed_mutex held
+ */
+static void frame_insert(const FileKey *key, uint32_t frame, char *data, size_t len)
+{
+        CachedFrame *victim = &frames[0];
+
+        for (size_t i = 0; i < FRAME_CACHE_SIZE; i++) {
+                if (!frames[i].data) {
+                        victim = &frames[i];
+                        break;
+                }
+                if (frames[i].used < victim->used) {
+                        victim = &frames[i];
+                }
+        }
+        free(victim->data);
+        victim->key = *key;
+        victim->frame = frame;
+        victim->data = data;
+        victim->len = len;
+        victim->used = ++tick;
+}
+
+/**
+ * Read and decompress the frame @ref of the file open at @fd
+ *
+ * @return The newly allocated frame, or NULL on failure
+ */
+static char *frame_load(int fd, const FrameRef *ref)
+{
+        autofree(char) *src = NULL;
+        char *dst = NULL;
+
+        if (ref->c_len > FRAME_MAX_SIZE || ref->d_len > FRAME_MAX_SIZE || ref->d_len == 0) {
+                return NULL;
+        }
+        src = malloc((size_t)ref->c_len);
+        dst = malloc((size_t)ref->d_len);
+        if (!src || !dst ||
+            pread(fd, src, (size_t)ref->c_len, (off_t)ref->c_offset) != (ssize_t)ref->c_len ||
+            seekable_decompress_frame(src, (size_t)ref->c_len, dst, (size_t)ref->d_len) !=
+                (ssize_t)ref->d_len) {
+                free(dst);
+                return NULL;
+        }
+        return dst;
+}
+
+int compressed_read(int fd, const struct stat *st, char *buf, size_t size, off_t offset)
+{
+        size_t done = 0;
+        FileKey key;
+
+        if (offset < 0) {
+                return -EINVAL;
+        }
+        file_key(st, &key);
+
+        while (done < size) {
+                uint64_t pos = (uint64_t)offset + done;
+                FrameRef ref = { .d_offset = pos };
+                ssize_t copied;
+                char *data;
+                int ret;
+
+                ret = with_table(fd, st, table_locate, &ref);
+                if (ret < 0) {
+                        return done ? (int)done : ret;
+                }
+                if (ret == 0) {
+                        break;
+                }
+
+                pthread_mutex_lock(&compressed_mutex);
+                copied = frame_copy(&key, &ref, buf + done, size - done, pos);
+                pthread_mutex_unlock(&compressed_mutex);
+                if (copied >= 0) {
+                        done += (size_t)copied;
+                        continue;
+                }
+
+                /* decompressed without the lock, so other reads go on meanwhile */
+                data = frame_load(fd, &ref);
+                if (!data) {
+                        return done ? (int)done : -EIO;
+                }
+                pthread_mutex_lock(&compressed_mutex);
+                frame_insert(&key, ref.frame, data, (size_t)ref.d_len);
+                copied = frame_copy(&key, &ref, buf + done, size - done, pos);
+                pthread_mutex_unlock(&compressed_mutex);
+                done += (size_t)copied;
+        }
+        return (int)done;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,318 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * clr_debug_ctl -- send control commands to clr_debug_daemon
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_trace.h"
+#include "nica/util.h"
+
+#include "config.h"
+
+/**
+ * Where the fuse mounts put each prefix of the cache
+ */
+static const struct {
+        const char *dir;
+        const char *prefix;
+} mounts[] = {
+        { "/usr/lib/debug", "lib" },
+        { "/usr/src/debug", "src" },
+};
+
+static void usage(const char *name)
+{
+        fprintf(stderr,
+                "Usage: %s COMMAND [PATH...]\n"
+                "Commands:\n"
+                "  pin PATH...    Keep PATH, a file or directory below /usr/lib/debug or\n"
+                "                 /usr/src/debug, cached and up to date\n"
+                "  unpin PATH...  Allow PATH to be evicted again\n"
+                "  pins           List the pinned paths\n"
+                "  stats          Print the daemon's statistics, in the Prometheus text format\n"
+                "  access-log FILE...\n"
+                "                 Print access traces written with CLR_DEBUGINFO_ACCESS_TRACE\n",
+                name);
+}
+
+/**
+ * Send @command for @path below @prefix and print the reply if @print
+ *
+ * @return true if the daemon accepted the command
+ */
+static bool send_command(const char *command, const char *prefix, const char *path, bool print)
+{
+        autofree(char) *request = NULL;
+        autofree(char) *reply = NULL;
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        size_t len = 0, alloc = 0;
+        ssize_t n;
+        int sockfd;
+
+        if (asprintf(&request, "!%s:%s:%s", command, prefix, path) < 0) {
+                return false;
+        }
+
+        sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd < 0) {
+                return false;
+        }
+        strcpy(sun.sun_path, SOCKET_PATH);
+        if (connect(sockfd,
+                    (struct sockaddr *)&sun,
+                    offsetof(struct sockaddr_un, sun_path) + strlen(SOCKET_PATH) + 1) < 0) {
+                fprintf(stderr, "Cannot connect to %s: %s\n", SOCKET_PATH, strerror(errno));
+                close(sockfd);
+                return false;
+        }
+        if (write(sockfd, request, strlen(request) + 1) != (ssize_t)strlen(request) + 1) {
+                close(sockfd);
+                return false;
+        }
+
+        /* the reply is NUL terminated, and followed by the daemon hanging up */
+        do {
+                if (len + 4096 > alloc) {
+                        char *grown = realloc(reply, alloc + 4096);
+                        if (!grown) {
+                                close(sockfd);
+                                return false;
+                        }
+                        reply = grown;
+                        alloc += 4096;
+                }
+                n = read(sockfd, reply + len, alloc - len - 1);
+                if (n > 0) {
+                        len += (size_t)n;
+                }
+        } while (n > 0 || (n < 0 && errno == EINTR));
+        close(sockfd);
+
+        if (!reply || len == 0) {
+                fprintf(stderr, "No reply from the daemon\n");
+                return false;
+        }
+        reply[len] = '\0';
+        if (print) {
+                fputs(reply, stdout);
+                return true;
+        }
+        if (strcmp(reply, "ok") != 0) {
+                fprintf(stderr, "%s%s: %s\n", prefix, path, reply);
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Copy the statistics served on STATS_SOCKET_PATH to stdout
+ *
+ * @return true if the daemon answered
+ */
+static bool print_stats(void)
+{
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        char buf[4096];
+        bool ret = false;
+        ssize_t n;
+        int sockfd;
+
+        sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd < 0) {
+                return false;
+        }
+        strcpy(sun.sun_path, STATS_SOCKET_PATH);
+        if (connect(sockfd,
+                    (struct sockaddr *)&sun,
+                    offsetof(struct sockaddr_un, sun_path) + strlen(STATS_SOCKET_PATH) + 1) < 0) {
+                fprintf(stderr, "Cannot connect to %s: %s\n", STATS_SOCKET_PATH, strerror(errno));
+                close(sockfd);
+                return false;
+        }
+
+        /* everything there is, then the daemon hangs up */
+        while ((n = read(sockfd, buf, sizeof(buf))) != 0) {
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        break;
+                }
+                fwrite(buf, 1, (size_t)n, stdout);
+                ret = true;
+        }
+        close(sockfd);
+
+        if (!ret) {
+                fprintf(stderr, "No reply from the daemon\n");
+        }
+        return ret;
+}
+
+/**
+ * Print one operation of an access trace, where @data points to the mount
+ * prefix of the trace
+ */
+static bool print_access(const AccessRecord *record, void *data)
+{
+        const char *prefix = *(char **)data;
+        const char *dir = prefix;
+        time_t sec = (time_t)(record->time_ns / 1000000000ULL);
+        char when[32];
+        struct tm tm;
+
+        for (size_t i = 0; i < ARRAY_SIZE(mounts); i++) {
+                if (strcmp(prefix, mounts[i].prefix) == 0) {
+                        dir = mounts[i].dir;
+                }
+        }
+        localtime_r(&sec, &tm);
+        strftime(when, sizeof(when), "%F %T", &tm);
+        printf("%s.%06llu %-8s %7d %-15s %s%s", when,
+               (unsigned long long)(record->time_ns % 1000000000ULL / 1000),
+               access_op_name(record->op), record->pid, record->comm, dir, record->path);
+        if (record->op == ACCESS_READ) {
+                printf(" %llu+%llu", (unsigned long long)record->offset,
+                       (unsigned long long)record->size);
+        }
+        printf(" = %d (%llu us)\n", record->result, (unsigned long long)record->duration_us);
+        return true;
+}
+
+/**
+ * Print the access trace in @file
+ *
+ * @return true if it could be read to the end
+ */
+static bool print_access_log(const char *file)
+{
+        autofree(char) *prefix = NULL;
+        bool ret;
+        FILE *f;
+
+        f = fopen(file, "re");
+        if (!f) {
+                fprintf(stderr, "Cannot open %s: %s\n", file, strerror(errno));
+                return false;
+        }
+        /* the prefix is set before the first record is passed on */
+        ret = access_trace_parse(f, &prefix, print_access, &prefix);
+        fclose(f);
+        if (!ret) {
+                fprintf(stderr, "%s: not an access trace, or cut short\n", file);
+        }
+        return ret;
+}
+
+/**
+ * Split @arg, a path below one of the mounts, into its prefix and the
+ * path below the mount
+ */
+static bool split_path(const char *arg, const char **prefix, const char **path)
+{
+        for (size_t i = 0; i < ARRAY_SIZE(mounts); i++) {
+                size_t len = strlen(mounts[i].dir);
+
+                if (strncmp(arg, mounts[i].dir, len) != 0) {
+                        continue;
+                }
+                if (arg[len] == '\0') {
+                        *path = "/";
+                } else if (arg[len] == '/') {
+                        *path = arg + len;
+                } else {
+                        continue;
+                }
+                *prefix = mounts[i].prefix;
+                return true;
+        }
+        return false;
+}
+
+int main(int argc, char **argv)
+{
+        const char *command;
+        int ret = EXIT_SUCCESS;
+
+        if (argc < 2) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+        command = argv[1];
+
+        if (strcmp(command, "stats") == 0 && argc == 2) {
+                return print_stats() ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (strcmp(command, "access-log") == 0 && argc > 2) {
+                for (int i = 2; i < argc; i++) {
+                        if (!print_access_log(argv[i])) {
+                                ret = EXIT_FAILURE;
+                        }
+                }
+                return ret;
+        }
+        if (strcmp(command, "pins") == 0 && argc == 2) {
+                return send_command(command, "lib", "/", true) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if ((strcmp(command, "pin") != 0 && strcmp(command, "unpin") != 0) || argc < 3) {
+                usage(argv[0]);
+                return strcmp(command, "-h") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        for (int i = 2; i < argc; i++) {
+                const char *prefix, *path;
+
+                if (!split_path(argv[i], &prefix, &path)) {
+                        fprintf(stderr, "%s is not below /usr/lib/debug or /usr/src/debug\n",
+                                argv[i]);
+                        ret = EXIT_FAILURE;
+                        continue;
+                }
+                if (!send_command(command, prefix, path, false)) {
+                        ret = EXIT_FAILURE;
+                }
+        }
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
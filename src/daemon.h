@@ -0,0 +1,491 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "config.h"
+
+/*
+ * Internal interfaces shared between the modules of clr_debug_daemon
+ */
+
+/* ID of the request the current thread works on for tracing, 0 when in
+ * the background, see trace.h */
+extern _Thread_local uint64_t trace_request;
+
+/* Mirror list, see configure_urls() */
+extern char **urls;
+extern int urls_size;
+extern int urlcounter;
+
+/* Interrupted downloads are kept below CACHE_DIR/STAGING_SUBDIR */
+#define STAGING_SUBDIR "staging"
+
+/* The persistent pin list lives below CACHE_DIR/PINS_SUBDIR */
+#define PINS_SUBDIR "pins"
+
+/* The validator index lives below CACHE_DIR/INDEX_SUBDIR */
+#define INDEX_SUBDIR "index"
+
+/* Deduplicated file contents live below CACHE_DIR/CAS_SUBDIR */
+#define CAS_SUBDIR "cas"
+
+/**
+ * Find the part of @url that follows the mirror it is on, which is the
+ * same on every mirror
+ *
+ * @return A pointer into @url, or NULL if @url isn't on any mirror
+ */
+const char *url_relative(const char *url);
+
+/**
+ * Fetch the tarball at @url and extract it below CACHE_DIR/@prefix
+ *
+ * @param path The object @url is for, or NULL when it doesn't name a
+ * single object. Objects larger than LAZY_MIN_SIZE are then served lazily.
+ * @param timestamp If non-zero, only fetch when modified since this time
+ *
+ * @return The HTTP response code, or one of the internal 3xx/418 codes
+ */
+int curl_get_file(const char *url, const char *prefix, const char *path, time_t timestamp);
+
+/**
+ * Fetch the byte range @range ("first-last", or "-suffix") of the object
+ * at @url into memory
+ *
+ * @note On a 200 or 206 response *data is allocated, NUL terminated, and
+ * must be freed by the caller. A 200 response holds the whole object.
+ *
+ * @param range The range to request, or NULL for the whole object
+ * @param if_range If non-zero, only honour @range if the object wasn't
+ * modified since this time
+ * @param filetime If non-NULL, receives the Last-Modified time or 0
+ *
+ * @return The HTTP response code, or 418 on local failure
+ */
+int curl_get_range(const char *url, const char *range, time_t if_range, char **data, size_t *len,
+                   time_t *filetime);
+
+/**
+ * Fetch a small object at @url into memory
+ *
+ * @note On a 200 response *data is allocated, NUL terminated, and must be
+ * freed by the caller
+ *
+ * @param filetime If non-NULL, receives the Last-Modified time or 0
+ *
+ * @return The HTTP response code, or 418 on local failure, including
+ * objects too large to hold in memory
+ */
+int curl_get_buffer(const char *url, char **data, size_t *len, time_t *filetime);
+
+/**
+ * Format @t as an HTTP date into @buf
+ */
+void format_http_date(time_t t, char *buf, size_t len);
+
+/**
+ * Run tar with @args on the archive @filename, or on the @len bytes at
+ * @data fed through a pipe if @data is non-NULL
+ *
+ * @return true if tar succeeded
+ */
+bool run_tar(const char *args, const char *filename, const char *data, size_t len);
+
+/**
+ * Validate and extract the tarball @filename below CACHE_DIR/@prefix
+ *
+ * @param concatenated Whether @filename is several archives back to back
+ *
+ * @return 200 on success, otherwise 418
+ */
+int extract_tarball(const char *filename, const char *prefix, bool concatenated);
+
+/**
+ * Validate and extract the tarball of @len bytes at @data below
+ * CACHE_DIR/@prefix
+ *
+ * @return 200 on success, otherwise 418
+ */
+int extract_buffer(const char *data, size_t len, const char *prefix);
+
+/**
+ * Fetch members of the pack file of directory @dir below @prefix, and
+ * extract them in one step
+ *
+ * @param names Names of the members to fetch, or NULL for all of them
+ * @param n_names Number of entries in @names
+ *
+ * @return 200 on success, otherwise an HTTP response code or 418
+ */
+int pack_fetch(const char *prefix, const char *dir, char **names, int n_names);
+
+/* Objects at least this large are fetched with parallel range requests */
+#define PARALLEL_MIN_SIZE (32 * 1024 * 1024)
+
+/**
+ * Configure parallel range downloads from the CLR_DEBUGINFO_PARALLEL and
+ * CLR_DEBUGINFO_PARALLEL_MIRRORS environment variables
+ *
+ * @return The number of ranges large objects are split into
+ */
+int parallel_init(void);
+
+/**
+ * Determine whether an object of @length bytes should be fetched with
+ * parallel range requests
+ */
+bool parallel_wanted(off_t length);
+
+/**
+ * Fetch the @length bytes of the object at @url with parallel range
+ * requests, writing each at its offset in the file open at @fd
+ *
+ * @param filetime Last-Modified of the object, sent as If-Range so all
+ * ranges come from the same version
+ *
+ * @return true if every range was received completely
+ */
+bool parallel_fetch(const char *url, int fd, off_t length, time_t filetime);
+
+/**
+ * Move the extracted file @src, described by @st, to @dst in the cache,
+ * as a hardlink to an identical stored copy if there is one, see cas.c
+ *
+ * @return false if @dst could not be published
+ */
+bool cas_publish(const char *src, const char *dst, const struct stat *st);
+
+/**
+ * Remove the stored copies no cached path links to anymore
+ */
+void cas_prune(void);
+
+/**
+ * Set up the directory-sibling prefetcher, if enabled by the
+ * CLR_DEBUGINFO_PREFETCH environment variable
+ *
+ * @return true if the prefetcher is active
+ */
+bool prefetch_init(void);
+
+/**
+ * Record a lookup of @path below @prefix, possibly queueing a prefetch
+ * of the remaining entries in the same directory
+ */
+void prefetch_note_hit(const char *prefix, const char *path);
+
+/**
+ * Determine whether directories are being prefetched
+ */
+bool prefetch_busy(void);
+
+/**
+ * Determine how many directories are waiting to be prefetched
+ */
+int prefetch_queued(void);
+
+/*
+ * Live statistics, see stats.c
+ */
+
+typedef enum {
+        STATS_LOOKUP,  /**<Object lookup from the fuse layer */
+        STATS_RANGE,   /**<Byte range of a partial file */
+        STATS_CONTROL, /**<Command from clr_debug_ctl */
+        STATS_N_CLASSES
+} StatsClass;
+
+typedef enum {
+        STATS_DOWNLOADED, /**<Fetched and extracted */
+        STATS_CURRENT,    /**<The cached copy is up to date */
+        STATS_MISSING,    /**<The server has no such object */
+        STATS_FAILED,
+        STATS_N_RESULTS
+} StatsResult;
+
+/**
+ * Start counting
+ */
+void stats_init(void);
+
+/**
+ * Count a request of @class answered in @seconds
+ */
+void stats_request(StatsClass class, double seconds);
+
+/**
+ * Count a lookup that curl_get_file() answered with @ret
+ */
+void stats_lookup(int ret);
+
+/**
+ * Count a lookup answered from the validator index
+ */
+void stats_index_answer(void);
+
+/**
+ * Count a response from @mirror, see url_mirror()
+ *
+ * @param failed Whether the transfer failed, e.g. timed out
+ * @param bytes Size of the body received
+ */
+void stats_response(int mirror, long code, bool failed, uint64_t bytes);
+
+/**
+ * Count an extraction that took @seconds
+ */
+void stats_extract(double seconds);
+
+/**
+ * Track an object download beginning or ending
+ */
+void stats_download(bool begin);
+
+/**
+ * Count a connection refused for being over MAX_CONNECTIONS
+ */
+void stats_rejected(void);
+
+/**
+ * Describe the statistics in the Prometheus text format
+ *
+ * @param connections Number of requests being answered
+ *
+ * @return A newly allocated string, or NULL on failure
+ */
+char *stats_format(int connections);
+
+/**
+ * Write the statistics to the client @fd
+ */
+void stats_serve(int fd, int connections);
+
+/**
+ * Start tracking the cache against the quota set by the
+ * CLR_DEBUGINFO_CACHE_QUOTA environment variable, evicting the least
+ * recently used objects in the background
+ *
+ * @return The quota in bytes, or 0 if eviction is disabled
+ */
+unsigned long long cache_init(void);
+
+/**
+ * Record a lookup of @path below @prefix, making it the most recently
+ * used object
+ */
+void cache_note_access(const char *prefix, const char *path);
+
+/**
+ * Map the validator index, see index.c
+ *
+ * @return false if the index is unavailable, and every lookup goes out to
+ * the server
+ */
+bool index_init(void);
+
+/**
+ * Decide whether the lookup of @path below @prefix needs to go out to the
+ * server. When it does, *@timestamp is replaced with the Last-Modified
+ * recorded for the cached file, and its ETag, if any, is copied to @etag
+ * of @len bytes.
+ *
+ * @return 0 if a request is due, otherwise the response the server gave
+ * recently enough: 304 if the cached file is current, 404 if there is none
+ */
+int index_check(const char *prefix, const char *path, time_t *timestamp, char *etag, size_t len);
+
+/**
+ * Record the @status the server returned for @path below @prefix, along
+ * with the validators and @size of the object and the @mirror it came from
+ */
+void index_record(const char *prefix, const char *path, int status, time_t modified,
+                  const char *etag, uint64_t size, int mirror);
+
+/**
+ * Get the serial number of the last change log applied to the index
+ *
+ * @param synced Receives when it was applied
+ *
+ * @return The serial, or 0 if none was applied yet
+ */
+uint64_t index_serial(time_t *synced);
+
+/**
+ * Record that the index reflects the change log @serial as of @synced
+ */
+void index_set_serial(uint64_t serial, time_t synced);
+
+/**
+ * Mark every path in the index validated at or after @since as validated
+ * @now, leaving out those invalidated
+ */
+void index_refresh_all(time_t since, time_t now);
+
+/**
+ * Make the next lookup of every path in the index go out to the server
+ */
+void index_invalidate_all(void);
+
+/**
+ * Make the next lookup of @key, e.g. "lib/usr/lib64/libc.so.6.debug", go
+ * out to the server
+ */
+void index_invalidate(const char *key);
+
+/**
+ * Determine whether a delta against the cached copy of @path below @prefix
+ * is worth trying, see delta.c
+ *
+ * @return Last-Modified of the cached version, if the change logs marked
+ * it as changed, else 0
+ */
+time_t index_delta_base(const char *prefix, const char *path);
+
+/**
+ * Start following the change logs published on the server, see changes.c
+ */
+void changes_init(void);
+
+/**
+ * Determine whether change logs are being fetched and applied
+ */
+bool changes_busy(void);
+
+/**
+ * Load the pinned objects from CLR_DEBUGINFO_PINS and the persistent pin
+ * list, and start fetching them in the background
+ *
+ * @return The number of pins
+ */
+int pins_init(void);
+
+/**
+ * Determine whether @key, e.g. "lib/usr/lib64/libc.so.6.debug", is pinned
+ * itself or lies below a pinned directory
+ */
+bool pins_match(const char *key);
+
+/**
+ * Pin @key persistently and fetch it in the background
+ *
+ * @return false if @key is invalid or the list could not be saved
+ */
+bool pins_add(const char *key);
+
+/**
+ * Remove the persistent pin @key
+ *
+ * @return false if @key was not pinned or the list could not be saved
+ */
+bool pins_remove(const char *key);
+
+/**
+ * Describe the pins, one per line
+ *
+ * @return A newly allocated string, or NULL on failure
+ */
+char *pins_list(void);
+
+/**
+ * Determine whether pinned objects are being fetched
+ */
+bool pins_busy(void);
+
+#ifdef HAVE_ZSTD
+/* Objects at least this large are fetched lazily, see lazy.c */
+#define LAZY_MIN_SIZE (64 * 1024 * 1024)
+
+/**
+ * Make @path below @prefix available as a partial file, backed by its
+ * seekable zstd version on the server
+ *
+ * @return 200 on success, otherwise an HTTP response code or 418
+ */
+int lazy_open(const char *prefix, const char *path);
+
+/**
+ * Make sure @size bytes at @offset of the partial file @path below @prefix
+ * are present. Complete files are always satisfied.
+ *
+ * @return 200 on success, otherwise an HTTP response code or 418
+ */
+int lazy_fetch_range(const char *prefix, const char *path, uint64_t offset, uint64_t size);
+
+/**
+ * Start the thread filling in partial files, and queue those left
+ * unfinished by a previous run
+ *
+ * @return true if the thread was started
+ */
+bool lazy_init(void);
+
+/**
+ * Determine whether partial files are still being filled in
+ */
+bool lazy_busy(void);
+
+/**
+ * Bring the cached copy of @path below @prefix, the version of the tarball
+ * at @url last modified at @base_time, up to date from a delta
+ *
+ * @param filetime Receives the Last-Modified time of the new version
+ *
+ * @return 200 on success, otherwise an HTTP response code or 418
+ */
+int delta_fetch(const char *url, const char *prefix, const char *path, time_t base_time,
+                time_t *filetime);
+
+/**
+ * Read the compression level for extracted files from the environment
+ *
+ * @return true if extracted files are to be stored compressed
+ */
+bool compress_init(void);
+
+/**
+ * Rewrite the extracted file @path with attributes @st as seekable zstd,
+ * if compression is enabled and it is worth it, and update @st
+ *
+ * @return true if @path is now compressed
+ */
+bool compress_file(const char *path, struct stat *st);
+#endif
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,183 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Delta updates
+ *
+ * Most .debug files change only slightly between releases. When asked to,
+ * clr_debug_prepare publishes <path>.delta-<time> next to a regenerated
+ * tarball: the new file compressed with zstd --patch-from against the
+ * previous version, whose tarball had Last-Modified <time>, and carrying
+ * the new tarball's mtime itself. Objects the change logs mark as changed
+ * are first tried as a delta against the cached copy, identified by the
+ * Last-Modified recorded in the validator index. The frame checksum
+ * rejects a delta applied to anything but its exact base, in which case
+ * the whole tarball is downloaded as before.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zstd.h>
+
+#include "daemon.h"
+#include "nica/util.h"
+#include "seekable.h"
+
+#include "config.h"
+
+/* Larger results are left to a full download */
+#define DELTA_MAX_SIZE (4ULL * 1024 * 1024 * 1024)
+
+/* Patches of large files reach back further than the decoder allows by
+ * default; this is ZSTD_WINDOWLOG_MAX, which is not part of the stable API */
+#define DELTA_WINDOW_LOG 31
+
+/**
+ * Reconstruct the new version of the @base_size bytes at @base from the
+ * @delta_len bytes of @delta, into @fd
+ */
+static bool delta_apply(const void *base, size_t base_size, const char *delta, size_t delta_len,
+                        int fd)
+{
+        unsigned long long size = ZSTD_getFrameContentSize(delta, delta_len);
+        ZSTD_DCtx *dctx = NULL;
+        void *out = NULL;
+        size_t ret;
+
+        if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+            size == 0 || size > DELTA_MAX_SIZE) {
+                return false;
+        }
+        if (ftruncate(fd, (off_t)size) != 0) {
+                return false;
+        }
+        out = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (out == MAP_FAILED) {
+                return false;
+        }
+
+        dctx = ZSTD_createDCtx();
+        if (!dctx) {
+                munmap(out, (size_t)size);
+                return false;
+        }
+        ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, DELTA_WINDOW_LOG);
+        ret = ZSTD_DCtx_refPrefix(dctx, base, base_size);
+        if (!ZSTD_isError(ret)) {
+                ret = ZSTD_decompressDCtx(dctx, out, (size_t)size, delta, delta_len);
+        }
+        ZSTD_freeDCtx(dctx);
+        munmap(out, (size_t)size);
+
+        return !ZSTD_isError(ret) && ret == size;
+}
+
+int delta_fetch(const char *url, const char *prefix, const char *path, time_t base_time,
+                time_t *filetime)
+{
+        autofree(char) *delta_url = NULL;
+        autofree(char) *delta = NULL;
+        autofree(char) *local = NULL;
+        autofree(char) *staging = NULL;
+        size_t len = 0, url_len = strlen(url);
+        void *base = MAP_FAILED;
+        struct stat st;
+        int base_fd = -1, fd = -1;
+        int ret;
+
+        if (url_len < 4 || strcmp(url + url_len - 4, ".tar") != 0 ||
+            asprintf(&delta_url, "%.*s.delta-%lld", (int)(url_len - 4), url,
+                     (long long)base_time) < 0 ||
+            asprintf(&local, "%s/%s%s", CACHE_DIR, prefix, path) < 0 ||
+            asprintf(&staging, "%s/%s/.delta-XXXXXX", CACHE_DIR, STAGING_SUBDIR) < 0) {
+                return 418;
+        }
+
+        /* a compressed copy is no base, the full download is stored compressed again */
+        base_fd = open(local, O_RDONLY | O_CLOEXEC);
+        if (base_fd < 0 || fstat(base_fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+            (st.st_mode & COMPRESSED_MODE)) {
+                ret = 418;
+                goto out;
+        }
+
+        ret = curl_get_buffer(delta_url, &delta, &len, filetime);
+        if (ret != 200) {
+                goto out;
+        }
+        ret = 418;
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, base_fd, 0);
+        if (base == MAP_FAILED) {
+                goto out;
+        }
+        fd = mkstemp(staging);
+        if (fd < 0) {
+                goto out;
+        }
+        if (!delta_apply(base, (size_t)st.st_size, delta, len, fd)) {
+                fprintf(stderr, "Delta %s doesn't apply, downloading in full\n", delta_url);
+                unlink(staging);
+                goto out;
+        }
+
+        if (*filetime > 0) {
+                struct timespec times[2] = { { .tv_sec = *filetime }, { .tv_sec = *filetime } };
+
+                futimens(fd, times);
+        }
+        /* replaced in one go, like extracted files are */
+        if (fchmod(fd, st.st_mode & 07777) != 0 || rename(staging, local) != 0) {
+                unlink(staging);
+                goto out;
+        }
+        ret = 200;
+
+out:
+        if (base != MAP_FAILED) {
+                munmap(base, (size_t)st.st_size);
+        }
+        if (base_fd >= 0) {
+                close(base_fd);
+        }
+        if (fd >= 0) {
+                close(fd);
+        }
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -50,9 +50,16 @@ Original copyright notice follows:
 #endif
 
 #include "nica/files.h"
+#include "access_trace.h"
+#include "latency.h"
 #include "nica/util.h"
+#include "seekable.h"
+#include "trace.h"
 
-extern void try_to_get(const char *path, int pid, time_t timestamp);
+extern LatencyOutcome try_to_get(const char *path, int pid, time_t timestamp, uint64_t id);
+extern int ensure_range(const char *path, int pid, off_t offset, size_t size, uint64_t id,
+                        LatencyOutcome *outcome);
+extern char *prefix;
 
 __attribute__((always_inline)) static inline char *xmp_make_dotpath(const char *path)
 {
@@ -63,11 +70,64 @@ __attribute__((always_inline)) static inline char *xmp_make_dotpath(const char *
         return newp;
 }
 
+#ifdef HAVE_ZSTD
+/**
+ * Present a compressed-at-rest file at @newpath with attributes @stbuf as
+ * the file it holds
+ *
+ * @return 0 on success, or a negative errno
+ */
+static int xmp_uncompressed_attr(const char *newpath, struct stat *stbuf)
+{
+        off_t size;
+        int fd;
+        int res;
+
+        fd = open(newpath, O_RDONLY);
+        if (fd == -1) {
+                return -errno;
+        }
+        res = compressed_size(fd, stbuf, &size);
+        close(fd);
+        if (res < 0) {
+                return res;
+        }
+
+        /* st_blocks still tells what it takes on disk */
+        stbuf->st_size = size;
+        stbuf->st_mode &= ~COMPRESSED_MODE;
+        return 0;
+}
+#endif
+
+/**
+ * Attributes of the LATENCY_PATH virtual file, which has no size until it
+ * is read
+ */
+static void xmp_latency_attr(struct stat *stbuf)
+{
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_mtime = time(NULL);
+        stbuf->st_atime = stbuf->st_ctime = stbuf->st_mtime;
+}
+
 static int xmp_getattr(const char *path, struct stat *stbuf)
 {
+        LatencyOutcome outcome;
+        uint64_t start;
+        uint64_t id;
+        int pid;
         int res;
         autofree(char) *newpath = NULL;
 
+        if (strcmp(path, LATENCY_PATH) == 0) {
+                xmp_latency_attr(stbuf);
+                return 0;
+        }
+
+        start = latency_start();
         if ((newpath = xmp_make_dotpath(path)) == NULL) {
                 return -ENOMEM;
         }
@@ -89,15 +149,26 @@ static int xmp_getattr(const char *path, struct stat *stbuf)
          * get the file. if the st_mtime is set, this is just an async refresh, otherwise it's
          * a synchronous request.
          */
-        try_to_get(path, fuse_get_context()->pid, stbuf->st_mtime);
+        id = trace_new_id();
+        pid = fuse_get_context()->pid;
+        TRACE(getattr__start, id, path);
+        outcome = try_to_get(path, pid, stbuf->st_mtime, id);
 
         res = lstat(newpath, stbuf);
-
         if (res == -1) {
-                return -errno;
+                res = -errno;
         }
+        TRACE(getattr__done, id, res);
+        latency_record(LATENCY_GETATTR, outcome, start);
 
-        return 0;
+#ifdef HAVE_ZSTD
+        if (res == 0 && S_ISREG(stbuf->st_mode) && (stbuf->st_mode & COMPRESSED_MODE)) {
+                res = xmp_uncompressed_attr(newpath, stbuf);
+        }
+#endif
+
+        access_trace(ACCESS_GETATTR, path, pid, start, 0, 0, res);
+        return res;
 }
 
 static int xmp_access(const char *path, int mask)
@@ -105,6 +176,10 @@ static int xmp_access(const char *path, int mask)
         int res;
         autofree(char) *newpath = NULL;
 
+        if (strcmp(path, LATENCY_PATH) == 0) {
+                return mask & (W_OK | X_OK) ? -EACCES : 0;
+        }
+
         if ((newpath = xmp_make_dotpath(path)) == NULL) {
                 return -ENOMEM;
         }
@@ -119,6 +194,7 @@ static int xmp_access(const char *path, int mask)
 
 static int xmp_readlink(const char *path, char *buf, size_t size)
 {
+        uint64_t start = latency_start();
         int res;
         autofree(char) *newpath = NULL;
 
@@ -128,10 +204,13 @@ static int xmp_readlink(const char *path, char *buf, size_t size)
 
         res = readlink(newpath, buf, size - 1);
         if (res == -1) {
-                return -errno;
+                res = -errno;
+                access_trace(ACCESS_READLINK, path, fuse_get_context()->pid, start, 0, 0, res);
+                return res;
         }
 
         buf[res] = '\0';
+        access_trace(ACCESS_READLINK, path, fuse_get_context()->pid, start, 0, 0, 0);
         return 0;
 }
 
@@ -384,45 +463,110 @@ static int xmp_utimens(const char *path, const struct timespec ts[2])
 
 static int xmp_open(const char *path, struct fuse_file_info *fi)
 {
+        uint64_t start = latency_start();
         int res;
         autofree(char) *newpath = NULL;
 
+        if (strcmp(path, LATENCY_PATH) == 0) {
+                char *text;
+
+                if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+                        return -EACCES;
+                }
+                /* a snapshot per open, read past its unknown size */
+                text = latency_format(prefix);
+                if (!text) {
+                        return -ENOMEM;
+                }
+                fi->fh = (uint64_t)(uintptr_t)text;
+                fi->direct_io = 1;
+                return 0;
+        }
+
         if ((newpath = xmp_make_dotpath(path)) == NULL) {
                 return -ENOMEM;
         }
 
         res = open(newpath, fi->flags);
         if (res == -1) {
-                return -errno;
+                res = -errno;
+                access_trace(ACCESS_OPEN, path, fuse_get_context()->pid, start, 0, 0, res);
+                return res;
         }
 
         close(res);
+        latency_record(LATENCY_OPEN, LATENCY_HIT, start);
+        access_trace(ACCESS_OPEN, path, fuse_get_context()->pid, start, 0, 0, 0);
         return 0;
 }
 
+/**
+ * Read the snapshot of LATENCY_PATH that xmp_open() made
+ */
+static int xmp_latency_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+        const char *text = (const char *)(uintptr_t)fi->fh;
+        size_t len = strlen(text);
+
+        if (offset < 0 || (size_t)offset >= len) {
+                return 0;
+        }
+        if (size > len - (size_t)offset) {
+                size = len - (size_t)offset;
+        }
+        memcpy(buf, text + offset, size);
+        return (int)size;
+}
+
 static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
                     struct fuse_file_info *fi)
 {
+        uint64_t start = latency_start();
+        int pid = fuse_get_context()->pid;
+        LatencyOutcome outcome;
         int fd;
         int res;
         autofree(char) *newpath = NULL;
 
+        if (strcmp(path, LATENCY_PATH) == 0) {
+                return xmp_latency_read(buf, size, offset, fi);
+        }
+
         if ((newpath = xmp_make_dotpath(path)) == NULL) {
                 return -ENOMEM;
         }
 
-        (void)fi;
         fd = open(newpath, O_RDONLY);
         if (fd == -1) {
                 return -errno;
         }
 
-        res = pread(fd, buf, size, offset);
-        if (res == -1) {
-                res = -errno;
+#ifdef HAVE_ZSTD
+        {
+                struct stat st;
+
+                if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & COMPRESSED_MODE)) {
+                        res = compressed_read(fd, &st, buf, size, offset);
+                        close(fd);
+                        latency_record(LATENCY_READ, LATENCY_HIT, start);
+                        access_trace(ACCESS_READ, path, pid, start, offset, size, res);
+                        return res;
+                }
+        }
+#endif
+
+        /* huge objects may still be partly missing */
+        res = ensure_range(path, pid, offset, size, trace_new_id(), &outcome);
+        if (res == 0) {
+                res = pread(fd, buf, size, offset);
+                if (res == -1) {
+                        res = -errno;
+                }
         }
 
         close(fd);
+        latency_record(LATENCY_READ, outcome, start);
+        access_trace(ACCESS_READ, path, pid, start, offset, size, res);
         return res;
 }
 
@@ -471,11 +615,10 @@ static int xmp_statfs(const char *path, struct statvfs *stbuf)
 
 static int xmp_release(const char *path, struct fuse_file_info *fi)
 {
-        /* Just a stub.	 This method is optional and can safely be left
-           unimplemented */
-
-        (void)path;
-        (void)fi;
+        /* Only the LATENCY_PATH snapshot holds anything to release */
+        if (strcmp(path, LATENCY_PATH) == 0) {
+                free((char *)(uintptr_t)fi->fh);
+        }
         return 0;
 }
 
@@ -594,8 +737,14 @@ static void *xmp_init(__nc_unused__ struct fuse_conn_info *conn)
         return NULL;
 }
 
+static void xmp_destroy(__nc_unused__ void *private_data)
+{
+        access_trace_close();
+}
+
 static struct fuse_operations xmp_oper = {
         .init = xmp_init,
+        .destroy = xmp_destroy,
         .getattr = xmp_getattr,
         .access = xmp_access,
         .readlink = xmp_readlink,
@@ -630,8 +779,6 @@ static struct fuse_operations xmp_oper = {
 #endif
 };
 
-extern char *prefix;
-
 int main(__nc_unused__ int argc, __nc_unused__ char *argv[])
 {
         char *fake_argv[20];
@@ -668,6 +815,7 @@ int main(__nc_unused__ int argc, __nc_unused__ char *argv[])
         }
 
         save_dir = open(shadowdir, O_RDONLY);
+        access_trace_open(prefix);
 
         fake_argv[0] = "clr_debug_fuse";
         fake_argv[1] = "-f";
@@ -0,0 +1,380 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Validator index
+ *
+ * Freshness used to be inferred from the mtime of the extracted file alone,
+ * so every lookup past the duplicate window went out to the server with
+ * If-Modified-Since. The index records, per requested path, what the server
+ * last said about it: the response, Last-Modified, ETag, size, which mirror
+ * answered and when. Lookups answered less than CLR_DEBUGINFO_REVALIDATE
+ * seconds ago are answered from the index without any request, including
+ * those the server had no object for. Older ones are revalidated with the
+ * recorded ETag, which unlike the mtime of the extracted file survives the
+ * CDN rewriting Last-Modified and the file being touched.
+ *
+ * The index is a fixed size, memory-mapped open addressing table in
+ * INDEX_FILE, so it survives the daemon exiting when idle and costs one
+ * mmap() at startup. When the probe sequence of a path is full, the slot
+ * validated longest ago is reused; the index only ever saves requests.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "nica/util.h"
+
+#include "config.h"
+
+#define INDEX_FILE CACHE_DIR "/" INDEX_SUBDIR "/validators"
+#define INDEX_MAGIC 0x58494443 /* "CDIX" */
+#define INDEX_VERSION 2
+#define INDEX_SLOTS 65536 /* power of two */
+#define INDEX_PROBE 16    /* slots looked at per path */
+#define INDEX_DEFAULT_FRESH 3600
+
+/**
+ * One path, exactly INDEX_SLOT_SIZE bytes on disk
+ */
+typedef struct IndexSlot {
+        uint64_t hash;      /**<Hash of key, 0 for an empty slot */
+        int64_t modified;   /**<Last-Modified of the object, -1 if unknown */
+        int64_t validated;  /**<When the server last answered for it */
+        uint64_t size;      /**<Size of the object on the server */
+        int32_t status;     /**<200 if the server has the object, else 404 */
+        int32_t mirror;     /**<Index of the URL it was fetched from */
+        uint32_t changed;   /**<Named in a change log since last validated */
+        uint32_t reserved;
+        char etag[96];      /**<ETag of the object, if any */
+        char key[368];      /**<"<prefix><path>" relative to CACHE_DIR */
+} IndexSlot;
+
+#define INDEX_SLOT_SIZE 512
+_Static_assert(sizeof(IndexSlot) == INDEX_SLOT_SIZE, "index slots have a fixed size");
+
+/**
+ * Describes the table, in the first INDEX_SLOT_SIZE bytes of the file
+ */
+typedef struct IndexHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slot_size;
+        uint32_t n_slots;
+        uint64_t serial; /**<Last change log applied, see changes.c */
+        int64_t synced;  /**<When serial was applied */
+} IndexHeader;
+
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static IndexHeader *index_header = NULL;
+static IndexSlot *slots = NULL;
+static time_t index_fresh = INDEX_DEFAULT_FRESH;
+
+/**
+ * FNV-1a, which unlike the hashmap hash must never change as it is stored
+ */
+static uint64_t index_hash(const char *key)
+{
+        uint64_t hash = 0xcbf29ce484222325ULL;
+
+        for (const unsigned char *c = (const unsigned char *)key; *c; c++) {
+                hash ^= *c;
+                hash *= 0x100000001b3ULL;
+        }
+        return hash ? hash : 1;
+}
+
+/**
+ * Find the slot of @key, or the one to store it in if @create, with
+ * index_mutex held
+ */
+static IndexSlot *index_find(const char *key, bool create)
+{
+        uint64_t hash = index_hash(key);
+        IndexSlot *victim = NULL;
+
+        for (uint64_t i = 0; i < INDEX_PROBE; i++) {
+                IndexSlot *slot = &slots[(hash + i) & (INDEX_SLOTS - 1)];
+
+                if (slot->hash == hash && strcmp(slot->key, key) == 0) {
+                        return slot;
+                }
+                if (!create) {
+                        if (!slot->hash) {
+                                return NULL;
+                        }
+                        continue;
+                }
+                if (!victim || (victim->hash && (!slot->hash ||
+                                                 slot->validated < victim->validated))) {
+                        victim = slot;
+                }
+        }
+        return victim;
+}
+
+bool index_init(void)
+{
+        const char *env = getenv("CLR_DEBUGINFO_REVALIDATE");
+        const size_t size = (size_t)(INDEX_SLOTS + 1) * INDEX_SLOT_SIZE;
+        IndexHeader header;
+        struct stat st;
+        void *map;
+        int fd;
+
+        if (env) {
+                index_fresh = (time_t)strtol(env, NULL, 10);
+        }
+
+        fd = open(INDEX_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                fprintf(stderr, "Failed to open %s: %s\n", INDEX_FILE, strerror(errno));
+                return false;
+        }
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size != size ||
+            pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            header.magic != INDEX_MAGIC || header.version != INDEX_VERSION ||
+            header.slot_size != INDEX_SLOT_SIZE || header.n_slots != INDEX_SLOTS) {
+                /* new, or from another version of the daemon: start over */
+                header = (IndexHeader){ .magic = INDEX_MAGIC,
+                                        .version = INDEX_VERSION,
+                                        .slot_size = INDEX_SLOT_SIZE,
+                                        .n_slots = INDEX_SLOTS };
+                /* sparse, so only the slots in use take up space */
+                if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)size) != 0 ||
+                    pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+                        close(fd);
+                        return false;
+                }
+        }
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                return false;
+        }
+
+        index_header = map;
+        slots = (IndexSlot *)((char *)map + INDEX_SLOT_SIZE);
+        return true;
+}
+
+int index_check(const char *prefix, const char *path, time_t *timestamp, char *etag, size_t len)
+{
+        autofree(char) *key = NULL;
+        autofree(char) *local = NULL;
+        IndexSlot *slot;
+        bool present;
+        struct stat st;
+        int ret = 0;
+
+        if (!slots || asprintf(&key, "%s%s", prefix, path) < 0 ||
+            asprintf(&local, "%s/%s", CACHE_DIR, key) < 0) {
+                return 0;
+        }
+        /* the file may have been evicted or aged out since */
+        present = lstat(local, &st) == 0;
+
+        pthread_mutex_lock(&index_mutex);
+        slot = index_find(key, false);
+        if (slot) {
+                bool fresh = time(NULL) - (time_t)slot->validated < index_fresh;
+
+                if (slot->status == 404 && fresh && !present) {
+                        ret = 404;
+                } else if (slot->status == 200 && present) {
+                        if (fresh) {
+                                ret = 304;
+                        } else {
+                                /* what the server said, not what the file says */
+                                if (slot->modified > 0) {
+                                        *timestamp = (time_t)slot->modified;
+                                }
+                                if (slot->etag[0] && strlen(slot->etag) < len) {
+                                        strcpy(etag, slot->etag);
+                                }
+                        }
+                }
+        }
+        pthread_mutex_unlock(&index_mutex);
+
+        return ret;
+}
+
+void index_record(const char *prefix, const char *path, int status, time_t modified,
+                  const char *etag, uint64_t size, int mirror)
+{
+        autofree(char) *key = NULL;
+        IndexSlot *slot;
+
+        if (!slots || asprintf(&key, "%s%s", prefix, path) < 0) {
+                return;
+        }
+        if (strlen(key) >= sizeof(slot->key)) {
+                return;
+        }
+
+        pthread_mutex_lock(&index_mutex);
+        if (status == 304) {
+                slot = index_find(key, false);
+                if (slot && slot->status == 200) {
+                        /* still the same object */
+                        slot->validated = (int64_t)time(NULL);
+                        slot->changed = 0;
+                        pthread_mutex_unlock(&index_mutex);
+                        return;
+                }
+                /* the file we have is current, as of @modified */
+                status = 200;
+        }
+        if (status != 200 && status != 404) {
+                pthread_mutex_unlock(&index_mutex);
+                return;
+        }
+        slot = index_find(key, true);
+        /* mark the slot empty while it is rewritten, in case we die halfway */
+        slot->hash = 0;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->modified = (int64_t)modified;
+        slot->validated = (int64_t)time(NULL);
+        slot->size = size;
+        slot->status = status;
+        slot->mirror = mirror;
+        slot->changed = 0;
+        if (!etag || strlen(etag) >= sizeof(slot->etag)) {
+                etag = "";
+        }
+        snprintf(slot->etag, sizeof(slot->etag), "%s", etag);
+        snprintf(slot->key, sizeof(slot->key), "%s", key);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->hash = index_hash(key);
+        pthread_mutex_unlock(&index_mutex);
+}
+
+uint64_t index_serial(time_t *synced)
+{
+        uint64_t serial;
+
+        if (!index_header) {
+                return 0;
+        }
+        pthread_mutex_lock(&index_mutex);
+        serial = index_header->serial;
+        *synced = (time_t)index_header->synced;
+        pthread_mutex_unlock(&index_mutex);
+
+        return serial;
+}
+
+void index_set_serial(uint64_t serial, time_t synced)
+{
+        if (!index_header) {
+                return;
+        }
+        pthread_mutex_lock(&index_mutex);
+        index_header->serial = serial;
+        index_header->synced = (int64_t)synced;
+        pthread_mutex_unlock(&index_mutex);
+}
+
+void index_refresh_all(time_t since, time_t now)
+{
+        if (!slots) {
+                return;
+        }
+        pthread_mutex_lock(&index_mutex);
+        for (size_t i = 0; i < INDEX_SLOTS; i++) {
+                /* invalidated objects stay that way until they are fetched, and
+                 * ones validated before the last sync may have changed since */
+                if (slots[i].hash && slots[i].validated && slots[i].validated >= (int64_t)since) {
+                        slots[i].validated = (int64_t)now;
+                }
+        }
+        pthread_mutex_unlock(&index_mutex);
+}
+
+void index_invalidate_all(void)
+{
+        if (!slots) {
+                return;
+        }
+        pthread_mutex_lock(&index_mutex);
+        for (size_t i = 0; i < INDEX_SLOTS; i++) {
+                slots[i].validated = 0;
+        }
+        pthread_mutex_unlock(&index_mutex);
+}
+
+time_t index_delta_base(const char *prefix, const char *path)
+{
+        autofree(char) *key = NULL;
+        IndexSlot *slot;
+        time_t base = 0;
+
+        if (!slots || asprintf(&key, "%s%s", prefix, path) < 0) {
+                return 0;
+        }
+        pthread_mutex_lock(&index_mutex);
+        slot = index_find(key, false);
+        /* only what the change logs said changed, anything else is rarely newer */
+        if (slot && slot->status == 200 && slot->changed && slot->modified > 0) {
+                base = (time_t)slot->modified;
+        }
+        pthread_mutex_unlock(&index_mutex);
+
+        return base;
+}
+
+void index_invalidate(const char *key)
+{
+        IndexSlot *slot;
+
+        if (!slots) {
+                return;
+        }
+        pthread_mutex_lock(&index_mutex);
+        slot = index_find(key, false);
+        if (slot) {
+                slot->validated = 0;
+                slot->changed = 1;
+        }
+        pthread_mutex_unlock(&index_mutex);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,261 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Latency of the FUSE operations
+ *
+ * Every getattr() of a missing file may wait up to TIMEOUT for the daemon,
+ * which is the slow path users notice. Each FUSE worker thread records its
+ * operations in histograms of its own, with plain stores, so recording takes
+ * neither a lock nor a contended cache line. A thread that exits leaves its
+ * histograms to the next thread that starts, as libfuse starts and stops
+ * workers with the load.
+ *
+ * Reading LATENCY_PATH on the mount root sums the histograms of all
+ * threads, in the same format as the statistics of the daemon.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+#include "nica/util.h"
+
+/* Upper bounds of the buckets, in microseconds */
+static const uint64_t buckets[] = { 50,    100,   250,   500,    1000,   2500,   5000,   10000,
+                                    25000, 50000, 75000, 100000, 250000, 1000000, 10000000 };
+#define N_BUCKETS ARRAY_SIZE(buckets)
+
+typedef struct Histogram {
+        uint64_t counts[N_BUCKETS + 1]; /**<Per bucket, the last one for anything slower */
+        uint64_t sum_us;                /**<Sum of all observations in microseconds */
+} Histogram;
+
+/**
+ * The histograms of one thread at a time
+ */
+typedef struct LatencySlot {
+        Histogram histograms[LATENCY_N_OPS][LATENCY_N_OUTCOMES];
+        bool in_use;              /**<Whether a thread records in it */
+        struct LatencySlot *next; /**<Slots are never freed */
+} LatencySlot;
+
+static const char *op_names[LATENCY_N_OPS] = { "getattr", "open", "read" };
+
+static const char *outcome_names[LATENCY_N_OUTCOMES] = { "hit", "daemon", "timeout",
+                                                         "unreachable" };
+
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LatencySlot *slots = NULL;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static _Thread_local LatencySlot *own_slot = NULL;
+static time_t start_time = 0;
+
+/**
+ * Hand the slot of an exiting thread back
+ */
+static void slot_release(void *data)
+{
+        LatencySlot *slot = data;
+
+        pthread_mutex_lock(&slots_mutex);
+        slot->in_use = false;
+        pthread_mutex_unlock(&slots_mutex);
+}
+
+static void slot_key_create(void)
+{
+        start_time = time(NULL);
+        if (pthread_key_create(&slot_key, slot_release) != 0) {
+                abort();
+        }
+}
+
+/**
+ * The slot of the calling thread, taking a free one or making a new one the
+ * first time
+ *
+ * @return The slot, or NULL if out of memory
+ */
+static LatencySlot *slot_get(void)
+{
+        LatencySlot *slot;
+
+        if (own_slot) {
+                return own_slot;
+        }
+        pthread_once(&slot_key_once, slot_key_create);
+
+        pthread_mutex_lock(&slots_mutex);
+        for (slot = slots; slot; slot = slot->next) {
+                if (!slot->in_use) {
+                        break;
+                }
+        }
+        if (!slot) {
+                slot = calloc(1, sizeof(LatencySlot));
+                if (!slot) {
+                        pthread_mutex_unlock(&slots_mutex);
+                        return NULL;
+                }
+                slot->next = slots;
+                slots = slot;
+        }
+        slot->in_use = true;
+        pthread_mutex_unlock(&slots_mutex);
+
+        pthread_setspecific(slot_key, slot);
+        own_slot = slot;
+        return slot;
+}
+
+/**
+ * Add @n to a counter only the calling thread writes to
+ */
+static inline void counter_add(uint64_t *counter, uint64_t n)
+{
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                         __ATOMIC_RELAXED);
+}
+
+static inline uint64_t counter_get(const uint64_t *counter)
+{
+        return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t latency_start(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void latency_record(LatencyOp op, LatencyOutcome outcome, uint64_t start)
+{
+        LatencySlot *slot = slot_get();
+        uint64_t us = (latency_start() - start) / 1000;
+        Histogram *histogram;
+        size_t i = 0;
+
+        if (!slot) {
+                return;
+        }
+        histogram = &slot->histograms[op][outcome];
+        while (i < N_BUCKETS && us > buckets[i]) {
+                i++;
+        }
+        counter_add(&histogram->counts[i], 1);
+        counter_add(&histogram->sum_us, us);
+}
+
+/**
+ * Sum the histograms of @op with @outcome of all threads into @sum, with
+ * slots_mutex held
+ */
+static void histogram_sum(LatencyOp op, LatencyOutcome outcome, Histogram *sum)
+{
+        memset(sum, 0, sizeof(*sum));
+        for (LatencySlot *slot = slots; slot; slot = slot->next) {
+                const Histogram *h = &slot->histograms[op][outcome];
+
+                for (size_t i = 0; i <= N_BUCKETS; i++) {
+                        sum->counts[i] += counter_get(&h->counts[i]);
+                }
+                sum->sum_us += counter_get(&h->sum_us);
+        }
+}
+
+static void write_histogram(FILE *f, const char *name, const char *labels, const Histogram *h)
+{
+        uint64_t total = 0;
+
+        for (size_t i = 0; i < N_BUCKETS; i++) {
+                total += h->counts[i];
+                fprintf(f, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+                        (double)buckets[i] / 1e6, (unsigned long long)total);
+        }
+        total += h->counts[N_BUCKETS];
+        fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)total);
+        fprintf(f, "%s_sum{%s} %.6f\n", name, labels, (double)h->sum_us / 1e6);
+        fprintf(f, "%s_count{%s} %llu\n", name, labels, (unsigned long long)total);
+}
+
+char *latency_format(const char *mount)
+{
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *f;
+
+        f = open_memstream(&buf, &len);
+        if (!f) {
+                return NULL;
+        }
+
+        pthread_once(&slot_key_once, slot_key_create);
+        fprintf(f, "# HELP clr_debug_fuse_start_time_seconds When counting started\n");
+        fprintf(f, "# TYPE clr_debug_fuse_start_time_seconds gauge\n");
+        fprintf(f, "clr_debug_fuse_start_time_seconds{mount=\"%s\"} %lld\n", mount,
+                (long long)start_time);
+
+        fprintf(f, "# HELP clr_debug_fuse_duration_seconds Time to answer a FUSE operation, by "
+                   "whether it waited for the daemon\n");
+        fprintf(f, "# TYPE clr_debug_fuse_duration_seconds histogram\n");
+        pthread_mutex_lock(&slots_mutex);
+        for (int op = 0; op < LATENCY_N_OPS; op++) {
+                for (int outcome = 0; outcome < LATENCY_N_OUTCOMES; outcome++) {
+                        autofree(char) *labels = NULL;
+                        Histogram sum;
+
+                        if (asprintf(&labels, "mount=\"%s\",op=\"%s\",outcome=\"%s\"", mount,
+                                     op_names[op], outcome_names[outcome]) < 0) {
+                                continue;
+                        }
+                        histogram_sum(op, outcome, &sum);
+                        write_histogram(f, "clr_debug_fuse_duration_seconds", labels, &sum);
+                }
+        }
+        pthread_mutex_unlock(&slots_mutex);
+
+        if (fclose(f) != 0) {
+                free(buf);
+                return NULL;
+        }
+        return buf;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
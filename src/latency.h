@@ -0,0 +1,77 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Latency of the FUSE operations, see latency.c
+ */
+
+/* Virtual file on the root of each mount that holds the histograms */
+#define LATENCY_PATH "/.clr_debug_stats"
+
+typedef enum {
+        LATENCY_GETATTR,
+        LATENCY_OPEN,
+        LATENCY_READ,
+        LATENCY_N_OPS
+} LatencyOp;
+
+typedef enum {
+        LATENCY_HIT,         /**<Answered from the cache without waiting for the daemon */
+        LATENCY_DAEMON,      /**<The daemon answered in time */
+        LATENCY_TIMEOUT,     /**<Gave up waiting for the daemon */
+        LATENCY_UNREACHABLE, /**<No daemon to ask */
+        LATENCY_N_OUTCOMES
+} LatencyOutcome;
+
+/**
+ * Current time in nanoseconds, to pass to latency_record() later
+ */
+uint64_t latency_start(void);
+
+/**
+ * Record an @op with @outcome that began at @start in the histograms of
+ * the calling thread
+ */
+void latency_record(LatencyOp op, LatencyOutcome outcome, uint64_t start);
+
+/**
+ * Describe the histograms of all threads in the Prometheus text format
+ *
+ * @param mount Prefix of the mount, for the mount label
+ *
+ * @return A newly allocated string, or NULL on failure
+ */
+char *latency_format(const char *mount);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
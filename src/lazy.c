@@ -0,0 +1,543 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Lazy fetching of huge objects
+ *
+ * gdb only reads the ELF headers, the section table and the index sections
+ * of a .debug file up front. Rather than downloading and extracting a
+ * tarball of hundreds of MB first, objects of at least LAZY_MIN_SIZE are
+ * made available as sparse files straight away. Their seekable zstd
+ * version (<path>.zst) is then fetched frame by frame: frames covering
+ * reads come in on demand through range requests from clr_debug_fuse, and
+ * a background thread fills in the rest.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "nica/files.h"
+#include "seekable.h"
+
+#include "config.h"
+
+/* Frames fetched per request by the background filler */
+#define LAZY_FILL_FRAMES 8
+
+/* Pause between background requests, in microseconds */
+#define LAZY_FILL_PAUSE 50000
+
+/**
+ * A partial file waiting to be filled in by the background thread
+ */
+typedef struct LazyJob {
+        char *prefix;
+        char *path;
+        struct LazyJob *next;
+} LazyJob;
+
+static pthread_mutex_t lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazy_cond = PTHREAD_COND_INITIALIZER;
+static LazyJob *jobs_head = NULL;
+static LazyJob *jobs_tail = NULL;
+static bool filling = false; /* whether the filler thread is busy */
+
+static char *lazy_map_path(const char *prefix, const char *path)
+{
+        char *map = NULL;
+
+        if (asprintf(&map, "%s/%s/%s%s", CACHE_DIR, PARTIAL_SUBDIR, prefix, path) < 0) {
+                return NULL;
+        }
+        return map;
+}
+
+static char *lazy_zst_url(const char *prefix, const char *path)
+{
+        char *url = NULL;
+
+        if (asprintf(&url, "%s%s%s.zst", urls[urlcounter % urls_size], prefix, path) < 0) {
+                return NULL;
+        }
+        return url;
+}
+
+static bool lazy_mkdir_parent(const char *path)
+{
+        autofree(char) *dir = strdup(path);
+        char *c;
+
+        if (!dir) {
+                return false;
+        }
+        c = strrchr(dir, '/');
+        if (c) {
+                *c = 0;
+        }
+        return nc_mkdir_p(dir, 00755);
+}
+
+static void lazy_queue(const char *prefix, const char *path)
+{
+        LazyJob *job = calloc(1, sizeof(LazyJob));
+
+        if (!job) {
+                return;
+        }
+        job->prefix = strdup(prefix);
+        job->path = strdup(path);
+        if (!job->prefix || !job->path) {
+                free(job->prefix);
+                free(job->path);
+                free(job);
+                return;
+        }
+
+        pthread_mutex_lock(&lazy_mutex);
+        if (jobs_tail) {
+                jobs_tail->next = job;
+        } else {
+                jobs_head = job;
+        }
+        jobs_tail = job;
+        pthread_cond_signal(&lazy_cond);
+        pthread_mutex_unlock(&lazy_mutex);
+}
+
+/**
+ * Drop a partial file, e.g. because the object changed on the server
+ * while we were filling it in; the next lookup starts over
+ */
+static void lazy_discard(const char *prefix, const char *path)
+{
+        autofree(char) *map = lazy_map_path(prefix, path);
+        autofree(char) *local = NULL;
+
+        if (asprintf(&local, "%s/%s%s", CACHE_DIR, prefix, path) >= 0) {
+                unlink(local);
+        }
+        if (map) {
+                unlink(map);
+        }
+}
+
+int lazy_open(const char *prefix, const char *path)
+{
+        autofree(char) *url = lazy_zst_url(prefix, path);
+        autofree(char) *map = lazy_map_path(prefix, path);
+        autofree(char) *local = NULL;
+        autofree(char) *staging = NULL;
+        autofree(char) *buf = NULL;
+        autofree(char) *status = NULL;
+        SeekTable *table = NULL;
+        PartialHeader header = { .magic = PARTIAL_MAGIC };
+        struct timespec times[2];
+        char range[32];
+        size_t len = 0, table_size;
+        time_t filetime = 0;
+        int ret, fd = -1;
+
+        if (!url || !map || asprintf(&local, "%s/%s%s", CACHE_DIR, prefix, path) < 0 ||
+            asprintf(&staging, "%s/%s/.lazy-XXXXXX", CACHE_DIR, PARTIAL_SUBDIR) < 0) {
+                return 418;
+        }
+
+        /* the footer says how large the seek table is */
+        snprintf(range, sizeof(range), "-%d", SEEKABLE_FOOTER_SIZE);
+        ret = curl_get_range(url, range, 0, &buf, &len, &filetime);
+        if (ret != 206) {
+                return ret == 200 ? 418 : ret;
+        }
+        if (len != SEEKABLE_FOOTER_SIZE || !filetime) {
+                return 418;
+        }
+        table_size = seekable_table_size((const uint8_t *)buf);
+        if (table_size == 0) {
+                return 418;
+        }
+
+        free(buf);
+        buf = NULL;
+        snprintf(range, sizeof(range), "-%zu", table_size);
+        ret = curl_get_range(url, range, filetime, &buf, &len, NULL);
+        if (ret != 206) {
+                return ret == 200 ? 418 : ret;
+        }
+        table = seekable_parse_table((const uint8_t *)buf, len);
+        if (!table || table->n_frames == 0) {
+                ret = 418;
+                goto out;
+        }
+
+        /* the map goes first, so readers never see the sparse file without it */
+        header.n_frames = table->n_frames;
+        header.last_modified = filetime;
+        status = calloc(table->n_frames, 1);
+        if (!status || !lazy_mkdir_parent(map)) {
+                ret = 418;
+                goto out;
+        }
+        fd = open(map, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+        if (fd < 0) {
+                ret = 418;
+                goto out;
+        }
+        len = (table->n_frames + 1) * sizeof(uint64_t);
+        if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+            write(fd, table->c_offsets, len) != (ssize_t)len ||
+            write(fd, table->d_offsets, len) != (ssize_t)len ||
+            write(fd, status, table->n_frames) != (ssize_t)table->n_frames) {
+                close(fd);
+                unlink(map);
+                ret = 418;
+                goto out;
+        }
+        close(fd);
+
+        /* then the sparse file of the final size, moved into place whole */
+        fd = mkstemp(staging);
+        if (fd < 0) {
+                unlink(map);
+                ret = 418;
+                goto out;
+        }
+        times[0].tv_sec = times[1].tv_sec = filetime;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        if (ftruncate(fd, (off_t)table->d_offsets[table->n_frames]) != 0 ||
+            fchmod(fd, 00644) != 0 || futimens(fd, times) != 0 || !lazy_mkdir_parent(local) ||
+            rename(staging, local) != 0) {
+                close(fd);
+                unlink(staging);
+                unlink(map);
+                ret = 418;
+                goto out;
+        }
+        close(fd);
+
+        lazy_queue(prefix, path);
+        ret = 200;
+
+out:
+        seekable_free(table);
+        return ret;
+}
+
+/**
+ * Fetch and store the frames @first to @last of a partial file, and drop
+ * the map once every frame is present
+ *
+ * @return 200 on success, otherwise an HTTP response code or 418
+ */
+static int lazy_fill(const char *prefix, const char *path, int first, int last)
+{
+        autofree(char) *url = lazy_zst_url(prefix, path);
+        autofree(char) *map = lazy_map_path(prefix, path);
+        autofree(char) *local = NULL;
+        autofree(char) *status = NULL;
+        SeekTable *table = NULL;
+        PartialHeader header;
+        struct stat st;
+        off_t status_offset;
+        int map_fd = -1, data_fd = -1;
+        int ret = 418;
+        int i;
+
+        if (!url || !map || asprintf(&local, "%s/%s%s", CACHE_DIR, prefix, path) < 0) {
+                return 418;
+        }
+
+        map_fd = open(map, O_RDWR);
+        if (map_fd < 0) {
+                /* no map, so the file is complete */
+                return errno == ENOENT ? 200 : 418;
+        }
+        /* on-demand and background fills would fetch the same frames twice */
+        if (flock(map_fd, LOCK_EX) != 0 || fstat(map_fd, &st) != 0) {
+                goto out;
+        }
+        if (st.st_nlink == 0) {
+                /* completed or discarded while we waited */
+                ret = 200;
+                goto out;
+        }
+        table = partial_load(map_fd, &header);
+        if (!table) {
+                goto out;
+        }
+        if (last >= (int)table->n_frames) {
+                last = (int)table->n_frames - 1;
+        }
+        if (first > last) {
+                goto out;
+        }
+        status_offset = partial_status_offset(table->n_frames);
+        status = malloc(table->n_frames);
+        data_fd = open(local, O_WRONLY);
+        if (!status || data_fd < 0 ||
+            pread(map_fd, status, table->n_frames, status_offset) != (ssize_t)table->n_frames) {
+                goto out;
+        }
+
+        i = first;
+        while (i <= last) {
+                autofree(char) *buf = NULL;
+                char range[64];
+                size_t len = 0;
+                int end = i;
+                int r;
+
+                if (status[i]) {
+                        i++;
+                        continue;
+                }
+                /* one request for each run of missing frames */
+                while (end + 1 <= last && !status[end + 1]) {
+                        end++;
+                }
+
+                snprintf(range,
+                         sizeof(range),
+                         "%llu-%llu",
+                         (unsigned long long)table->c_offsets[i],
+                         (unsigned long long)table->c_offsets[end + 1] - 1);
+                r = curl_get_range(url, range, (time_t)header.last_modified, &buf, &len, NULL);
+                if (r == 200) {
+                        /* If-Range didn't match, the object has changed */
+                        lazy_discard(prefix, path);
+                        goto out;
+                } else if (r != 206) {
+                        ret = r;
+                        goto out;
+                }
+                if (len != table->c_offsets[end + 1] - table->c_offsets[i]) {
+                        goto out;
+                }
+
+                for (int k = i; k <= end; k++) {
+                        size_t d_len = table->d_offsets[k + 1] - table->d_offsets[k];
+                        autofree(char) *frame = malloc(d_len ? d_len : 1);
+                        const char *src = buf + (table->c_offsets[k] - table->c_offsets[i]);
+
+                        if (!frame ||
+                            seekable_decompress_frame(src,
+                                                      table->c_offsets[k + 1] -
+                                                          table->c_offsets[k],
+                                                      frame,
+                                                      d_len) != (ssize_t)d_len ||
+                            pwrite(data_fd, frame, d_len, (off_t)table->d_offsets[k]) !=
+                                (ssize_t)d_len) {
+                                goto out;
+                        }
+                        status[k] = 1;
+                }
+                /* the data must be on disk before readers are told it is there */
+                if (fdatasync(data_fd) != 0 ||
+                    pwrite(map_fd, status + i, (size_t)(end - i + 1), status_offset + i) !=
+                        end - i + 1) {
+                        goto out;
+                }
+                i = end + 1;
+        }
+
+        ret = 200;
+        for (uint32_t k = 0; k < table->n_frames; k++) {
+                if (!status[k]) {
+                        goto out;
+                }
+        }
+        unlink(map);
+        /* account for the final size */
+        cache_note_access(prefix, path);
+
+out:
+        seekable_free(table);
+        if (data_fd >= 0) {
+                close(data_fd);
+        }
+        if (map_fd >= 0) {
+                close(map_fd);
+        }
+        return ret;
+}
+
+int lazy_fetch_range(const char *prefix, const char *path, uint64_t offset, uint64_t size)
+{
+        autofree(char) *map = lazy_map_path(prefix, path);
+        SeekTable *table = NULL;
+        PartialHeader header;
+        int first, last;
+        int fd;
+
+        if (!map) {
+                return 418;
+        }
+        fd = open(map, O_RDONLY);
+        if (fd < 0) {
+                return errno == ENOENT ? 200 : 418;
+        }
+        table = partial_load(fd, &header);
+        close(fd);
+        if (!table) {
+                return 418;
+        }
+
+        first = seekable_find_frame(table, offset);
+        last = seekable_find_frame(table, offset + (size ? size - 1 : 0));
+        if (last < 0) {
+                last = (int)table->n_frames - 1;
+        }
+        seekable_free(table);
+        if (first < 0) {
+                return 200;
+        }
+
+        return lazy_fill(prefix, path, first, last);
+}
+
+static void *lazy_thread(__nc_unused__ void *arg)
+{
+        /* filling in happens in the background, don't compete with lookups */
+        setpriority(PRIO_PROCESS, (id_t)gettid(), 19);
+
+        while (1) {
+                LazyJob *job = NULL;
+                int first = 0;
+                int ret;
+
+                pthread_mutex_lock(&lazy_mutex);
+                while (!jobs_head) {
+                        filling = false;
+                        pthread_cond_wait(&lazy_cond, &lazy_mutex);
+                }
+                filling = true;
+                job = jobs_head;
+                jobs_head = job->next;
+                if (!jobs_head) {
+                        jobs_tail = NULL;
+                }
+                pthread_mutex_unlock(&lazy_mutex);
+
+                /* a chunk at a time, so on-demand requests can get in between */
+                do {
+                        autofree(char) *map = lazy_map_path(job->prefix, job->path);
+                        struct stat st;
+                        int last = first + LAZY_FILL_FRAMES - 1;
+
+                        ret = lazy_fill(job->prefix, job->path, first, last);
+                        first = last + 1;
+                        if (!map || stat(map, &st) != 0) {
+                                break;
+                        }
+                        usleep(LAZY_FILL_PAUSE);
+                } while (ret == 200);
+
+                free(job->prefix);
+                free(job->path);
+                free(job);
+        }
+
+        return NULL;
+}
+
+static int lazy_scan(const char *fpath, const struct stat *sb, int typeflag,
+                     __nc_unused__ struct FTW *ftwbuf)
+{
+        static const size_t base_len = sizeof(CACHE_DIR "/" PARTIAL_SUBDIR) - 1;
+        const char *rel = fpath + base_len;
+        const char *name = strrchr(fpath, '/');
+        autofree(char) *prefix = NULL;
+        const char *slash;
+
+        if (typeflag != FTW_F || !S_ISREG(sb->st_mode)) {
+                return 0;
+        }
+        /* staging files of a run that died before moving them into place */
+        if (name && name[1] == '.') {
+                unlink(fpath);
+                return 0;
+        }
+        /* maps live at PARTIAL_SUBDIR/<prefix>/<path> */
+        if (strlen(fpath) <= base_len || *rel != '/') {
+                return 0;
+        }
+        slash = strchr(rel + 1, '/');
+        if (!slash) {
+                return 0;
+        }
+        prefix = strndup(rel + 1, (size_t)(slash - rel - 1));
+        if (prefix) {
+                lazy_queue(prefix, slash);
+        }
+        return 0;
+}
+
+bool lazy_init(void)
+{
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        if (pthread_attr_init(&attr) != 0) {
+                return false;
+        }
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, lazy_thread, NULL) != 0) {
+                pthread_attr_destroy(&attr);
+                return false;
+        }
+        pthread_attr_destroy(&attr);
+
+        /* pick up where a previous run left off */
+        nftw(CACHE_DIR "/" PARTIAL_SUBDIR, lazy_scan, 16, FTW_PHYS);
+        return true;
+}
+
+bool lazy_busy(void)
+{
+        bool busy;
+
+        pthread_mutex_lock(&lazy_mutex);
+        busy = filling || jobs_head != NULL;
+        pthread_mutex_unlock(&lazy_mutex);
+        return busy;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
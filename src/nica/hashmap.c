@@ -18,35 +18,178 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
 
 #include "hashmap.h"
 
-#define INITIAL_SIZE 61
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-/* When we're "full", 70% */
-#define FULL_FACTOR 0.7
+/*
+ * Layout
+ *
+ * Keys live in one flat array of slots, each holding the key, the value and
+ * the full hash of the key. Alongside it runs an array of control bytes, one
+ * per slot: the low 7 bits of the mixed hash (H2) for a used slot, or
+ * CTRL_EMPTY / CTRL_DELETED. A lookup starts at the group of slots picked by
+ * the rest of the mixed hash (H1) and compares H2 against a whole group of
+ * control bytes at once, so keys are only compared when both H2 and the full
+ * hash match. Groups are probed triangularly until one holds an empty slot.
+ *
+ * The first GROUP_WIDTH control bytes are mirrored past the end of the
+ * array, so a group starting anywhere can be loaded without wrapping.
+ * Control bytes are stored XORed with CTRL_STORED, which makes an empty
+ * slot a zero byte, so a new table comes zeroed from calloc, straight from
+ * mmap for big ones, rather than being filled in one go.
+ *
+ * Resizing is incremental, so no single operation has to move every item.
+ * A resize allocates the new table and keeps the old one around; every
+ * put or remove then moves the next MIGRATE_STEP slots of the old table,
+ * and lookups try the new table first, then the old. The new table holds
+ * at least twice the items the old one had room for, so the old one is
+ * empty long before the new one fills up.
+ */
+
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+#define CTRL_STORED 0x80
+
+/* Smallest number of slots, at least one group */
+#define INITIAL_SIZE 16
+
+/* Slots of the old table moved per put or remove during a resize */
+#define MIGRATE_STEP 32
+
+/* Moved slots of the old table are given back in pieces of this size, as
+ * unmapping a big table at once takes milliseconds too */
+#define RELEASE_SIZE (256 * 1024)
+
+#ifdef __SSE2__
+
+#define GROUP_WIDTH 16
+#define GROUP_SHIFT 0 /* Match masks have one bit per control byte */
+
+typedef __m128i NcHashmapGroup;
+
+static inline NcHashmapGroup group_load(const uint8_t *ctrl)
+{
+        return _mm_xor_si128(_mm_loadu_si128((const __m128i *)(const void *)ctrl),
+                             _mm_set1_epi8((char)CTRL_STORED));
+}
+
+static inline uint64_t group_match(NcHashmapGroup group, int8_t h2)
+{
+        return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), group));
+}
+
+static inline uint64_t group_match_empty(NcHashmapGroup group)
+{
+        return group_match(group, CTRL_EMPTY);
+}
+
+static inline uint64_t group_match_empty_or_deleted(NcHashmapGroup group)
+{
+        return (uint16_t)_mm_movemask_epi8(group);
+}
 
-/* Multiple to increase bucket size by */
-#define INCREASE_FACTOR 4
+#else
+
+#define GROUP_WIDTH 8
+#define GROUP_SHIFT 3 /* Match masks have the top bit of each control byte */
+
+#define LSBS 0x0101010101010101ULL
+#define MSBS 0x8080808080808080ULL
+
+typedef uint64_t NcHashmapGroup;
+
+static inline NcHashmapGroup group_load(const uint8_t *ctrl)
+{
+        uint64_t group;
+
+        memcpy(&group, ctrl, sizeof(group));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        group = __builtin_bswap64(group);
+#endif
+        return group ^ MSBS;
+}
+
+/* May report a false match right after a real one, the full hash sorts it out */
+static inline uint64_t group_match(NcHashmapGroup group, int8_t h2)
+{
+        uint64_t x = group ^ (LSBS * (uint8_t)h2);
+
+        return (x - LSBS) & ~x & MSBS;
+}
+
+static inline uint64_t group_match_empty(NcHashmapGroup group)
+{
+        return group & ~(group << 6) & MSBS;
+}
+
+static inline uint64_t group_match_empty_or_deleted(NcHashmapGroup group)
+{
+        return group & MSBS;
+}
+
+#endif
 
 /**
- * An bucket/chain within the hashmap
+ * Index within its group of the lowest control byte set in @mask
  */
-typedef struct NcHashmapEntry {
-        void *hash;                  /**<The key for this item */
-        void *value;                 /**<Value for this item */
-        struct NcHashmapEntry *next; /**<Next item in the chain */
-        bool occ;                    /**<Whether this bucket is occupied */
-} NcHashmapEntry;
+static inline size_t mask_first(uint64_t mask)
+{
+        return (size_t)__builtin_ctzll(mask) >> GROUP_SHIFT;
+}
+
+/**
+ * Number of control bytes set in @mask at the start of the group
+ */
+static inline size_t mask_leading_bytes(uint64_t mask)
+{
+        return mask ? mask_first(mask) : GROUP_WIDTH;
+}
+
+/**
+ * Number of control bytes set in @mask at the end of the group
+ */
+static inline size_t mask_trailing_bytes(uint64_t mask)
+{
+        if (!mask) {
+                return GROUP_WIDTH;
+        }
+        return (size_t)(__builtin_clzll(mask) - (64 - (GROUP_WIDTH << GROUP_SHIFT))) >>
+               GROUP_SHIFT;
+}
+
+/**
+ * A slot within the hashmap
+ */
+typedef struct NcHashmapSlot {
+        void *key;     /**<The key for this item */
+        void *value;   /**<Value for this item */
+        unsigned hash; /**<Hash of the key, compared before the key itself */
+} NcHashmapSlot;
+
+/**
+ * Slots and control bytes of the hashmap
+ */
+typedef struct NcHashmapTable {
+        NcHashmapSlot *slots; /**<Stores our items, NULL for an unused table */
+        uint8_t *ctrl;        /**<Control byte per slot, plus the mirrored group */
+        size_t n_slots;       /**<Number of slots, a power of two */
+        size_t growth_left;   /**<Empty slots we may still fill before resizing */
+} NcHashmapTable;
 
 /**
  * A NcHashmap
  */
 struct NcHashmap {
-        int size;                /**<Current size of the hashmap */
-        int next_size;           /**<Next size at which we need to resize */
-        int n_buckets;           /**<Current number of buckets */
-        NcHashmapEntry *buckets; /**<Stores our bucket chains */
+        int size;             /**<Current size of the hashmap */
+        NcHashmapTable table; /**<Where new items go */
+        NcHashmapTable old;   /**<Table being resized away from, if any */
+        size_t migrated;      /**<Slots of old already moved to table */
 
         nc_hash_create_func hash;     /**<Hash generation function */
         nc_hash_compare_func compare; /**<Key comparison function */
@@ -58,51 +201,273 @@ struct NcHashmap {
  * Iteration object
  */
 typedef struct _NcHashmapIter {
-        int bucket;     /**<Current bucket position */
+        int bucket;     /**<Current slot position, counting table then old */
         NcHashmap *map; /**<Associated NcHashmap */
-        void *item;     /**<Current item in this iteration */
+        void *item;     /**<Unused */
 } _NcHashmapIter;
 
-static void nc_hashmap_update_next_size(NcHashmap *self);
-static bool nc_hashmap_resize(NcHashmap *self);
+/**
+ * Slots we may fill out of @n_slots, keeping 1/8 empty to end probes early
+ */
+static inline size_t nc_hashmap_capacity(size_t n_slots)
+{
+        return n_slots - n_slots / 8;
+}
 
-static inline bool nc_hashmap_maybe_resize(NcHashmap *self)
+/**
+ * Spread the bits of a caller's hash, as the defaults are not very random
+ * in their low bits (nc_simple_hash of aligned pointers most of all)
+ */
+static inline uint64_t nc_hashmap_mix(unsigned hash)
 {
-        if (!self) {
+        uint64_t h = (uint64_t)hash * 0x9e3779b97f4a7c15ULL;
+
+        return h ^ (h >> 32);
+}
+
+static inline size_t nc_hashmap_h1(uint64_t mixed)
+{
+        return (size_t)(mixed >> 7);
+}
+
+static inline int8_t nc_hashmap_h2(uint64_t mixed)
+{
+        return (int8_t)(mixed & 0x7f);
+}
+
+static inline bool nc_hashmap_is_full(int8_t ctrl)
+{
+        return ctrl >= 0;
+}
+
+/**
+ * Allocate slots and control bytes for @n_slots, all empty
+ */
+static bool nc_hashmap_table_alloc(NcHashmapTable *table, size_t n_slots)
+{
+        char *mem = calloc(1, n_slots * sizeof(NcHashmapSlot) + n_slots + GROUP_WIDTH);
+
+        if (!mem) {
                 return false;
         }
-        if (self->size >= self->next_size) {
-                return true;
+        table->slots = (NcHashmapSlot *)(void *)mem;
+        table->ctrl = (uint8_t *)(mem + n_slots * sizeof(NcHashmapSlot));
+        table->n_slots = n_slots;
+        table->growth_left = nc_hashmap_capacity(n_slots);
+        return true;
+}
+
+static void nc_hashmap_table_free(NcHashmapTable *table)
+{
+        /* ctrl shares the allocation of slots */
+        free(table->slots);
+        memset(table, 0, sizeof(*table));
+}
+
+static inline int8_t nc_hashmap_ctrl(const NcHashmapTable *table, size_t i)
+{
+        return (int8_t)(table->ctrl[i] ^ CTRL_STORED);
+}
+
+/**
+ * Set the control byte of slot @i, and its mirror if in the first group
+ */
+static inline void nc_hashmap_set_ctrl(NcHashmapTable *table, size_t i, int8_t ctrl)
+{
+        uint8_t stored = (uint8_t)ctrl ^ CTRL_STORED;
+
+        table->ctrl[i] = stored;
+        table->ctrl[((i - GROUP_WIDTH) & (table->n_slots - 1)) + GROUP_WIDTH] = stored;
+}
+
+/**
+ * Find the first empty or deleted slot on the probe sequence of @mixed
+ */
+static size_t nc_hashmap_find_free(NcHashmapTable *table, uint64_t mixed)
+{
+        size_t mask = table->n_slots - 1;
+        size_t pos = nc_hashmap_h1(mixed) & mask;
+
+        for (size_t stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+                uint64_t free_slots = group_match_empty_or_deleted(group_load(table->ctrl + pos));
+
+                if (free_slots) {
+                        return (pos + mask_first(free_slots)) & mask;
+                }
+                pos = (pos + stride) & mask;
         }
-        return false;
+}
+
+/**
+ * Store the contents of @slot in @table, which must have room for it and
+ * not hold the key yet
+ */
+static void nc_hashmap_insert(NcHashmapTable *table, uint64_t mixed, const NcHashmapSlot *slot)
+{
+        size_t i = nc_hashmap_find_free(table, mixed);
+
+        if (nc_hashmap_ctrl(table, i) == CTRL_EMPTY) {
+                table->growth_left--;
+        }
+        nc_hashmap_set_ctrl(table, i, nc_hashmap_h2(mixed));
+        table->slots[i] = *slot;
+}
+
+/**
+ * Empty slot @i of @table
+ */
+static void nc_hashmap_erase(NcHashmapTable *table, size_t i)
+{
+        size_t mask = table->n_slots - 1;
+        size_t before = (i - GROUP_WIDTH) & mask;
+        uint64_t empty_after, empty_before;
+
+        table->slots[i].key = NULL;
+        table->slots[i].value = NULL;
+
+        /* If no group containing the slot was ever seen without an empty
+         * slot, no probe went past it and it may become empty again */
+        empty_after = group_match_empty(group_load(table->ctrl + i));
+        empty_before = group_match_empty(group_load(table->ctrl + before));
+        if (empty_after && empty_before &&
+            mask_leading_bytes(empty_after) + mask_trailing_bytes(empty_before) < GROUP_WIDTH) {
+                nc_hashmap_set_ctrl(table, i, CTRL_EMPTY);
+                table->growth_left++;
+        } else {
+                nc_hashmap_set_ctrl(table, i, CTRL_DELETED);
+        }
+}
+
+/* Secrets of the string hash, odd and with half their bits set */
+static const uint64_t hash_secret[4] = { 0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+                                         0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL };
+
+/**
+ * Multiply @a by @b, leaving the low half of the product in @a and the high
+ * half in @b
+ */
+static inline void hash_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+        __uint128_t r = (__uint128_t)*a * *b;
+
+        *a = (uint64_t)r;
+        *b = (uint64_t)(r >> 64);
+#else
+        uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+        uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+        uint64_t t = rl + (rm0 << 32), lo, hi;
+        uint64_t c = t < rl;
+
+        lo = t + (rm1 << 32);
+        c += lo < t;
+        hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+        *a = lo;
+        *b = hi;
+#endif
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+        hash_mum(&a, &b);
+        return a ^ b;
+}
+
+static inline uint64_t hash_read8(const uint8_t *p)
+{
+        uint64_t v;
+
+        memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        return v;
+}
+
+static inline uint64_t hash_read4(const uint8_t *p)
+{
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap32(v);
+#endif
+        return v;
+}
+
+unsigned nc_string_hash_len(const void *key, size_t len)
+{
+        const uint8_t *p = key;
+        const uint64_t *s = hash_secret;
+        uint64_t seed = hash_mix(s[0], s[1]);
+        uint64_t a, b;
+
+        if (len <= 16) {
+                if (len >= 4) {
+                        /* two overlapping reads cover 4 to 16 bytes */
+                        size_t mid = (len >> 3) << 2;
+
+                        a = hash_read4(p) << 32 | hash_read4(p + mid);
+                        b = hash_read4(p + len - 4) << 32 | hash_read4(p + len - 4 - mid);
+                } else if (len > 0) {
+                        a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 | p[len - 1];
+                        b = 0;
+                } else {
+                        a = b = 0;
+                }
+        } else {
+                size_t i = len;
+
+                if (i > 48) {
+                        uint64_t seed1 = seed, seed2 = seed;
+
+                        do {
+                                seed = hash_mix(hash_read8(p) ^ s[1], hash_read8(p + 8) ^ seed);
+                                seed1 = hash_mix(hash_read8(p + 16) ^ s[2],
+                                                 hash_read8(p + 24) ^ seed1);
+                                seed2 = hash_mix(hash_read8(p + 32) ^ s[3],
+                                                 hash_read8(p + 40) ^ seed2);
+                                p += 48;
+                                i -= 48;
+                        } while (i > 48);
+                        seed ^= seed1 ^ seed2;
+                }
+                while (i > 16) {
+                        seed = hash_mix(hash_read8(p) ^ s[1], hash_read8(p + 8) ^ seed);
+                        i -= 16;
+                        p += 16;
+                }
+                /* the last 16 bytes, overlapping what was already mixed */
+                a = hash_read8(p + i - 16);
+                b = hash_read8(p + i - 8);
+        }
+        a ^= s[1];
+        b ^= seed;
+        hash_mum(&a, &b);
+        a = hash_mix(a ^ s[0] ^ len, b ^ s[1]);
+        return (unsigned)(a ^ (a >> 32));
 }
 
 static NcHashmap *nc_hashmap_new_internal(nc_hash_create_func create, nc_hash_compare_func compare,
                                           nc_hash_free_func key_free, nc_hash_free_func value_free)
 {
         NcHashmap *map = NULL;
-        NcHashmapEntry *buckets = NULL;
 
         map = calloc(1, sizeof(NcHashmap));
         if (!map) {
                 return NULL;
         }
 
-        buckets = calloc(INITIAL_SIZE, sizeof(NcHashmapEntry));
-        if (!buckets) {
+        if (!nc_hashmap_table_alloc(&map->table, INITIAL_SIZE)) {
                 free(map);
                 return NULL;
         }
-        map->buckets = buckets;
-        map->n_buckets = INITIAL_SIZE;
         map->hash = create ? create : nc_simple_hash;
         map->compare = compare ? compare : nc_simple_compare;
         map->key_free = key_free;
         map->value_free = value_free;
         map->size = 0;
 
-        nc_hashmap_update_next_size(map);
-
         return map;
 }
 
@@ -117,64 +482,133 @@ NcHashmap *nc_hashmap_new_full(nc_hash_create_func create, nc_hash_compare_func
         return nc_hashmap_new_internal(create, compare, key_free, value_free);
 }
 
-static inline unsigned nc_hashmap_get_hash(NcHashmap *self, const void *key)
+/**
+ * Give back the memory of the slots of the old table that are all moved by
+ * moving those from @from to @to. Their control bytes stay, for probes.
+ */
+static void nc_hashmap_release(NcHashmapTable *old, size_t from, size_t to)
 {
-        unsigned hash = self->hash(key);
-        return hash;
+        uintptr_t mask = RELEASE_SIZE - 1;
+        uintptr_t first = ((uintptr_t)old->slots + mask) & ~mask;
+        uintptr_t start = (uintptr_t)&old->slots[from] & ~mask;
+        uintptr_t end = (uintptr_t)&old->slots[to] & ~mask;
+
+        if (start < first) {
+                start = first;
+        }
+        if (start < end) {
+                madvise((void *)start, end - start, MADV_DONTNEED);
+        }
 }
 
-static int nc_hashmap_insert_bucket(NcHashmap *self, NcHashmapEntry *buckets, int n_buckets,
-                                    unsigned hash, const void *key, void *value)
+/**
+ * Move up to @n slots of the old table into the current one, if resizing.
+ * The stored hashes are reused, so the hash function isn't called again.
+ */
+static void nc_hashmap_migrate(NcHashmap *self, size_t n)
 {
-        NcHashmapEntry *row = &(buckets[hash % n_buckets]);
-        NcHashmapEntry *head = NULL;
-        NcHashmapEntry *parent = head = row;
-        bool can_replace = false;
-        NcHashmapEntry *tomb = NULL;
-        int ret = 1;
+        NcHashmapTable *old = &self->old;
+        size_t end;
 
-        while (row) {
-                if (!row->occ) {
-                        tomb = row;
-                }
-                parent = row;
-                if (row->occ && row->hash == key) {
-                        if (self->compare(row->hash, key)) {
-                                can_replace = true;
-                                break;
-                        }
+        if (!old->slots) {
+                return;
+        }
+        end = old->n_slots - self->migrated > n ? self->migrated + n : old->n_slots;
+        for (size_t i = self->migrated; i < end; i++) {
+                if (!nc_hashmap_is_full(nc_hashmap_ctrl(old, i))) {
+                        continue;
                 }
-                row = row->next;
+                nc_hashmap_insert(&self->table, nc_hashmap_mix(old->slots[i].hash),
+                                  &old->slots[i]);
+                /* probes for the keys still there must go on past it */
+                nc_hashmap_set_ctrl(old, i, CTRL_DELETED);
         }
+        if (end == old->n_slots) {
+                nc_hashmap_table_free(old);
+        } else {
+                nc_hashmap_release(old, self->migrated, end);
+        }
+        self->migrated = end;
+}
 
-        if (can_replace) {
-                /* Replace existing allocations. */
-                if (self->value_free) {
-                        self->value_free(row->value);
-                }
-                if (self->key_free) {
-                        self->key_free(row->hash);
+/**
+ * Make room for one more item by starting a resize. A table clogged with
+ * tombstones is rebuilt at the same size, a full one is doubled.
+ */
+static bool nc_hashmap_grow(NcHashmap *self)
+{
+        NcHashmapTable table;
+        size_t n_slots = self->table.n_slots;
+
+        /* never happens as long as MIGRATE_STEP outpaces the inserts */
+        if (self->old.slots) {
+                nc_hashmap_migrate(self, SIZE_MAX);
+                if (self->table.growth_left > 0) {
+                        return true;
                 }
-                ret = 0;
-        } else if (tomb) {
-                row = tomb;
         }
 
-        if (!row) {
-                row = calloc(1, sizeof(NcHashmapEntry));
-                if (!row) {
+        if ((size_t)self->size > nc_hashmap_capacity(n_slots) / 2) {
+                n_slots *= 2;
+        }
+        if (!nc_hashmap_table_alloc(&table, n_slots)) {
+                return false;
+        }
+        self->old = self->table;
+        self->table = table;
+        self->migrated = 0;
+        return true;
+}
+
+/**
+ * Find the slot of @table holding @key
+ *
+ * @return Index of the slot, or -1 if the key isn't stored
+ */
+static ssize_t nc_hashmap_find(NcHashmap *self, NcHashmapTable *table, const void *key,
+                               unsigned hash, uint64_t mixed)
+{
+        size_t mask = table->n_slots - 1;
+        size_t pos = nc_hashmap_h1(mixed) & mask;
+        int8_t h2 = nc_hashmap_h2(mixed);
+
+        for (size_t stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+                NcHashmapGroup group = group_load(table->ctrl + pos);
+
+                for (uint64_t match = group_match(group, h2); match; match &= match - 1) {
+                        size_t i = (pos + mask_first(match)) & mask;
+                        NcHashmapSlot *slot = &table->slots[i];
+
+                        if (slot->hash == hash && self->compare(slot->key, key)) {
+                                return (ssize_t)i;
+                        }
+                }
+                if (group_match_empty(group)) {
                         return -1;
                 }
+                pos = (pos + stride) & mask;
         }
+}
 
-        row->hash = (void *)key;
-        row->value = value;
-        row->occ = true;
-        if (parent != row && parent) {
-                parent->next = row;
-        }
+/**
+ * Find the slot holding @key, in the current table or the old one
+ *
+ * @param table Set to the table of the slot
+ * @return The slot, or NULL if the key isn't stored
+ */
+static NcHashmapSlot *nc_hashmap_lookup(NcHashmap *self, const void *key, unsigned hash,
+                                        NcHashmapTable **table)
+{
+        uint64_t mixed = nc_hashmap_mix(hash);
+        ssize_t i;
 
-        return ret;
+        *table = &self->table;
+        i = nc_hashmap_find(self, *table, key, hash, mixed);
+        if (i < 0 && self->old.slots) {
+                *table = &self->old;
+                i = nc_hashmap_find(self, *table, key, hash, mixed);
+        }
+        return i >= 0 ? &(*table)->slots[i] : NULL;
 }
 
 bool nc_hashmap_put(NcHashmap *self, const void *key, void *value)
@@ -182,39 +616,48 @@ bool nc_hashmap_put(NcHashmap *self, const void *key, void *value)
         if (!self) {
                 return false;
         }
-        int inc;
+        unsigned hash = self->hash(key);
+        uint64_t mixed = nc_hashmap_mix(hash);
+        NcHashmapSlot new_slot = { .key = (void *)key, .value = value, .hash = hash };
+        NcHashmapTable *table;
+        NcHashmapSlot *slot;
+        size_t i;
 
-        if (nc_hashmap_maybe_resize(self)) {
-                if (!nc_hashmap_resize(self)) {
-                        return false;
+        nc_hashmap_migrate(self, MIGRATE_STEP);
+
+        slot = nc_hashmap_lookup(self, key, hash, &table);
+        if (slot) {
+                /* Replace existing allocations. */
+                if (self->value_free && slot->value != value) {
+                        self->value_free(slot->value);
                 }
-        }
-        unsigned hash = nc_hashmap_get_hash(self, key);
-        inc = nc_hashmap_insert_bucket(self, self->buckets, self->n_buckets, hash, key, value);
-        if (inc > 0) {
-                self->size += inc;
+                if (self->key_free && slot->key != key) {
+                        self->key_free(slot->key);
+                }
+                *slot = new_slot;
                 return true;
-        } else {
-                return false;
         }
+
+        table = &self->table;
+        i = nc_hashmap_find_free(table, mixed);
+        if (nc_hashmap_ctrl(table, i) == CTRL_EMPTY && table->growth_left == 0) {
+                if (!nc_hashmap_grow(self)) {
+                        return false;
+                }
+        }
+        nc_hashmap_insert(&self->table, mixed, &new_slot);
+        self->size++;
+        return true;
 }
 
-static NcHashmapEntry *nc_hashmap_get_entry(NcHashmap *self, const void *key)
+static NcHashmapSlot *nc_hashmap_get_slot(NcHashmap *self, const void *key)
 {
+        NcHashmapTable *table;
+
         if (!self) {
                 return NULL;
         }
-
-        unsigned hash = nc_hashmap_get_hash(self, key);
-        NcHashmapEntry *row = &(self->buckets[hash % self->n_buckets]);
-
-        while (row) {
-                if (self->compare(row->hash, key)) {
-                        return row;
-                }
-                row = row->next;
-        }
-        return NULL;
+        return nc_hashmap_lookup(self, key, self->hash(key), &table);
 }
 
 void *nc_hashmap_get(NcHashmap *self, const void *key)
@@ -223,9 +666,9 @@ void *nc_hashmap_get(NcHashmap *self, const void *key)
                 return NULL;
         }
 
-        NcHashmapEntry *row = nc_hashmap_get_entry(self, key);
-        if (row) {
-                return row->value;
+        NcHashmapSlot *slot = nc_hashmap_get_slot(self, key);
+        if (slot) {
+                return slot->value;
         }
         return NULL;
 }
@@ -236,12 +679,12 @@ bool nc_hashmap_ensure_get(NcHashmap *self, const void *key, void **value)
                 return false;
         }
 
-        NcHashmapEntry *row = nc_hashmap_get_entry(self, key);
-        if (!row) {
+        NcHashmapSlot *slot = nc_hashmap_get_slot(self, key);
+        if (!slot) {
                 *value = NULL;
                 return false;
         }
-        *value = row->value;
+        *value = slot->value;
         return true;
 }
 
@@ -250,24 +693,26 @@ static bool nc_hashmap_remove_internal(NcHashmap *self, const void *key, bool re
         if (!self) {
                 return false;
         }
-        NcHashmapEntry *row = nc_hashmap_get_entry(self, key);
+        NcHashmapTable *table;
+        NcHashmapSlot *slot;
 
-        if (!row) {
+        nc_hashmap_migrate(self, MIGRATE_STEP);
+
+        slot = nc_hashmap_lookup(self, key, self->hash(key), &table);
+        if (!slot) {
                 return false;
         }
 
         if (remove) {
                 if (self->key_free) {
-                        self->key_free(row->hash);
+                        self->key_free(slot->key);
                 }
                 if (self->value_free) {
-                        self->value_free(row->value);
+                        self->value_free(slot->value);
                 }
         }
         self->size -= 1;
-        row->hash = NULL;
-        row->value = NULL;
-        row->occ = false;
+        nc_hashmap_erase(table, (size_t)(slot - table->slots));
 
         return true;
 }
@@ -287,34 +732,22 @@ bool nc_hashmap_contains(NcHashmap *self, const void *key)
         return (nc_hashmap_get(self, key)) != NULL;
 }
 
-static inline void nc_hashmap_free_bucket(NcHashmap *self, NcHashmapEntry *bucket, bool nuke)
+static void nc_hashmap_free_table(NcHashmap *self, NcHashmapTable *table)
 {
-        if (!self) {
-                return;
-        }
-        NcHashmapEntry *tmp = bucket;
-        NcHashmapEntry *bk = bucket;
-        NcHashmapEntry *root = bucket;
-
-        while (tmp) {
-                bk = NULL;
-                if (tmp->next) {
-                        bk = tmp->next;
-                }
-
-                if (nuke && tmp->occ) {
+        if (self->key_free || self->value_free) {
+                for (size_t i = 0; i < table->n_slots; i++) {
+                        if (!nc_hashmap_is_full(nc_hashmap_ctrl(table, i))) {
+                                continue;
+                        }
                         if (self->key_free) {
-                                self->key_free(tmp->hash);
+                                self->key_free(table->slots[i].key);
                         }
                         if (self->value_free) {
-                                self->value_free(tmp->value);
+                                self->value_free(table->slots[i].value);
                         }
                 }
-                if (tmp != root) {
-                        free(tmp);
-                }
-                tmp = bk;
         }
+        nc_hashmap_table_free(table);
 }
 
 void nc_hashmap_free(NcHashmap *self)
@@ -322,25 +755,12 @@ void nc_hashmap_free(NcHashmap *self)
         if (!self) {
                 return;
         }
-        for (int i = 0; i < self->n_buckets; i++) {
-                NcHashmapEntry *row = &(self->buckets[i]);
-                nc_hashmap_free_bucket(self, row, true);
-        }
-        if (self->buckets) {
-                free(self->buckets);
-        }
+        nc_hashmap_free_table(self, &self->table);
+        nc_hashmap_free_table(self, &self->old);
 
         free(self);
 }
 
-static void nc_hashmap_update_next_size(NcHashmap *self)
-{
-        if (!self) {
-                return;
-        }
-        self->next_size = (int)(self->n_buckets * FULL_FACTOR);
-}
-
 int nc_hashmap_size(NcHashmap *self)
 {
         if (!self) {
@@ -349,70 +769,6 @@ int nc_hashmap_size(NcHashmap *self)
         return self->size;
 }
 
-static bool nc_hashmap_resize(NcHashmap *self)
-{
-        if (!self || !self->buckets) {
-                return false;
-        }
-
-        NcHashmapEntry *old_buckets = self->buckets;
-        NcHashmapEntry *new_buckets = NULL;
-        NcHashmapEntry *entry = NULL;
-        int incr;
-
-        int old_size, new_size;
-        int items = 0;
-
-        new_size = old_size = self->n_buckets;
-        new_size *= INCREASE_FACTOR;
-
-        new_buckets = calloc(new_size, sizeof(NcHashmapEntry));
-        if (!new_buckets) {
-                return false;
-        }
-
-        for (int i = 0; i < old_size; i++) {
-                entry = &(old_buckets[i]);
-                while (entry) {
-                        if (entry->occ) {
-                                unsigned hash = nc_hashmap_get_hash(self, entry->hash);
-                                if ((incr = nc_hashmap_insert_bucket(self,
-                                                                     new_buckets,
-                                                                     new_size,
-                                                                     hash,
-                                                                     entry->hash,
-                                                                     entry->value)) > 0) {
-                                        items += incr;
-                                } else {
-                                        /* Likely a memory issue */
-                                        goto failure;
-                                }
-                        }
-                        entry = entry->next;
-                }
-        }
-        /* Successfully resized - do this separately because we need to
-         * gaurantee old data is preserved */
-        for (int i = 0; i < old_size; i++) {
-                nc_hashmap_free_bucket(self, &(old_buckets[i]), false);
-        }
-
-        free(old_buckets);
-        self->n_buckets = new_size;
-        self->size = items;
-        self->buckets = new_buckets;
-
-        nc_hashmap_update_next_size(self);
-        return true;
-
-failure:
-        for (int i = 0; i < new_size; i++) {
-                nc_hashmap_free_bucket(self, &(new_buckets[i]), true);
-        }
-        free(new_buckets);
-        return false;
-}
-
 void nc_hashmap_iter_init(NcHashmap *map, NcHashmapIter *citer)
 {
         _NcHashmapIter *iter = NULL;
@@ -429,9 +785,9 @@ void nc_hashmap_iter_init(NcHashmap *map, NcHashmapIter *citer)
 bool nc_hashmap_iter_next(NcHashmapIter *citer, void **key, void **value)
 {
         _NcHashmapIter *iter = NULL;
-        NcHashmapEntry *item = NULL;
+        NcHashmapTable *table = NULL;
         NcHashmap *map = NULL;
-        int n_buckets = 0;
+        size_t i;
 
         if (!citer) {
                 return false;
@@ -442,38 +798,28 @@ bool nc_hashmap_iter_next(NcHashmapIter *citer, void **key, void **value)
         if (!map) {
                 return false;
         }
-        n_buckets = map->n_buckets;
-        item = iter->item;
 
         for (;;) {
-                if (iter->bucket >= n_buckets) {
-                        if (item && !item->next) {
+                i = (size_t)(iter->bucket + 1);
+                table = &map->table;
+                if (i >= table->n_slots) {
+                        i -= table->n_slots;
+                        table = &map->old;
+                        if (i >= table->n_slots) {
                                 return false;
                         }
                 }
-                if (!item) {
-                        iter->bucket++;
-                        if (iter->bucket > n_buckets - 1) {
-                                return false;
-                        }
-                        item = &(map->buckets[iter->bucket]);
-                }
-                if (item) {
-                        if (item->occ) {
-                                goto success;
-                        }
-                        item = item->next;
+                iter->bucket++;
+                if (nc_hashmap_is_full(nc_hashmap_ctrl(table, i))) {
+                        break;
                 }
         }
-        return false;
 
-success:
-        iter->item = item->next;
         if (key) {
-                *key = item->hash;
+                *key = table->slots[i].key;
         }
         if (value) {
-                *value = item->value;
+                *value = table->slots[i].value;
         }
 
         return true;
@@ -8,16 +8,15 @@
  * published by the Free Software Foundation; either version 2.1
  * of the License, or (at your option) any later version.
  *
- * This is a chained Hashmap implementation. It focuses on being clean
- * and efficient, and is comparable (at -O2) to open addressing hashmaps
- * up until around 105,000 elements, where open addressing will begin
- * to come out in front. At 1 million elements, open addressing is a clear
- * winner, however currently we only need a maximum of 70k elements in
- * our implementation.
- *
- * Given the memory required to even begin to deal with 1 million elements,
- * it becomes very questionable whether a hashmap should have even been
- * used in the first place (mmap'd db?)
+ * This is an open addressing Hashmap in the style of SwissTable. Items
+ * are kept in one flat array of slots, next to an array of one control
+ * byte per slot holding 7 bits of the hash, so a probe checks a whole group
+ * of slots at once (with SSE2 where available). The full hash of each key
+ * is stored in its slot, so the comparison function only runs on keys
+ * whose hash matches exactly. Removed slots become tombstones until the
+ * next resize, and the table doubles once 7/8 of its slots are taken.
+ * Resizes are incremental: the old table is moved over a few slots per
+ * put or remove, so no single call stalls for the size of the table.
  *
  * Authors:
  *
@@ -84,17 +83,19 @@ typedef void (*nc_hash_free_func)(void *p);
  * nc_simple_hash and nc_simple_compare functions
  */
 
+/**
+ * Hash the @len bytes at @key
+ *
+ * A word-at-a-time hash of the wyhash family: 8 bytes per multiply, and
+ * three independent lanes for keys longer than 48 bytes. Use it directly
+ * for keys whose length is already known.
+ */
+unsigned nc_string_hash_len(const void *key, size_t len);
+
 /* Default string hash */
 static inline unsigned nc_string_hash(const void *key)
 {
-        unsigned hash = 5381;
-        const signed char *c;
-
-        /* DJB's hash function */
-        for (c = key; *c != '\0'; c++) {
-                hash = (hash << 5) + hash + (unsigned)*c;
-        }
-        return hash;
+        return nc_string_hash_len(key, strlen(key));
 }
 
 /**
@@ -150,13 +151,14 @@ NcHashmap *nc_hashmap_new_full(nc_hash_create_func hash, nc_hash_compare_func co
 /**
  * Store a key/value pair in the hashmap
  *
- * @note This will displace duplicate keys, and may free both the key
- * and value if key_free and value_free are non null
+ * @note This will displace an equal key, and may free both the old key
+ * and value if key_free and value_free are non null (unless they are the
+ * very ones being stored)
  *
  * @param key Key to store in the hashmap
  * @param value Value to be associated with the key
  *
- * @return true if the operation succeeded.
+ * @return true if the operation succeeded, false if out of memory
  */
 bool nc_hashmap_put(NcHashmap *map, const void *key, void *value);
 
@@ -0,0 +1,188 @@
+/*
+ * This file is part of libnica.
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * libnica is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shardmap.h"
+
+#define CACHE_LINE 64
+
+/**
+ * A shard, alone on its cache lines so that locking one doesn't slow
+ * down threads using its neighbours
+ */
+typedef struct NcShardmapShard {
+        _Alignas(CACHE_LINE) pthread_mutex_t lock; /**<Guards map */
+        NcHashmap *map;                            /**<Keys whose hash picks this shard */
+} NcShardmapShard;
+
+/**
+ * A NcShardmap
+ */
+struct NcShardmap {
+        NcShardmapShard shards[NC_SHARDMAP_SHARDS];
+        nc_hash_create_func hash; /**<Hash generation function */
+};
+
+static NcShardmap *nc_shardmap_new_internal(nc_hash_create_func create,
+                                            nc_hash_compare_func compare,
+                                            nc_hash_free_func key_free,
+                                            nc_hash_free_func value_free)
+{
+        NcShardmap *map = NULL;
+
+        map = aligned_alloc(CACHE_LINE, sizeof(NcShardmap));
+        if (!map) {
+                return NULL;
+        }
+        memset(map, 0, sizeof(NcShardmap));
+        map->hash = create ? create : nc_simple_hash;
+
+        for (size_t i = 0; i < NC_SHARDMAP_SHARDS; i++) {
+                pthread_mutex_init(&map->shards[i].lock, NULL);
+        }
+        for (size_t i = 0; i < NC_SHARDMAP_SHARDS; i++) {
+                map->shards[i].map = nc_hashmap_new_full(map->hash, compare, key_free,
+                                                         value_free);
+                if (!map->shards[i].map) {
+                        nc_shardmap_free(map);
+                        return NULL;
+                }
+        }
+        return map;
+}
+
+NcShardmap *nc_shardmap_new(nc_hash_create_func create, nc_hash_compare_func compare)
+{
+        return nc_shardmap_new_internal(create, compare, NULL, NULL);
+}
+
+NcShardmap *nc_shardmap_new_full(nc_hash_create_func create, nc_hash_compare_func compare,
+                                 nc_hash_free_func key_free, nc_hash_free_func value_free)
+{
+        return nc_shardmap_new_internal(create, compare, key_free, value_free);
+}
+
+/**
+ * Find the shard of @key. The shard is picked by the top bits of the mixed
+ * hash, while NcHashmap mostly uses the low ones, so keys of one shard still
+ * spread over its slots.
+ */
+static inline NcShardmapShard *nc_shardmap_shard(NcShardmap *self, const void *key)
+{
+        uint64_t h = (uint64_t)self->hash(key) * 0x9e3779b97f4a7c15ULL;
+
+        return &self->shards[h >> 58 & (NC_SHARDMAP_SHARDS - 1)];
+}
+
+bool nc_shardmap_put(NcShardmap *self, const void *key, void *value)
+{
+        if (!self) {
+                return false;
+        }
+        NcShardmapShard *shard = nc_shardmap_shard(self, key);
+        bool ret;
+
+        pthread_mutex_lock(&shard->lock);
+        ret = nc_hashmap_put(shard->map, key, value);
+        pthread_mutex_unlock(&shard->lock);
+        return ret;
+}
+
+bool nc_shardmap_ensure_get(NcShardmap *self, const void *key, void **value)
+{
+        if (!self) {
+                return false;
+        }
+        NcShardmapShard *shard = nc_shardmap_shard(self, key);
+        bool ret;
+
+        pthread_mutex_lock(&shard->lock);
+        ret = nc_hashmap_ensure_get(shard->map, key, value);
+        pthread_mutex_unlock(&shard->lock);
+        return ret;
+}
+
+bool nc_shardmap_contains(NcShardmap *self, const void *key)
+{
+        void *value;
+
+        return nc_shardmap_ensure_get(self, key, &value) && value != NULL;
+}
+
+bool nc_shardmap_remove(NcShardmap *self, const void *key)
+{
+        if (!self) {
+                return false;
+        }
+        NcShardmapShard *shard = nc_shardmap_shard(self, key);
+        bool ret;
+
+        pthread_mutex_lock(&shard->lock);
+        ret = nc_hashmap_remove(shard->map, key);
+        pthread_mutex_unlock(&shard->lock);
+        return ret;
+}
+
+int nc_shardmap_with(NcShardmap *self, const void *key, nc_shardmap_func fn, void *data)
+{
+        NcShardmapShard *shard = nc_shardmap_shard(self, key);
+        int ret;
+
+        pthread_mutex_lock(&shard->lock);
+        ret = fn(shard->map, data);
+        pthread_mutex_unlock(&shard->lock);
+        return ret;
+}
+
+int nc_shardmap_size(NcShardmap *self)
+{
+        int size = 0;
+
+        if (!self) {
+                return -1;
+        }
+        for (size_t i = 0; i < NC_SHARDMAP_SHARDS; i++) {
+                pthread_mutex_lock(&self->shards[i].lock);
+                size += nc_hashmap_size(self->shards[i].map);
+                pthread_mutex_unlock(&self->shards[i].lock);
+        }
+        return size;
+}
+
+void nc_shardmap_free(NcShardmap *self)
+{
+        if (!self) {
+                return;
+        }
+        for (size_t i = 0; i < NC_SHARDMAP_SHARDS; i++) {
+                nc_hashmap_free(self->shards[i].map);
+                pthread_mutex_destroy(&self->shards[i].lock);
+        }
+        free(self);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
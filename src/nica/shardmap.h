@@ -0,0 +1,129 @@
+/*
+ * This file is part of libnica.
+ *
+ * Copyright (C) 2020 Intel Corporation
+ *
+ * libnica is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * This is a concurrent Hashmap built from NcHashmap shards, each behind
+ * its own lock. A key always lives in the shard its hash picks, so threads
+ * working on different keys rarely wait for each other, and a resize only
+ * holds up the threads of one shard, for 1/NC_SHARDMAP_SHARDS of the time
+ * a whole table would take.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+
+#include "hashmap.h"
+#include "util.h"
+
+/* Number of shards, a power of two well above the number of busy threads */
+#define NC_SHARDMAP_SHARDS 64
+
+typedef struct NcShardmap NcShardmap;
+
+/**
+ * Callback definition for nc_shardmap_with
+ *
+ * @param shard The shard holding the key, locked for the duration
+ * @param data Caller's data
+ *
+ * @return Anything, handed back by nc_shardmap_with
+ */
+typedef int (*nc_shardmap_func)(NcHashmap *shard, void *data);
+
+/**
+ * Create a new NcShardmap
+ *
+ * @param hash Hash creation function
+ * @param compare Key comparison function
+ *
+ * @return A newly allocated NcShardmap
+ */
+NcShardmap *nc_shardmap_new(nc_hash_create_func hash, nc_hash_compare_func compare);
+
+/**
+ * Create a new NcShardmap with cleanup functions
+ *
+ * @param hash Hash creation function
+ * @param compare Key comparison function
+ * @param key_free Function to free keys when removed/destroyed
+ * @param value_free Function to free values when removed/destroyed
+ *
+ * @return A newly allocated NcShardmap
+ */
+NcShardmap *nc_shardmap_new_full(nc_hash_create_func hash, nc_hash_compare_func compare,
+                                 nc_hash_free_func key_free, nc_hash_free_func value_free);
+
+/**
+ * Store a key/value pair in the shardmap, see nc_hashmap_put
+ *
+ * @return true if the operation succeeded
+ */
+bool nc_shardmap_put(NcShardmap *map, const void *key, void *value);
+
+/**
+ * Get the value associated with the unique key, see nc_hashmap_ensure_get
+ *
+ * @note Another thread may remove the key right after, so with a
+ * value_free function only nc_shardmap_with can use values safely
+ *
+ * @returns True if the key exists, otherwise false
+ */
+bool nc_shardmap_ensure_get(NcShardmap *map, const void *key, void **value);
+
+/**
+ * Determine if the key has an associated value in the NcShardmap
+ */
+bool nc_shardmap_contains(NcShardmap *map, const void *key);
+
+/**
+ * Remove the value and key identified by key, see nc_hashmap_remove
+ *
+ * @return true if the key/value pair were removed
+ */
+bool nc_shardmap_remove(NcShardmap *map, const void *key);
+
+/**
+ * Run @fn on the shard that holds, or would hold, @key, with the shard
+ * locked, for anything more than a single get, put or remove to happen
+ * atomically. @fn must only touch @key in the shard.
+ *
+ * @return What @fn returned
+ */
+int nc_shardmap_with(NcShardmap *map, const void *key, nc_shardmap_func fn, void *data);
+
+/**
+ * Return the current size of the shardmap, which may already have changed
+ *
+ * @return element count
+ */
+int nc_shardmap_size(NcShardmap *map);
+
+/**
+ * Free the given NcShardmap, and all keys/values if appropriate. No other
+ * thread may use it anymore.
+ */
+void nc_shardmap_free(NcShardmap *map);
+
+DEF_AUTOFREE(NcShardmap, nc_shardmap_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
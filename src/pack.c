@@ -0,0 +1,309 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Per-directory pack files
+ *
+ * clr_debug_prepare concatenates the tarballs of all entries of a source
+ * directory into <dir>.pack, and lists the byte range of each member in
+ * <dir>.idx. Runs of wanted members are fetched with one HTTP range
+ * request each, and if a large part of the pack is wanted anyway it is
+ * fetched whole. The result is extracted with a single tar invocation.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#include "daemon.h"
+#include "nica/util.h"
+
+#include "config.h"
+
+/* Fetch the whole pack when more than this fraction of it is wanted */
+#define PACK_WHOLE_FRACTION 0.5
+
+/* Fetch the whole pack rather than issuing more range requests than this */
+#define PACK_MAX_RANGES 8
+
+/**
+ * A single member of a pack, as listed in its index
+ */
+typedef struct PackMember {
+        unsigned long long offset; /**<Byte offset into the pack */
+        unsigned long long length; /**<Length of the member tarball */
+        const char *name;          /**<Entry name, points into the index */
+        bool wanted;               /**<Whether this member should be fetched */
+} PackMember;
+
+/**
+ * State of the pack download, shared by all range requests
+ */
+typedef struct PackDownload {
+        FILE *file;   /**<Staging file for the concatenated members */
+        CURL *curl;   /**<Handle, to look at the response code */
+        bool checked; /**<Whether the current response was inspected yet */
+        bool whole;   /**<Whether the server sent the whole pack */
+} PackDownload;
+
+static int pack_parse_index(char *data, PackMember **members)
+{
+        PackMember *list = NULL;
+        char *line, *saveptr = NULL;
+        int count = 0;
+
+        for (line = strtok_r(data, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+                PackMember m = { .wanted = false };
+                PackMember *grown;
+                int pos = 0;
+
+                if (sscanf(line, "%llu %llu %n", &m.offset, &m.length, &pos) != 2 || pos == 0 ||
+                    !line[pos]) {
+                        continue;
+                }
+                m.name = line + pos;
+
+                grown = realloc(list, (count + 1) * sizeof(PackMember));
+                if (!grown) {
+                        free(list);
+                        return -1;
+                }
+                list = grown;
+                list[count++] = m;
+        }
+
+        *members = list;
+        return count;
+}
+
+static size_t pack_write(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+        PackDownload *dl = userdata;
+
+        if (!dl->checked) {
+                long code = 0;
+
+                dl->checked = true;
+                curl_easy_getinfo(dl->curl, CURLINFO_RESPONSE_CODE, &code);
+                /* If-Range didn't match, or ranges aren't supported: this
+                 * is the whole (possibly newer) pack, drop what we have */
+                if (code == 200) {
+                        dl->whole = true;
+                        if (fflush(dl->file) != 0 || ftruncate(fileno(dl->file), 0) != 0) {
+                                return 0;
+                        }
+                        rewind(dl->file);
+                }
+        }
+
+        return fwrite(ptr, size, nmemb, dl->file);
+}
+
+static long pack_request(PackDownload *dl, const char *url, const char *range,
+                         struct curl_slist *headers)
+{
+        long ret = 0;
+
+        curl_easy_setopt(dl->curl, CURLOPT_URL, url);
+        curl_easy_setopt(dl->curl, CURLOPT_RANGE, range);
+        curl_easy_setopt(dl->curl, CURLOPT_HTTPHEADER, range ? headers : NULL);
+        dl->checked = false;
+
+        if (curl_easy_perform(dl->curl) != 0) {
+                return 418;
+        }
+        curl_easy_getinfo(dl->curl, CURLINFO_RESPONSE_CODE, &ret);
+        return ret;
+}
+
+int pack_fetch(const char *prefix, const char *dir, char **names, int n_names)
+{
+        autofree(char) *idx_url = NULL;
+        autofree(char) *pack_url = NULL;
+        autofree(char) *index = NULL;
+        autofree(char) *filename = NULL;
+        autofree(char) *if_range = NULL;
+        PackMember *members = NULL;
+        PackDownload dl = { .file = NULL, .curl = NULL, .checked = false, .whole = false };
+        struct curl_slist *headers = NULL;
+        unsigned long long total = 0, wanted = 0;
+        size_t len = 0;
+        time_t filetime = 0;
+        int count, n_ranges = 0;
+        int fd = -1;
+        long ret = 418;
+        int mirror = urlcounter % urls_size;
+        const char *base = urls[mirror];
+
+        if (asprintf(&idx_url, "%s%s%s.idx", base, prefix, dir) < 0 ||
+            asprintf(&pack_url, "%s%s%s.pack", base, prefix, dir) < 0) {
+                return 418;
+        }
+
+        ret = curl_get_buffer(idx_url, &index, &len, &filetime);
+        if (ret != 200) {
+                return ret;
+        }
+        ret = 418;
+
+        count = pack_parse_index(index, &members);
+        if (count <= 0) {
+                goto out;
+        }
+
+        for (int i = 0; i < count; i++) {
+                total += members[i].length;
+                if (!names) {
+                        members[i].wanted = true;
+                } else {
+                        for (int j = 0; j < n_names; j++) {
+                                if (strcmp(members[i].name, names[j]) == 0) {
+                                        members[i].wanted = true;
+                                        break;
+                                }
+                        }
+                }
+                if (!members[i].wanted) {
+                        continue;
+                }
+                wanted += members[i].length;
+                /* one range per run of wanted members */
+                if (i == 0 || !members[i - 1].wanted) {
+                        n_ranges++;
+                }
+        }
+        if (wanted == 0) {
+                goto out;
+        }
+
+        if (asprintf(&filename, "%s/%s/.pack-XXXXXX", CACHE_DIR, STAGING_SUBDIR) < 0) {
+                goto out;
+        }
+        fd = mkstemp(filename);
+        if (fd < 0) {
+                goto out;
+        }
+        dl.file = fdopen(fd, "w");
+        dl.curl = curl_easy_init();
+        if (!dl.file || !dl.curl) {
+                goto out;
+        }
+
+        curl_easy_setopt(dl.curl, CURLOPT_WRITEFUNCTION, pack_write);
+        curl_easy_setopt(dl.curl, CURLOPT_WRITEDATA, &dl);
+        curl_easy_setopt(dl.curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
+        curl_easy_setopt(dl.curl, CURLOPT_CONNECTTIMEOUT, 30L);
+        curl_easy_setopt(dl.curl, CURLOPT_LOW_SPEED_TIME, 30L);
+        curl_easy_setopt(dl.curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+
+        if (wanted > total * PACK_WHOLE_FRACTION || n_ranges > PACK_MAX_RANGES || !filetime) {
+                ret = pack_request(&dl, pack_url, NULL, NULL);
+        } else {
+                char date[64];
+
+                /* the pack and its index are published with the same mtime */
+                format_http_date(filetime, date, sizeof(date));
+                if (asprintf(&if_range, "If-Range: %s", date) < 0) {
+                        goto out;
+                }
+                headers = curl_slist_append(NULL, if_range);
+
+                for (int i = 0; i < count && !dl.whole; i++) {
+                        char range[64];
+                        unsigned long long start, end;
+
+                        if (!members[i].wanted) {
+                                continue;
+                        }
+                        start = members[i].offset;
+                        end = start + members[i].length;
+                        while (i + 1 < count && members[i + 1].wanted) {
+                                i++;
+                                end = members[i].offset + members[i].length;
+                        }
+
+                        snprintf(range, sizeof(range), "%llu-%llu", start, end - 1);
+                        ret = pack_request(&dl, pack_url, range, headers);
+                        if (ret != 206 && ret != 200) {
+                                goto out;
+                        }
+                }
+        }
+
+        if (ret != 200 && ret != 206) {
+                goto out;
+        }
+        if (fflush(dl.file) != 0) {
+                ret = 418;
+                goto out;
+        }
+
+        ret = extract_tarball(filename, prefix, true);
+        if (ret != 200) {
+                goto out;
+        }
+
+        /* the whole pack brings every member; the pack is published after
+         * them, so its date is a valid If-Modified-Since for each */
+        for (int i = 0; i < count; i++) {
+                autofree(char) *path = NULL;
+
+                if ((!members[i].wanted && !dl.whole) ||
+                    asprintf(&path, "%s/%s", dir, members[i].name) < 0) {
+                        continue;
+                }
+                index_record(prefix, path, 200, filetime, NULL, 0, mirror);
+                cache_note_access(prefix, path);
+        }
+
+out:
+        if (dl.curl) {
+                curl_easy_cleanup(dl.curl);
+        }
+        if (dl.file) {
+                fclose(dl.file);
+        } else if (fd >= 0) {
+                close(fd);
+        }
+        if (fd >= 0) {
+                unlink(filename);
+        }
+        curl_slist_free_all(headers);
+        free(members);
+        return ret == 206 ? 200 : ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,267 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Parallel range downloads
+ *
+ * A single stream is limited by the congestion window of one connection,
+ * which on high-latency links leaves most of the bandwidth unused for big
+ * tarballs. Large objects are therefore split into equal byte ranges that
+ * are fetched at the same time over separate connections, optionally
+ * spread across all mirrors, and written straight to their place in the
+ * staging file.
+ *
+ * Settings, from the environment:
+ *   CLR_DEBUGINFO_PARALLEL=N          Number of ranges, 1 disables this
+ *   CLR_DEBUGINFO_PARALLEL_MIRRORS=1  Spread the ranges across all mirrors
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#include "daemon.h"
+#include "nica/util.h"
+
+/* Default number of ranges per object */
+#define PARALLEL_DEFAULT_PARTS 4
+
+/* Upper bound for CLR_DEBUGINFO_PARALLEL */
+#define PARALLEL_MAX_PARTS 16
+
+static int parallel_parts = PARALLEL_DEFAULT_PARTS;
+static bool parallel_mirrors = false;
+
+/**
+ * One byte range of the object, written to the staging file as it arrives
+ */
+typedef struct RangePart {
+        CURL *curl;                  /**<Handle of this range request */
+        struct curl_slist *headers;  /**<If-Range header */
+        int fd;                      /**<Staging file */
+        curl_off_t offset;           /**<Where the next byte goes */
+        curl_off_t end;              /**<Last byte of the range */
+        bool checked;                /**<Whether the response code was checked yet */
+        bool done;                   /**<Whether the range was completely received */
+} RangePart;
+
+int parallel_init(void)
+{
+        const char *env = getenv("CLR_DEBUGINFO_PARALLEL");
+
+        if (env) {
+                parallel_parts = atoi(env);
+                if (parallel_parts < 1) {
+                        parallel_parts = 1;
+                } else if (parallel_parts > PARALLEL_MAX_PARTS) {
+                        parallel_parts = PARALLEL_MAX_PARTS;
+                }
+        }
+        env = getenv("CLR_DEBUGINFO_PARALLEL_MIRRORS");
+        parallel_mirrors = env && strcmp(env, "1") == 0;
+
+        return parallel_parts;
+}
+
+static size_t range_write(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+        RangePart *part = userdata;
+        size_t n = size * nmemb;
+
+        if (!part->checked) {
+                long code = 0;
+
+                part->checked = true;
+                curl_easy_getinfo(part->curl, CURLINFO_RESPONSE_CODE, &code);
+                /* anything but the range means the object changed underneath */
+                if (code != 206) {
+                        return 0;
+                }
+        }
+        if (part->offset + (curl_off_t)n > part->end + 1) {
+                return 0;
+        }
+        if (pwrite(part->fd, ptr, n, (off_t)part->offset) != (ssize_t)n) {
+                return 0;
+        }
+        part->offset += (curl_off_t)n;
+        return n;
+}
+
+/**
+ * Find the URL of the same object on mirror @n, counting from the one
+ * @url is on
+ */
+static char *mirror_url(const char *url, int n)
+{
+        const char *rel = url_relative(url);
+        char *ret = NULL;
+
+        if (!rel) {
+                return strdup(url);
+        }
+        for (int i = 0; i < urls_size; i++) {
+                if (strncmp(url, urls[i], (size_t)(rel - url)) != 0) {
+                        continue;
+                }
+                if (asprintf(&ret, "%s%s", urls[(i + n) % urls_size], rel) < 0) {
+                        return NULL;
+                }
+                return ret;
+        }
+        return strdup(url);
+}
+
+bool parallel_wanted(off_t length)
+{
+        return parallel_parts > 1 && length >= PARALLEL_MIN_SIZE;
+}
+
+bool parallel_fetch(const char *url, int fd, off_t length, time_t filetime)
+{
+        RangePart parts[PARALLEL_MAX_PARTS];
+        CURLM *multi = NULL;
+        CURLMsg *msg;
+        curl_off_t chunk;
+        char date[64];
+        autofree(char) *if_range = NULL;
+        int n_parts = parallel_parts;
+        int running = 0, left;
+        bool ret = false;
+
+        if (n_parts < 2 || length <= 0 || filetime <= 0) {
+                return false;
+        }
+        memset(parts, 0, sizeof(parts));
+
+        /* all ranges must come from the very object the first response described */
+        format_http_date(filetime, date, sizeof(date));
+        if (asprintf(&if_range, "If-Range: %s", date) < 0) {
+                return false;
+        }
+        if (ftruncate(fd, length) != 0) {
+                return false;
+        }
+
+        multi = curl_multi_init();
+        if (!multi) {
+                return false;
+        }
+        /* separate connections, rather than streams multiplexed over one */
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_NOTHING);
+
+        chunk = ((curl_off_t)length + n_parts - 1) / n_parts;
+        for (int i = 0; i < n_parts; i++) {
+                RangePart *part = &parts[i];
+                autofree(char) *part_url = NULL;
+                char range[64];
+
+                part->fd = fd;
+                part->offset = chunk * i;
+                part->end = part->offset + chunk - 1;
+                if (part->end >= (curl_off_t)length) {
+                        part->end = (curl_off_t)length - 1;
+                }
+                if (part->offset > part->end) {
+                        part->done = true;
+                        continue;
+                }
+
+                part_url = parallel_mirrors ? mirror_url(url, i) : strdup(url);
+                part->curl = curl_easy_init();
+                part->headers = curl_slist_append(NULL, if_range);
+                if (!part_url || !part->curl || !part->headers) {
+                        goto out;
+                }
+
+                snprintf(range,
+                         sizeof(range),
+                         "%lld-%lld",
+                         (long long)part->offset,
+                         (long long)part->end);
+                curl_easy_setopt(part->curl, CURLOPT_URL, part_url);
+                curl_easy_setopt(part->curl, CURLOPT_RANGE, range);
+                curl_easy_setopt(part->curl, CURLOPT_HTTPHEADER, part->headers);
+                curl_easy_setopt(part->curl, CURLOPT_WRITEFUNCTION, range_write);
+                curl_easy_setopt(part->curl, CURLOPT_WRITEDATA, part);
+                curl_easy_setopt(part->curl, CURLOPT_PRIVATE, part);
+                curl_easy_setopt(part->curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
+                curl_easy_setopt(part->curl, CURLOPT_PIPEWAIT, 0L);
+                curl_easy_setopt(part->curl, CURLOPT_CONNECTTIMEOUT, 30L);
+                curl_easy_setopt(part->curl, CURLOPT_LOW_SPEED_TIME, 30L);
+                curl_easy_setopt(part->curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+                curl_multi_add_handle(multi, part->curl);
+        }
+
+        do {
+                if (curl_multi_perform(multi, &running) != CURLM_OK) {
+                        goto out;
+                }
+                while ((msg = curl_multi_info_read(multi, &left))) {
+                        RangePart *part = NULL;
+
+                        if (msg->msg != CURLMSG_DONE) {
+                                continue;
+                        }
+                        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&part);
+                        if (msg->data.result != CURLE_OK || part->offset != part->end + 1) {
+                                /* one failed range fails the whole object */
+                                goto out;
+                        }
+                        part->done = true;
+                }
+                if (running && curl_multi_poll(multi, NULL, 0, 1000, NULL) != CURLM_OK) {
+                        goto out;
+                }
+        } while (running);
+
+        ret = true;
+        for (int i = 0; i < n_parts; i++) {
+                ret = ret && parts[i].done;
+        }
+
+out:
+        for (int i = 0; i < n_parts; i++) {
+                if (parts[i].curl) {
+                        curl_multi_remove_handle(multi, parts[i].curl);
+                        curl_easy_cleanup(parts[i].curl);
+                }
+                curl_slist_free_all(parts[i].headers);
+        }
+        curl_multi_cleanup(multi);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
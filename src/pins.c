@@ -0,0 +1,432 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Pinned cache entries
+ *
+ * Some debug information, such as that of the C library, is needed for
+ * nearly every crash. Pinned objects are never evicted, and are fetched
+ * and revalidated in the background shortly after the daemon starts, so
+ * they stay resident and current. A pin names an object, or a directory
+ * whose cached contents are all kept, as "<prefix><path>" relative to
+ * CACHE_DIR, e.g. "lib/usr/lib64/libc.so.6.debug".
+ *
+ * Pins come from the CLR_DEBUGINFO_PINS environment variable (space
+ * separated) and from PINS_FILE, which is maintained through the pin and
+ * unpin control commands, see clr_debug_ctl. Pinned objects are revalidated
+ * every PINS_INTERVAL for as long as the daemon runs.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "nica/util.h"
+
+#include "config.h"
+
+#define PINS_FILE CACHE_DIR "/" PINS_SUBDIR "/list"
+#define PINS_MAX 256
+#define PINS_START_DELAY 30      /* seconds after startup before revalidating */
+#define PINS_INTERVAL (6 * 3600) /* seconds between revalidations */
+#define PINS_RATE 10             /* objects per second */
+
+/**
+ * A single pin
+ */
+typedef struct Pin {
+        char *key;       /**<"<prefix><path>" relative to CACHE_DIR */
+        size_t len;      /**<Length of key */
+        bool persistent; /**<Whether it is stored in PINS_FILE */
+} Pin;
+
+static pthread_mutex_t pins_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Pin pins[PINS_MAX];
+static int n_pins = 0;
+static int revalidating = 0; /* threads fetching pinned objects */
+
+static bool pin_key_valid(const char *key)
+{
+        if (strncmp(key, "lib/", 4) != 0 && strncmp(key, "src/", 4) != 0) {
+                return false;
+        }
+        return !strstr(key, "..") && !strchr(key, '\'') && !strchr(key, ';') &&
+               !strpbrk(key, " \t\n");
+}
+
+/**
+ * Add @key to the pin list, with pins_mutex held
+ */
+static bool pins_add_locked(const char *key, bool persistent)
+{
+        size_t len = strlen(key);
+
+        /* a trailing slash would keep "dir/" from matching "dir" itself */
+        while (len > 4 && key[len - 1] == '/') {
+                len--;
+        }
+        for (int i = 0; i < n_pins; i++) {
+                if (pins[i].len == len && strncmp(pins[i].key, key, len) == 0) {
+                        pins[i].persistent |= persistent;
+                        return true;
+                }
+        }
+        if (n_pins == PINS_MAX) {
+                return false;
+        }
+        pins[n_pins].key = strndup(key, len);
+        if (!pins[n_pins].key) {
+                return false;
+        }
+        pins[n_pins].len = len;
+        pins[n_pins].persistent = persistent;
+        n_pins++;
+        return true;
+}
+
+/**
+ * Write the persistent pins to PINS_FILE, with pins_mutex held
+ */
+static bool pins_save_locked(void)
+{
+        autofree(char) *tmp = NULL;
+        FILE *f;
+        int fd;
+
+        if (asprintf(&tmp, "%s.XXXXXX", PINS_FILE) < 0) {
+                return false;
+        }
+        fd = mkstemp(tmp);
+        if (fd < 0) {
+                return false;
+        }
+        f = fdopen(fd, "w");
+        if (!f) {
+                close(fd);
+                unlink(tmp);
+                return false;
+        }
+        for (int i = 0; i < n_pins; i++) {
+                if (pins[i].persistent) {
+                        fprintf(f, "%s\n", pins[i].key);
+                }
+        }
+        if (fchmod(fd, 00644) != 0 || fclose(f) != 0 || rename(tmp, PINS_FILE) != 0) {
+                unlink(tmp);
+                return false;
+        }
+        return true;
+}
+
+bool pins_match(const char *key)
+{
+        bool ret = false;
+
+        pthread_mutex_lock(&pins_mutex);
+        for (int i = 0; i < n_pins && !ret; i++) {
+                /* the object itself, or anything below a pinned directory */
+                ret = strncmp(key, pins[i].key, pins[i].len) == 0 &&
+                      (key[pins[i].len] == '\0' || key[pins[i].len] == '/');
+        }
+        pthread_mutex_unlock(&pins_mutex);
+
+        return ret;
+}
+
+bool pins_remove(const char *key)
+{
+        size_t len = strlen(key);
+        bool ret = false;
+
+        while (len > 4 && key[len - 1] == '/') {
+                len--;
+        }
+        pthread_mutex_lock(&pins_mutex);
+        for (int i = 0; i < n_pins; i++) {
+                if (pins[i].len != len || strncmp(pins[i].key, key, len) != 0) {
+                        continue;
+                }
+                free(pins[i].key);
+                pins[i] = pins[--n_pins];
+                ret = pins_save_locked();
+                break;
+        }
+        pthread_mutex_unlock(&pins_mutex);
+
+        return ret;
+}
+
+char *pins_list(void)
+{
+        char *list = NULL;
+        size_t len = 0;
+        FILE *f;
+
+        f = open_memstream(&list, &len);
+        if (!f) {
+                return NULL;
+        }
+        pthread_mutex_lock(&pins_mutex);
+        for (int i = 0; i < n_pins; i++) {
+                fprintf(f, "%s%s\n", pins[i].key, pins[i].persistent ? "" : " (environment)");
+        }
+        pthread_mutex_unlock(&pins_mutex);
+        if (fclose(f) != 0) {
+                free(list);
+                return NULL;
+        }
+        return list;
+}
+
+/**
+ * Fetch the object @key, or revalidate it if it is cached already
+ */
+static void pins_fetch(const char *key)
+{
+        const struct timespec times[2] = { { .tv_nsec = UTIME_NOW }, { .tv_nsec = UTIME_OMIT } };
+        autofree(char) *prefix = strndup(key, 3);
+        autofree(char) *url = NULL;
+        autofree(char) *local = NULL;
+        const char *path = key + 3;
+        struct stat st = { .st_mtime = 0 };
+
+        if (!prefix || asprintf(&url, "%s%s.tar", urls[urlcounter % urls_size], key) < 0 ||
+            asprintf(&local, "%s/%s", CACHE_DIR, key) < 0) {
+                return;
+        }
+        if (lstat(local, &st) != 0) {
+                st.st_mtime = 0;
+        }
+        curl_get_file(url, prefix, path, st.st_mtime);
+        /* a 304 leaves the file alone, yet it must not age out in tmpfiles;
+         * the mtime is what If-Modified-Since is asked with, so keep it */
+        utimensat(AT_FDCWD, local, times, AT_SYMLINK_NOFOLLOW);
+        cache_note_access(prefix, path);
+        usleep(1000000 / PINS_RATE);
+}
+
+/**
+ * Revalidate everything cached below the directory @key
+ */
+static void pins_fetch_tree(const char *key)
+{
+        autofree(char) *local = NULL;
+        struct dirent *ent;
+        DIR *dir;
+
+        if (asprintf(&local, "%s/%s", CACHE_DIR, key) < 0) {
+                return;
+        }
+        dir = opendir(local);
+        if (!dir) {
+                return;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *child = NULL;
+
+                if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                        continue;
+                }
+                if (asprintf(&child, "%s/%s", key, ent->d_name) < 0) {
+                        break;
+                }
+                if (ent->d_type == DT_DIR) {
+                        pins_fetch_tree(child);
+                } else {
+                        pins_fetch(child);
+                }
+        }
+        closedir(dir);
+}
+
+/**
+ * Fetch or revalidate the objects @keys, freeing them
+ */
+static void pins_fetch_all(char **keys, int count)
+{
+        pthread_mutex_lock(&pins_mutex);
+        revalidating++;
+        pthread_mutex_unlock(&pins_mutex);
+
+        for (int i = 0; i < count; i++) {
+                autofree(char) *local = NULL;
+                struct stat st;
+
+                if (asprintf(&local, "%s/%s", CACHE_DIR, keys[i]) >= 0 &&
+                    lstat(local, &st) == 0 && S_ISDIR(st.st_mode)) {
+                        pins_fetch_tree(keys[i]);
+                } else {
+                        pins_fetch(keys[i]);
+                }
+                free(keys[i]);
+        }
+
+        pthread_mutex_lock(&pins_mutex);
+        revalidating--;
+        pthread_mutex_unlock(&pins_mutex);
+}
+
+static void *pins_thread(void *arg)
+{
+        char *keys[PINS_MAX];
+        int count;
+
+        /* revalidation is housekeeping, don't compete with lookups */
+        setpriority(PRIO_PROCESS, (id_t)gettid(), 19);
+
+        if (arg) {
+                keys[0] = arg;
+                pins_fetch_all(keys, 1);
+                return NULL;
+        }
+
+        sleep(PINS_START_DELAY);
+        while (1) {
+                count = 0;
+                pthread_mutex_lock(&pins_mutex);
+                for (int i = 0; i < n_pins; i++) {
+                        keys[count] = strdup(pins[i].key);
+                        if (keys[count]) {
+                                count++;
+                        }
+                }
+                pthread_mutex_unlock(&pins_mutex);
+
+                pins_fetch_all(keys, count);
+                sleep(PINS_INTERVAL);
+        }
+
+        return NULL;
+}
+
+/**
+ * Start a thread fetching the pin @key, or all pins periodically if NULL
+ */
+static void pins_revalidate(const char *key)
+{
+        pthread_t thread;
+        pthread_attr_t attr;
+        char *arg = NULL;
+
+        if (key) {
+                arg = strdup(key);
+                if (!arg) {
+                        return;
+                }
+        }
+        if (pthread_attr_init(&attr) != 0) {
+                free(arg);
+                return;
+        }
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, pins_thread, arg) != 0) {
+                free(arg);
+        }
+        pthread_attr_destroy(&attr);
+}
+
+bool pins_add(const char *key)
+{
+        bool ret;
+
+        if (!pin_key_valid(key)) {
+                return false;
+        }
+        pthread_mutex_lock(&pins_mutex);
+        ret = pins_add_locked(key, true) && pins_save_locked();
+        pthread_mutex_unlock(&pins_mutex);
+
+        if (ret) {
+                pins_revalidate(key);
+        }
+        return ret;
+}
+
+int pins_init(void)
+{
+        autofree(char) *env = NULL;
+        char *line = NULL;
+        size_t len = 0;
+        FILE *f;
+        int count;
+
+        if (getenv("CLR_DEBUGINFO_PINS")) {
+                char *token, *saveptr = NULL;
+
+                env = strdup(getenv("CLR_DEBUGINFO_PINS"));
+                for (token = env ? strtok_r(env, " \t\n", &saveptr) : NULL; token;
+                     token = strtok_r(NULL, " \t\n", &saveptr)) {
+                        if (!pin_key_valid(token) || !pins_add_locked(token, false)) {
+                                fprintf(stderr, "Ignoring pin %s\n", token);
+                        }
+                }
+        }
+
+        f = fopen(PINS_FILE, "r");
+        if (f) {
+                while (getline(&line, &len, f) > 0) {
+                        line[strcspn(line, "\n")] = '\0';
+                        if (pin_key_valid(line)) {
+                                pins_add_locked(line, true);
+                        }
+                }
+                free(line);
+                fclose(f);
+        }
+
+        count = n_pins;
+        if (count) {
+                pins_revalidate(NULL);
+        }
+        return count;
+}
+
+bool pins_busy(void)
+{
+        bool busy;
+
+        pthread_mutex_lock(&pins_mutex);
+        busy = revalidating > 0;
+        pthread_mutex_unlock(&pins_mutex);
+
+        return busy;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
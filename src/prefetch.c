@@ -0,0 +1,307 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Directory-sibling prefetch
+ *
+ * Source lookups come in bursts from the same package directory. Once a
+ * directory sees PREFETCH_HITS lookups within PREFETCH_WINDOW seconds, the
+ * directory listing published by clr_debug_prepare (<dir>.list) is fetched
+ * and the remaining entries are downloaded by a single low priority thread.
+ * They come from the directory's pack file where one exists, otherwise one
+ * by one at no more than PREFETCH_RATE objects per second.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "nica/files.h"
+#include "nica/hashmap.h"
+
+#include "config.h"
+
+#define PREFETCH_WINDOW 10 /* seconds */
+#define PREFETCH_HITS 2
+#define PREFETCH_HOLDOFF 600 /* don't rescan a directory more often than this */
+#define PREFETCH_QUEUE 32
+#define PREFETCH_MAX_ENTRIES 512
+#define PREFETCH_RATE 10 /* objects per second */
+
+/**
+ * Lookup history of a single directory
+ */
+typedef struct DirHits {
+        time_t first;  /**<Start of the current window */
+        time_t queued; /**<Last time this directory was queued */
+        int count;     /**<Lookups within the current window */
+} DirHits;
+
+static bool prefetch_enabled = false;
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static NcHashmap *dirs = NULL;
+static time_t last_expiry = 0;
+
+/* Ring of directories waiting to be prefetched */
+static char *queue[PREFETCH_QUEUE];
+static int queue_head = 0;
+static int queue_len = 0;
+static bool fetching = false; /* whether the thread is working on a directory */
+
+static void prefetch_dir(const char *dir)
+{
+        autofree(char) *url = NULL;
+        autofree(char) *list = NULL;
+        char *names[PREFETCH_MAX_ENTRIES];
+        char *line, *saveptr = NULL;
+        size_t len = 0;
+        int count = 0;
+
+        if (asprintf(&url, "%ssrc%s.list", urls[urlcounter % urls_size], dir) < 0) {
+                return;
+        }
+        if (curl_get_buffer(url, &list, &len, NULL) != 200) {
+                return;
+        }
+
+        for (line = strtok_r(list, "\n", &saveptr); line && count < PREFETCH_MAX_ENTRIES;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+                autofree(char) *local = NULL;
+
+                /* same restrictions as for requests coming in over the socket */
+                if (strchr(line, '/') || strstr(line, "..") || strchr(line, '\'') ||
+                    strchr(line, ';')) {
+                        continue;
+                }
+                if (asprintf(&local, "%s/src%s/%s", CACHE_DIR, dir, line) < 0) {
+                        return;
+                }
+                if (!nc_file_exists(local)) {
+                        names[count++] = line;
+                }
+        }
+        if (count == 0) {
+                return;
+        }
+
+        /* one request for all of them if the directory has a pack */
+        if (pack_fetch("src", dir, names, count) == 200) {
+                return;
+        }
+
+        for (int i = 0; i < count; i++) {
+                autofree(char) *objurl = NULL;
+                autofree(char) *path = NULL;
+                const char *base = urls[urlcounter % urls_size];
+
+                if (asprintf(&path, "%s/%s", dir, names[i]) < 0 ||
+                    asprintf(&objurl, "%ssrc%s.tar", base, path) < 0) {
+                        return;
+                }
+                /* with the path, so it is handled like any lookup */
+                if (curl_get_file(objurl, "src", path, 0) == 200) {
+                        cache_note_access("src", path);
+                }
+                usleep(1000000 / PREFETCH_RATE);
+        }
+}
+
+static void *prefetch_thread(__nc_unused__ void *arg)
+{
+        /* only use bandwidth and CPU nobody else wants */
+        setpriority(PRIO_PROCESS, (id_t)gettid(), 19);
+
+        while (1) {
+                char *dir;
+
+                pthread_mutex_lock(&prefetch_mutex);
+                while (queue_len == 0) {
+                        pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+                }
+                dir = queue[queue_head];
+                queue_head = (queue_head + 1) % PREFETCH_QUEUE;
+                queue_len--;
+                fetching = true;
+                pthread_mutex_unlock(&prefetch_mutex);
+
+                prefetch_dir(dir);
+                free(dir);
+
+                pthread_mutex_lock(&prefetch_mutex);
+                fetching = false;
+                pthread_mutex_unlock(&prefetch_mutex);
+        }
+        return NULL;
+}
+
+bool prefetch_init(void)
+{
+        const char *env_var = getenv("CLR_DEBUGINFO_PREFETCH");
+        pthread_t thread;
+
+        if (!env_var || strcmp(env_var, "1") != 0) {
+                return false;
+        }
+
+        dirs = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        if (!dirs) {
+                return false;
+        }
+        if (pthread_create(&thread, NULL, prefetch_thread, NULL) != 0) {
+                nc_hashmap_free(dirs);
+                dirs = NULL;
+                return false;
+        }
+        pthread_detach(thread);
+        prefetch_enabled = true;
+        return true;
+}
+
+int prefetch_queued(void)
+{
+        int len;
+
+        pthread_mutex_lock(&prefetch_mutex);
+        len = queue_len;
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        return len;
+}
+
+bool prefetch_busy(void)
+{
+        bool busy;
+
+        pthread_mutex_lock(&prefetch_mutex);
+        busy = fetching || queue_len > 0;
+        pthread_mutex_unlock(&prefetch_mutex);
+        return busy;
+}
+
+/**
+ * Forget the directories whose window has passed and which may be queued
+ * again, as they are no different from those never seen. Called with
+ * prefetch_mutex held.
+ */
+static void prefetch_expire(time_t now)
+{
+        char **expired;
+        NcHashmapIter iter;
+        void *key, *value;
+        int count = 0;
+
+        if (now - last_expiry < PREFETCH_WINDOW) {
+                return;
+        }
+        last_expiry = now;
+
+        expired = calloc((size_t)nc_hashmap_size(dirs) + 1, sizeof(char *));
+        if (!expired) {
+                return;
+        }
+        nc_hashmap_iter_init(dirs, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, &value)) {
+                DirHits *hits = value;
+
+                if (now - hits->first > PREFETCH_WINDOW && now - hits->queued > PREFETCH_HOLDOFF) {
+                        expired[count++] = key;
+                }
+        }
+        for (int i = 0; i < count; i++) {
+                nc_hashmap_remove(dirs, expired[i]);
+        }
+        free(expired);
+}
+
+void prefetch_note_hit(const char *prefix, const char *path)
+{
+        autofree(char) *dir = NULL;
+        char *c;
+        DirHits *hits;
+        time_t now;
+
+        if (!prefetch_enabled || strcmp(prefix, "src") != 0) {
+                return;
+        }
+
+        dir = strdup(path);
+        if (!dir) {
+                return;
+        }
+        c = strrchr(dir, '/');
+        /* the top level holds every package, never prefetch it */
+        if (!c || c == dir) {
+                return;
+        }
+        *c = 0;
+
+        now = time(NULL);
+        pthread_mutex_lock(&prefetch_mutex);
+        prefetch_expire(now);
+
+        hits = nc_hashmap_get(dirs, dir);
+        if (!hits) {
+                char *key = strdup(dir);
+
+                hits = calloc(1, sizeof(DirHits));
+                if (!key || !hits || !nc_hashmap_put(dirs, key, hits)) {
+                        free(key);
+                        free(hits);
+                        goto out;
+                }
+        }
+
+        if (now - hits->first > PREFETCH_WINDOW) {
+                hits->first = now;
+                hits->count = 0;
+        }
+        hits->count++;
+
+        if (hits->count >= PREFETCH_HITS && now - hits->queued > PREFETCH_HOLDOFF &&
+            queue_len < PREFETCH_QUEUE) {
+                queue[(queue_head + queue_len) % PREFETCH_QUEUE] = dir;
+                dir = NULL;
+                queue_len++;
+                hits->queued = now;
+                pthread_cond_signal(&prefetch_cond);
+        }
+
+out:
+        pthread_mutex_unlock(&prefetch_mutex);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,348 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "nica/util.h"
+#include "seekable.h"
+
+static inline uint32_t read_le32(const uint8_t *p)
+{
+        return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void write_le32(uint8_t *p, uint32_t v)
+{
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)(v >> 8);
+        p[2] = (uint8_t)(v >> 16);
+        p[3] = (uint8_t)(v >> 24);
+}
+
+size_t seekable_table_size(const uint8_t *footer)
+{
+        uint32_t n_frames = read_le32(footer);
+        uint8_t descriptor = footer[4];
+
+        if (read_le32(footer + 5) != SEEKABLE_MAGIC) {
+                return 0;
+        }
+        /* reserved bits must be clear */
+        if (descriptor & 0x7c) {
+                return 0;
+        }
+        return SEEKABLE_SKIPPABLE_HEADER_SIZE +
+               (size_t)n_frames * (SEEKABLE_ENTRY_SIZE + ((descriptor & 0x80) ? 4 : 0)) +
+               SEEKABLE_FOOTER_SIZE;
+}
+
+SeekTable *seekable_parse_table(const uint8_t *buf, size_t len)
+{
+        SeekTable *table = NULL;
+        const uint8_t *entry;
+        size_t entry_size;
+        uint32_t n_frames;
+
+        if (len < SEEKABLE_SKIPPABLE_HEADER_SIZE + SEEKABLE_FOOTER_SIZE) {
+                return NULL;
+        }
+        if (seekable_table_size(buf + len - SEEKABLE_FOOTER_SIZE) != len ||
+            read_le32(buf) != SEEKABLE_SKIPPABLE_MAGIC ||
+            read_le32(buf + 4) != len - SEEKABLE_SKIPPABLE_HEADER_SIZE) {
+                return NULL;
+        }
+        n_frames = read_le32(buf + len - SEEKABLE_FOOTER_SIZE);
+        entry_size = SEEKABLE_ENTRY_SIZE + ((buf[len - 5] & 0x80) ? 4 : 0);
+
+        table = calloc(1, sizeof(SeekTable));
+        if (!table) {
+                return NULL;
+        }
+        table->n_frames = n_frames;
+        table->c_offsets = calloc(n_frames + 1, sizeof(uint64_t));
+        table->d_offsets = calloc(n_frames + 1, sizeof(uint64_t));
+        if (!table->c_offsets || !table->d_offsets) {
+                seekable_free(table);
+                return NULL;
+        }
+
+        entry = buf + SEEKABLE_SKIPPABLE_HEADER_SIZE;
+        for (uint32_t i = 0; i < n_frames; i++, entry += entry_size) {
+                uint32_t c_len = read_le32(entry), d_len = read_le32(entry + 4);
+
+                /* callers allocate whole frames, don't let the table size them */
+                if (c_len > SEEKABLE_FRAME_MAX || d_len > SEEKABLE_FRAME_MAX) {
+                        seekable_free(table);
+                        return NULL;
+                }
+                table->c_offsets[i + 1] = table->c_offsets[i] + c_len;
+                table->d_offsets[i + 1] = table->d_offsets[i] + d_len;
+        }
+
+        return table;
+}
+
+SeekTable *seekable_read_table(int fd)
+{
+        autofree(char) *buf = NULL;
+        uint8_t footer[SEEKABLE_FOOTER_SIZE];
+        struct stat st;
+        size_t size;
+
+        if (fstat(fd, &st) != 0 || st.st_size < SEEKABLE_FOOTER_SIZE) {
+                return NULL;
+        }
+        if (pread(fd, footer, sizeof(footer), st.st_size - SEEKABLE_FOOTER_SIZE) !=
+            sizeof(footer)) {
+                return NULL;
+        }
+        size = seekable_table_size(footer);
+        if (size == 0 || (off_t)size > st.st_size) {
+                return NULL;
+        }
+        buf = malloc(size);
+        if (!buf || pread(fd, buf, size, st.st_size - (off_t)size) != (ssize_t)size) {
+                return NULL;
+        }
+        return seekable_parse_table((const uint8_t *)buf, size);
+}
+
+int seekable_find_frame(const SeekTable *table, uint64_t offset)
+{
+        uint32_t lo = 0, hi = table->n_frames;
+
+        if (offset >= table->d_offsets[table->n_frames]) {
+                return -1;
+        }
+        /* find the last frame starting at or before offset */
+        while (hi - lo > 1) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (table->d_offsets[mid] <= offset) {
+                        lo = mid;
+                } else {
+                        hi = mid;
+                }
+        }
+        return (int)lo;
+}
+
+void seekable_free(SeekTable *table)
+{
+        if (!table) {
+                return;
+        }
+        free(table->c_offsets);
+        free(table->d_offsets);
+        free(table);
+}
+
+#ifdef HAVE_ZSTD
+ssize_t seekable_decompress_frame(const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+        size_t ret = ZSTD_decompress(dst, dst_len, src, src_len);
+
+        if (ZSTD_isError(ret)) {
+                return -1;
+        }
+        return (ssize_t)ret;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+        const char *p = buf;
+
+        while (len > 0) {
+                ssize_t r = write(fd, p, len);
+                if (r <= 0) {
+                        return false;
+                }
+                p += r;
+                len -= (size_t)r;
+        }
+        return true;
+}
+
+bool seekable_compress(int in_fd, int out_fd, size_t frame_size, int level)
+{
+        autofree(char) *in = NULL;
+        autofree(char) *out = NULL;
+        autofree(char) *table = NULL;
+        ZSTD_CCtx *cctx = NULL;
+        size_t out_size = ZSTD_compressBound(frame_size);
+        size_t table_len = 0, table_alloc = 0;
+        uint32_t n_frames = 0;
+        bool ret = false;
+
+        in = malloc(frame_size);
+        out = malloc(out_size);
+        cctx = ZSTD_createCCtx();
+        if (!in || !out || !cctx) {
+                goto out;
+        }
+
+        while (1) {
+                size_t len = 0;
+                size_t c_len;
+
+                /* fill a whole frame, short reads are fine */
+                while (len < frame_size) {
+                        ssize_t r = read(in_fd, in + len, frame_size - len);
+                        if (r < 0) {
+                                goto out;
+                        }
+                        if (r == 0) {
+                                break;
+                        }
+                        len += (size_t)r;
+                }
+                if (len == 0) {
+                        break;
+                }
+
+                c_len = ZSTD_compressCCtx(cctx, out, out_size, in, len, level);
+                if (ZSTD_isError(c_len) || !write_all(out_fd, out, c_len)) {
+                        goto out;
+                }
+
+                if (table_len + SEEKABLE_ENTRY_SIZE > table_alloc) {
+                        char *grown;
+                        table_alloc = table_alloc ? table_alloc * 2 : 4096;
+                        grown = realloc(table, table_alloc);
+                        if (!grown) {
+                                goto out;
+                        }
+                        table = grown;
+                }
+                write_le32((uint8_t *)table + table_len, (uint32_t)c_len);
+                write_le32((uint8_t *)table + table_len + 4, (uint32_t)len);
+                table_len += SEEKABLE_ENTRY_SIZE;
+                n_frames++;
+        }
+
+        {
+                uint8_t header[SEEKABLE_SKIPPABLE_HEADER_SIZE];
+                uint8_t footer[SEEKABLE_FOOTER_SIZE];
+
+                write_le32(header, SEEKABLE_SKIPPABLE_MAGIC);
+                write_le32(header + 4, (uint32_t)(table_len + SEEKABLE_FOOTER_SIZE));
+                write_le32(footer, n_frames);
+                footer[4] = 0; /* no checksums */
+                write_le32(footer + 5, SEEKABLE_MAGIC);
+
+                if (!write_all(out_fd, header, sizeof(header)) ||
+                    (table_len && !write_all(out_fd, table, table_len)) ||
+                    !write_all(out_fd, footer, sizeof(footer))) {
+                        goto out;
+                }
+        }
+        ret = true;
+
+out:
+        ZSTD_freeCCtx(cctx);
+        return ret;
+}
+#endif /* HAVE_ZSTD */
+
+SeekTable *partial_load(int fd, PartialHeader *header)
+{
+        SeekTable *table = NULL;
+        size_t len;
+
+        if (pread(fd, header, sizeof(PartialHeader), 0) != sizeof(PartialHeader) ||
+            header->magic != PARTIAL_MAGIC) {
+                return NULL;
+        }
+
+        table = calloc(1, sizeof(SeekTable));
+        if (!table) {
+                return NULL;
+        }
+        table->n_frames = header->n_frames;
+        len = (header->n_frames + 1) * sizeof(uint64_t);
+        table->c_offsets = malloc(len);
+        table->d_offsets = malloc(len);
+        if (!table->c_offsets || !table->d_offsets ||
+            pread(fd, table->c_offsets, len, sizeof(PartialHeader)) != (ssize_t)len ||
+            pread(fd, table->d_offsets, len, (off_t)(sizeof(PartialHeader) + len)) !=
+                (ssize_t)len) {
+                seekable_free(table);
+                return NULL;
+        }
+        return table;
+}
+
+bool partial_range_present(int fd, const SeekTable *table, uint64_t offset, uint64_t size)
+{
+        autofree(char) *status = NULL;
+        int first, last;
+
+        if (size == 0) {
+                return true;
+        }
+        first = seekable_find_frame(table, offset);
+        if (first < 0) {
+                /* reads past the end are always satisfied */
+                return true;
+        }
+        last = seekable_find_frame(table, offset + size - 1);
+        if (last < 0) {
+                last = (int)table->n_frames - 1;
+        }
+
+        status = malloc((size_t)(last - first + 1));
+        if (!status) {
+                return false;
+        }
+        if (pread(fd, status, (size_t)(last - first + 1),
+                  partial_status_offset(table->n_frames) + first) != last - first + 1) {
+                return false;
+        }
+        for (int i = 0; i <= last - first; i++) {
+                if (!status[i]) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
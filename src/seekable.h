@@ -0,0 +1,197 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * Seekable zstd files, as described in the zstd seekable format
+ * specification: a series of independently compressed frames, followed by
+ * a skippable frame holding the compressed and decompressed size of each.
+ */
+
+#define SEEKABLE_MAGIC 0x8F92EAB1
+#define SEEKABLE_SKIPPABLE_MAGIC 0x184D2A5E
+#define SEEKABLE_SKIPPABLE_HEADER_SIZE 8
+#define SEEKABLE_FOOTER_SIZE 9
+#define SEEKABLE_ENTRY_SIZE 8
+
+/* Default amount of uncompressed data per frame */
+#define SEEKABLE_FRAME_SIZE (1024 * 1024)
+
+/* Tables with larger frames, compressed or not, are rejected as broken */
+#define SEEKABLE_FRAME_MAX (64 * 1024 * 1024)
+
+/**
+ * Frame boundaries of a seekable file
+ */
+typedef struct SeekTable {
+        uint32_t n_frames;    /**<Number of frames */
+        uint64_t *c_offsets;  /**<Compressed frame offsets, n_frames + 1 entries */
+        uint64_t *d_offsets;  /**<Decompressed frame offsets, n_frames + 1 entries */
+} SeekTable;
+
+/**
+ * Determine the size of the seek table from the footer at the very end of
+ * a seekable file
+ *
+ * @return Size of the skippable frame holding the seek table, or 0 if
+ * @footer isn't a valid seekable footer
+ */
+size_t seekable_table_size(const uint8_t *footer);
+
+/**
+ * Parse the seek table in @buf, which holds the whole skippable frame
+ *
+ * @return A newly allocated SeekTable, or NULL if @buf isn't valid or has
+ * a frame larger than SEEKABLE_FRAME_MAX
+ */
+SeekTable *seekable_parse_table(const uint8_t *buf, size_t len);
+
+/**
+ * Read the seek table from the end of the seekable file open at @fd
+ *
+ * @return A newly allocated SeekTable, or NULL if @fd isn't seekable zstd
+ */
+SeekTable *seekable_read_table(int fd);
+
+/**
+ * Find the frame that holds decompressed offset @offset
+ *
+ * @return The frame index, or -1 if @offset is past the end
+ */
+int seekable_find_frame(const SeekTable *table, uint64_t offset);
+
+void seekable_free(SeekTable *table);
+
+#ifdef HAVE_ZSTD
+/**
+ * Decompress a single frame from @src into @dst
+ *
+ * @return The decompressed size, or -1 on error
+ */
+ssize_t seekable_decompress_frame(const void *src, size_t src_len, void *dst, size_t dst_len);
+
+/**
+ * Compress everything readable from @in_fd into seekable zstd on @out_fd
+ *
+ * @param frame_size Amount of uncompressed data per frame
+ * @param level zstd compression level
+ *
+ * @return true if this succeeded
+ */
+bool seekable_compress(int in_fd, int out_fd, size_t frame_size, int level);
+#endif
+
+/*
+ * Partial files
+ *
+ * Huge objects are made available before they are downloaded. The daemon
+ * creates a sparse file of the final size, and a map below
+ * CACHE_DIR/PARTIAL_SUBDIR with the same relative path that records the
+ * frame boundaries and which frames have been filled in. Once every frame
+ * is present the map is removed.
+ */
+
+#define PARTIAL_SUBDIR "partial"
+
+#define PARTIAL_MAGIC 0x50524c43 /* "CLRP" */
+
+/**
+ * Header of a partial map. It is followed by the compressed and
+ * decompressed offsets of the seek table, n_frames + 1 uint64_t each, and
+ * then by one status byte per frame, non-zero once the frame is present.
+ */
+typedef struct PartialHeader {
+        uint32_t magic;        /**<PARTIAL_MAGIC */
+        uint32_t n_frames;     /**<Number of frames */
+        int64_t last_modified; /**<Last-Modified of the seekable object */
+} PartialHeader;
+
+/**
+ * Offset of the frame status bytes in a partial map
+ */
+static inline off_t partial_status_offset(uint32_t n_frames)
+{
+        return (off_t)(sizeof(PartialHeader) + 2 * (n_frames + 1) * sizeof(uint64_t));
+}
+
+/**
+ * Load the header and seek table of the partial map open at @fd
+ *
+ * @return A newly allocated SeekTable, or NULL if @fd isn't a partial map
+ */
+SeekTable *partial_load(int fd, PartialHeader *header);
+
+/**
+ * Determine whether all frames covering @size bytes at @offset are present
+ */
+bool partial_range_present(int fd, const SeekTable *table, uint64_t offset, uint64_t size);
+
+/*
+ * Compressed-at-rest files
+ *
+ * With CLR_DEBUGINFO_COMPRESS set, the daemon stores extracted files as
+ * seekable zstd with COMPRESSED_FRAME_SIZE bytes per frame, and marks them
+ * with COMPRESSED_MODE, which means nothing else for regular files. The
+ * FUSE layer serves them as if they were stored uncompressed.
+ */
+
+#define COMPRESSED_MODE S_ISVTX
+
+/* Small frames, as debuggers read a few KiB at scattered offsets */
+#define COMPRESSED_FRAME_SIZE (256 * 1024)
+
+#ifdef HAVE_ZSTD
+/**
+ * Determine the uncompressed size of the compressed file open at @fd,
+ * whose attributes are @st
+ *
+ * @return 0 on success, or a negative errno
+ */
+int compressed_size(int fd, const struct stat *st, off_t *size);
+
+/**
+ * Read @size uncompressed bytes at @offset of the compressed file open at
+ * @fd, whose attributes are @st, decompressing only the frames needed
+ *
+ * @return The number of bytes read, or a negative errno
+ */
+int compressed_read(int fd, const struct stat *st, char *buf, size_t size, off_t offset);
+#endif
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,109 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * clr_debug_seekable -- write seekable zstd versions of large objects,
+ * used by clr_debug_prepare
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "seekable.h"
+
+static void usage(const char *name)
+{
+        fprintf(stderr,
+                "Usage: %s [-l LEVEL] [-f FRAMESIZE] INPUT OUTPUT\n"
+                "Compresses INPUT into OUTPUT as seekable zstd, with FRAMESIZE bytes\n"
+                "(default %d) of INPUT per independently compressed frame.\n",
+                name,
+                SEEKABLE_FRAME_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+        int level = 3;
+        size_t frame_size = SEEKABLE_FRAME_SIZE;
+        int in_fd, out_fd;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "l:f:h")) != -1) {
+                switch (opt) {
+                case 'l':
+                        level = atoi(optarg);
+                        break;
+                case 'f':
+                        frame_size = strtoul(optarg, NULL, 10);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+        }
+        /* leave room for incompressible frames to grow */
+        if (argc - optind != 2 || frame_size == 0 || frame_size > SEEKABLE_FRAME_MAX / 2) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        in_fd = open(argv[optind], O_RDONLY);
+        if (in_fd < 0) {
+                fprintf(stderr, "Failed to open %s: %s\n", argv[optind], strerror(errno));
+                return EXIT_FAILURE;
+        }
+        out_fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 00644);
+        if (out_fd < 0) {
+                fprintf(stderr, "Failed to open %s: %s\n", argv[optind + 1], strerror(errno));
+                close(in_fd);
+                return EXIT_FAILURE;
+        }
+
+        if (!seekable_compress(in_fd, out_fd, frame_size, level) || fsync(out_fd) != 0) {
+                fprintf(stderr, "Failed to compress %s\n", argv[optind]);
+                close(in_fd);
+                close(out_fd);
+                unlink(argv[optind + 1]);
+                return EXIT_FAILURE;
+        }
+
+        close(in_fd);
+        close(out_fd);
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -26,7 +26,9 @@
 
 #define _GNU_SOURCE
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <libgen.h>
 #include <linux/capability.h>
@@ -38,6 +40,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -45,14 +48,18 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include "daemon.h"
 #include "nica/files.h"
 #include "nica/hashmap.h"
+#include "nica/shardmap.h"
+#include "seekable.h"
 
 #include <curl/curl.h>
 
 #include "systemd/sd-daemon.h"
 
 #include "config.h"
+#include "trace.h"
 
 #ifdef HAVE_ATOMIC_SUPPORT
 #include <stdatomic.h>
@@ -60,43 +67,57 @@
 
 #define TIMEOUT 600 /* 10 minutes */
 
-static pthread_mutex_t dupes_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 char *urls_default[] = { "https://cdn.download.clearlinux.org/debuginfo/",
                          "https://cdn-alt.download.clearlinux.org/debuginfo/" };
 int urls_size = 2;
 int urlcounter = 1;
 char **urls = urls_default;
 
-static NcHashmap *hash = NULL;
+/* URLs requested lately, with the time of the request */
+static NcShardmap *dupes = NULL;
+
+_Thread_local uint64_t trace_request = 0;
 
 #define MAX_CONNECTIONS 16
 
-static int avoid_dupes(const char *url)
+/*
+ * Check whether @data, a URL, was requested in the last ten minutes, else
+ * note it as requested now, with the shard of the URL locked
+ */
+static int check_dupe(NcHashmap *shard, void *data)
 {
-        int retval = 0;
+        const char *url = data;
         void *value;
-        pthread_mutex_lock(&dupes_mutex);
-
-        if (hash == NULL) {
-                hash = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
-        }
 
-        if (nc_hashmap_ensure_get(hash, url, &value)) {
+        if (nc_hashmap_ensure_get(shard, url, &value)) {
                 unsigned long tm;
                 tm = (unsigned long)value;
                 if (time(NULL) - tm < 600) {
-                        retval = 1;
+                        return 1;
                 }
         } else {
                 unsigned long tm;
                 tm = time(NULL);
-                void *data = (void *)(unsigned long)tm;
-                nc_hashmap_put(hash, strdup(url), data);
+                char *key = strdup(url);
+                if (key && !nc_hashmap_put(shard, key, (void *)tm)) {
+                        free(key);
+                }
         }
+        return 0;
+}
 
-        pthread_mutex_unlock(&dupes_mutex);
-        return retval;
+static int avoid_dupes(const char *url)
+{
+        return nc_shardmap_with(dupes, url, check_dupe, (void *)url);
+}
+
+/*
+ * Allow @url to be requested again right away, e.g. to resume a download
+ * that failed
+ */
+static void forget_dupe(const char *url)
+{
+        nc_shardmap_remove(dupes, url);
 }
 
 /*
@@ -143,6 +164,31 @@ int configure_urls(void)
         return count;
 }
 
+const char *url_relative(const char *url)
+{
+        for (int i = 0; i < urls_size; i++) {
+                size_t len = strlen(urls[i]);
+
+                if (strncmp(url, urls[i], len) == 0) {
+                        return url + len;
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Determine which of the URLs @url is on, for the validator index
+ */
+static int url_mirror(const char *url)
+{
+        for (int i = 0; i < urls_size; i++) {
+                if (strncmp(url, urls[i], strlen(urls[i])) == 0) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
 void free_urls(void)
 {
         if (urls != urls_default) {
@@ -221,19 +267,481 @@ __nc_inline__ static inline void dec_connection_count(void)
 
 #endif /* !(HAVE_ATOMIC_SUPPORT) */
 
-static int curl_get_file(const char *url, const char *prefix, time_t timestamp)
+double timedelta(struct timeval before, struct timeval after)
+{
+        double d;
+        d = 1.0 * (after.tv_sec - before.tv_sec) +
+            (1.0 * after.tv_usec - before.tv_usec) / 1000000.0;
+        return d;
+}
+
+/**
+ * Move everything below @from into place below @to, one rename() per file
+ * so readers see either the old or the complete new version, never a
+ * partially written one
+ *
+ * @return true if everything was moved
+ */
+static bool publish_tree(const char *from, const char *to)
+{
+        DIR *dir = NULL;
+        struct dirent *ent;
+        bool ret = true;
+
+        dir = opendir(from);
+        if (!dir) {
+                return false;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *src = NULL;
+                autofree(char) *dst = NULL;
+                struct stat st;
+
+                if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                        continue;
+                }
+                if (asprintf(&src, "%s/%s", from, ent->d_name) < 0 ||
+                    asprintf(&dst, "%s/%s", to, ent->d_name) < 0) {
+                        ret = false;
+                        break;
+                }
+                if (lstat(src, &st) != 0) {
+                        ret = false;
+                        continue;
+                }
+
+                if (S_ISDIR(st.st_mode)) {
+                        struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+                        if (mkdir(dst, st.st_mode & 07777) != 0 && errno != EEXIST) {
+                                ret = false;
+                                continue;
+                        }
+                        if (!publish_tree(src, dst)) {
+                                ret = false;
+                        }
+                        /* moving the contents in changed it, and it is used
+                         * for If-Modified-Since just like files are */
+                        utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
+                        continue;
+                }
+#ifdef HAVE_ZSTD
+                /* compressed first, so identical files still share a copy */
+                compress_file(src, &st);
+#endif
+                if (!cas_publish(src, dst, &st)) {
+                        fprintf(stderr, "Failed to publish %s: %s\n", dst, strerror(errno));
+                        ret = false;
+                }
+        }
+        closedir(dir);
+        return ret;
+}
+
+static int extract(const char *filename, const char *data, size_t len, const char *prefix,
+                   bool concatenated)
+{
+        autofree(char) *args = NULL;
+        autofree(char) *staging = NULL;
+        autofree(char) *target = NULL;
+        /* concatenated archives have an end-of-archive marker per member */
+        const char *flags = concatenated ? "--ignore-zeros " : "";
+        struct timeval before, after;
+        int ret = 200;
+
+        gettimeofday(&before, NULL);
+
+        /* test extraction first */
+        if (asprintf(&args,
+                     "-C %s/%s --no-same-owner "
+                     "--no-same-permissions %s-t",
+                     CACHE_DIR,
+                     prefix,
+                     flags) < 0) {
+                return 418;
+        }
+
+        TRACE(extract__validate, trace_request);
+        if (!run_tar(args, filename, data, len)) {
+                fprintf(stderr, "Error: tar validation failed\n");
+                return 418;
+        }
+
+        /* extract next to the cache on the same filesystem, then move into place */
+        if (asprintf(&staging, "%s/%s/.extract-XXXXXX", CACHE_DIR, STAGING_SUBDIR) < 0 ||
+            asprintf(&target, "%s/%s", CACHE_DIR, prefix) < 0) {
+                return 418;
+        }
+        if (!mkdtemp(staging)) {
+                fprintf(stderr, "Failed to create %s: %s\n", staging, strerror(errno));
+                return 418;
+        }
+
+        free(args); /* reuse */
+        if (asprintf(&args,
+                     "-C %s --no-same-owner "
+                     "--no-same-permissions %s-x",
+                     staging,
+                     flags) < 0) {
+                ret = 418;
+                goto out;
+        }
+
+        TRACE(extract__unpack, trace_request);
+        if (!run_tar(args, filename, data, len)) {
+                fprintf(stderr, "Error: tar extraction failed\n");
+                ret = 418;
+                goto out;
+        }
+
+        TRACE(extract__publish, trace_request);
+        if (!publish_tree(staging, target)) {
+                ret = 418;
+        }
+
+out:
+        nc_rm_rf(staging);
+        TRACE(extract__done, trace_request, ret);
+        gettimeofday(&after, NULL);
+        stats_extract(timedelta(before, after));
+        return ret;
+}
+
+int extract_tarball(const char *filename, const char *prefix, bool concatenated)
+{
+        return extract(filename, NULL, 0, prefix, concatenated);
+}
+
+int extract_buffer(const char *data, size_t len, const char *prefix)
+{
+        return extract(NULL, data, len, prefix, false);
+}
+
+/*
+ * Small objects, which are most of them, are downloaded into one of a few
+ * recycled buffers and unpacked straight from there
+ */
+#define MEMORY_MAX (256 * 1024)
+#define MEMORY_POOL_SIZE 8
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *pool[MEMORY_POOL_SIZE];
+static int pool_count = 0;
+
+static char *buffer_pool_get(void)
+{
+        char *buf = NULL;
+
+        pthread_mutex_lock(&pool_mutex);
+        if (pool_count > 0) {
+                buf = pool[--pool_count];
+        }
+        pthread_mutex_unlock(&pool_mutex);
+
+        return buf ? buf : malloc(MEMORY_MAX);
+}
+
+static void buffer_pool_put(char *buf)
+{
+        if (!buf) {
+                return;
+        }
+        pthread_mutex_lock(&pool_mutex);
+        if (pool_count < MEMORY_POOL_SIZE) {
+                pool[pool_count++] = buf;
+                buf = NULL;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+        free(buf);
+}
+
+/**
+ * Count the response to the transfer @curl of @url just performed, which
+ * ended with @code
+ */
+static void note_transfer(CURL *curl, const char *url, CURLcode code)
+{
+        curl_off_t bytes = 0;
+        long response = 0;
+
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+        stats_response(url_mirror(url), response, code != CURLE_OK,
+                       bytes > 0 ? (uint64_t)bytes : 0);
+
+#ifdef HAVE_SYS_SDT_H
+        {
+                /* each in microseconds since the transfer started */
+                curl_off_t dns = 0, connect = 0, tls = 0, first_byte = 0, total = 0;
+
+                curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+                curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+                curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+                curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+                curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+                TRACE(http__done, trace_request, url, response, dns, connect, tls, first_byte,
+                      total, bytes);
+        }
+#endif
+}
+
+/**
+ * Tracks a download into a staging file, see curl_get_file()
+ */
+typedef struct FileDownload {
+        FILE *file;             /**<Staging file */
+        CURL *curl;             /**<Handle, to look at the response headers */
+        const char *meta;       /**<Where to record the validator, NULL if not resumable */
+        curl_off_t resume_from; /**<Size of the partial download being resumed */
+        curl_off_t abort_min;   /**<Abort 200 responses larger than this, 0 for never */
+        curl_off_t length;      /**<Content-Length of an aborted response */
+        char *mem;              /**<Memory buffer while the object fits MEMORY_MAX */
+        size_t mem_len;         /**<Bytes in mem */
+        char etag[128];         /**<ETag of the response, if any */
+        bool checked;           /**<Whether the response headers were inspected yet */
+        bool aborted;           /**<Whether the download was aborted, see abort_min */
+} FileDownload;
+
+static size_t file_header(char *ptr, size_t size, size_t nitems, void *userdata)
+{
+        FileDownload *dl = userdata;
+        size_t n = size * nitems;
+
+        if (n > 5 && strncasecmp(ptr, "ETag:", 5) == 0) {
+                size_t len = n - 5;
+                const char *value = ptr + 5;
+
+                while (len && (*value == ' ' || *value == '\t')) {
+                        value++;
+                        len--;
+                }
+                while (len && (value[len - 1] == '\r' || value[len - 1] == '\n' ||
+                               value[len - 1] == ' ')) {
+                        len--;
+                }
+                if (len < sizeof(dl->etag)) {
+                        memcpy(dl->etag, value, len);
+                        dl->etag[len] = '\0';
+                }
+        }
+        return n;
+}
+
+/**
+ * Record the validator of the response in dl->meta, so an interrupted
+ * download can be resumed with If-Range. Responses without one can't be.
+ */
+static void staging_save_validator(FileDownload *dl)
+{
+        long changed = -1;
+        FILE *f;
+        int fd;
+
+        curl_easy_getinfo(dl->curl, CURLINFO_FILETIME, &changed);
+        if (changed < 0 && !dl->etag[0]) {
+                unlink(dl->meta);
+                return;
+        }
+        fd = open(dl->meta, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                return;
+        }
+        f = fdopen(fd, "w");
+        if (!f) {
+                close(fd);
+                unlink(dl->meta);
+                return;
+        }
+        fprintf(f, "%ld %s\n", changed, dl->etag);
+        if (fclose(f) != 0) {
+                unlink(dl->meta);
+        }
+}
+
+/**
+ * Read the validator of a partial download back, see staging_save_validator()
+ *
+ * @return The If-Range header to resume with, or NULL
+ */
+static char *staging_if_range(const char *meta)
+{
+        char etag[128] = { 0 };
+        char *header = NULL;
+        long changed = -1;
+        FILE *f;
+        int n;
+
+        f = fopen(meta, "r");
+        if (!f) {
+                return NULL;
+        }
+        n = fscanf(f, "%ld %127s", &changed, etag);
+        fclose(f);
+
+        /* a strong ETag is the better validator; weak ones can't be used */
+        if (n == 2 && etag[0] == '"') {
+                if (asprintf(&header, "If-Range: %s", etag) < 0) {
+                        return NULL;
+                }
+        } else if (n >= 1 && changed >= 0) {
+                char date[64];
+
+                format_http_date((time_t)changed, date, sizeof(date));
+                if (asprintf(&header, "If-Range: %s", date) < 0) {
+                        return NULL;
+                }
+        }
+        return header;
+}
+
+/**
+ * Open the staging file for @url below CACHE_DIR/STAGING_SUBDIR, where
+ * an interrupted download of it is kept
+ *
+ * @return The locked file, or -1 if it doesn't exist and can't be created
+ * or another thread is downloading into it
+ */
+static int staging_open(const char *url, char **filename, char **meta)
+{
+        const char *rel = url_relative(url);
+        autofree(char) *dir = NULL;
+        int fd;
+
+        if (!rel || asprintf(filename, "%s/%s/%s", CACHE_DIR, STAGING_SUBDIR, rel) < 0) {
+                return -1;
+        }
+        if (asprintf(meta, "%s.meta", *filename) < 0) {
+                *meta = NULL;
+                goto fail;
+        }
+        dir = strdup(*filename);
+        if (!dir || !nc_mkdir_p(dirname(dir), 00755)) {
+                goto fail;
+        }
+
+        fd = open(*filename, O_RDWR | O_CREAT | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                goto fail;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+                close(fd);
+                goto fail;
+        }
+        return fd;
+
+fail:
+        free(*filename);
+        free(*meta);
+        *filename = NULL;
+        *meta = NULL;
+        return -1;
+}
+
+/**
+ * Move a download that outgrew its memory buffer to the staging file
+ */
+static bool file_spill(FileDownload *dl)
+{
+        if (dl->mem_len && fwrite(dl->mem, 1, dl->mem_len, dl->file) != dl->mem_len) {
+                return false;
+        }
+        buffer_pool_put(dl->mem);
+        dl->mem = NULL;
+        dl->mem_len = 0;
+        /* only now there is something worth resuming */
+        if (dl->meta) {
+                staging_save_validator(dl);
+        }
+        return true;
+}
+
+static size_t file_write(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+        FileDownload *dl = userdata;
+        size_t n = size * nmemb;
+
+        if (!dl->checked) {
+                curl_off_t length = -1;
+                long code = 0;
+
+                dl->checked = true;
+                curl_easy_getinfo(dl->curl, CURLINFO_RESPONSE_CODE, &code);
+                curl_easy_getinfo(dl->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+                /* If-Range didn't match, so this is a newer object: start over */
+                if (code == 200 && dl->resume_from) {
+                        if (fflush(dl->file) != 0 || ftruncate(fileno(dl->file), 0) != 0) {
+                                return 0;
+                        }
+                        rewind(dl->file);
+                        dl->resume_from = 0;
+                }
+                if (dl->abort_min && code == 200 && length > dl->abort_min) {
+                        dl->length = length;
+                        dl->aborted = true;
+                        return 0;
+                }
+                if (dl->mem && length > (curl_off_t)MEMORY_MAX && !file_spill(dl)) {
+                        return 0;
+                }
+                if (dl->meta && !dl->mem && (code == 200 || code == 206)) {
+                        staging_save_validator(dl);
+                }
+        }
+
+        if (dl->mem) {
+                if (dl->mem_len + n <= MEMORY_MAX) {
+                        memcpy(dl->mem + dl->mem_len, ptr, n);
+                        dl->mem_len += n;
+                        return n;
+                }
+                if (!file_spill(dl)) {
+                        return 0;
+                }
+        }
+
+        return fwrite(ptr, size, nmemb, dl->file);
+}
+
+int curl_get_file(const char *url, const char *prefix, const char *path, time_t timestamp)
 {
         CURLcode code;
         long ret;
-        long changed;
+        long changed = -1;
         int fd;
         autofree(char) *filename = NULL;
+        autofree(char) *meta = NULL;
+        autofree(char) *if_range = NULL;
+        autofree(char) *if_none_match = NULL;
+        struct curl_slist *headers = NULL;
+        char range[32];
         CURL *curl = NULL;
         FILE *file;
+        FileDownload dl = { .file = NULL, .curl = NULL, .meta = NULL, .abort_min = 0 };
+        char etag[128] = { 0 };
+        uint64_t size = 0;
+#ifdef HAVE_ZSTD
+        time_t base_time, delta_time = 0;
+#endif
+        bool keep = false;
 
         if (avoid_dupes(url)) {
                 return 300;
         }
+        if (path) {
+                ret = index_check(prefix, path, &timestamp, etag, sizeof(etag));
+                if (ret) {
+                        stats_index_answer();
+                        TRACE(index__answer, trace_request, ret);
+                        return (int)ret;
+                }
+        }
+#ifdef HAVE_ZSTD
+        if (path && (base_time = index_delta_base(prefix, path)) > 0 &&
+            delta_fetch(url, prefix, path, base_time, &delta_time) == 200) {
+                index_record(prefix, path, 200, delta_time, NULL, 0, url_mirror(url));
+                return 200;
+        }
+#endif
 
         curl = curl_easy_init();
         if (curl == NULL) {
@@ -241,21 +749,79 @@ static int curl_get_file(const char *url, const char *prefix, time_t timestamp)
         }
 
         // fprintf(stderr, "Fetching %s, prefix %s, path %s\n", url, prefix, path);
-        if (asprintf(&filename, "/tmp/clr-debug-info-XXXXXX") < 0) {
-                curl_easy_cleanup(curl);
-                return 418;
-        }
-        fd = mkstemp(filename);
+        fd = staging_open(url, &filename, &meta);
         if (fd < 0) {
-                curl_easy_cleanup(curl);
-                return 418;
+                /* not resumable, e.g. while another download of it is going on */
+                if (asprintf(&filename, "%s/%s/.download-XXXXXX", CACHE_DIR, STAGING_SUBDIR) <
+                    0) {
+                        curl_easy_cleanup(curl);
+                        return 418;
+                }
+                fd = mkstemp(filename);
+                if (fd < 0) {
+                        curl_easy_cleanup(curl);
+                        return 418;
+                }
+        } else {
+                struct stat st;
+
+                /* pick up where an interrupted download of the same object left off */
+                if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                        if_range = staging_if_range(meta);
+                        if (if_range) {
+                                dl.resume_from = st.st_size;
+                        } else if (ftruncate(fd, 0) != 0) {
+                                close(fd);
+                                unlink(filename);
+                                curl_easy_cleanup(curl);
+                                return 418;
+                        }
+                } else {
+                        unlink(meta);
+                }
+        }
+        /* resumed downloads are large, and continue in the staging file */
+        if (!dl.resume_from) {
+                dl.mem = buffer_pool_get();
         }
 
-        file = fdopen(fd, "w");
+        file = fdopen(fd, "r+");
+        if (dl.resume_from) {
+                /* not CURLOPT_RESUME_FROM, which fails on the 200 a changed object gets */
+                snprintf(range, sizeof(range), "%lld-", (long long)dl.resume_from);
+                fseeko(file, (off_t)dl.resume_from, SEEK_SET);
+                headers = curl_slist_append(headers, if_range);
+                curl_easy_setopt(curl, CURLOPT_RANGE, range);
+        }
+        if (etag[0]) {
+                /* more reliable than the timestamp, which is sent as well */
+                if (asprintf(&if_none_match, "If-None-Match: %s", etag) >= 0) {
+                        headers = curl_slist_append(headers, if_none_match);
+                }
+        }
+        if (headers) {
+                curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        }
+        dl.file = file;
+        dl.curl = curl;
+        dl.meta = meta;
+        /* large objects are fetched differently once their size is known */
+        if (parallel_wanted(PARALLEL_MIN_SIZE)) {
+                dl.abort_min = PARALLEL_MIN_SIZE - 1;
+        }
+#ifdef HAVE_ZSTD
+        /* huge objects are served lazily from their seekable version */
+        if (path && (!dl.abort_min || dl.abort_min > LAZY_MIN_SIZE)) {
+                dl.abort_min = LAZY_MIN_SIZE;
+        }
+#endif
 
         curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
-        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_0);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, file_write);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &dl);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, file_header);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &dl);
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
 
         /*
          * Some sane timeout values to prevent stalls
@@ -265,29 +831,76 @@ static int curl_get_file(const char *url, const char *prefix, time_t timestamp)
          * files are several mB large, we want to prevent them from
          * taking forever. (1kB/sec avg over 30secs).
          */
-        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30);
-        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30);
-        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
 
         /* request timestamp of files from server */
-        curl_easy_setopt(curl, CURLOPT_FILETIME, 1);
+        curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
 
         if (timestamp) {
-                curl_easy_setopt(curl, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
-                curl_easy_setopt(curl, CURLOPT_TIMEVALUE, timestamp);
+                curl_easy_setopt(curl, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFMODSINCE);
+                curl_easy_setopt(curl, CURLOPT_TIMEVALUE, (long)timestamp);
         }
 
+        stats_download(true);
         code = curl_easy_perform(curl);
-
-        /* can't trust the file if we get an error back */
-        if (code != 0) {
-                unlink(filename);
+        note_transfer(curl, url, code);
+
+        if (dl.aborted) {
+                buffer_pool_put(dl.mem);
+                dl.mem = NULL;
+#ifdef HAVE_ZSTD
+                if (path && dl.length > LAZY_MIN_SIZE && lazy_open(prefix, path) == 200) {
+                        curl_easy_getinfo(curl, CURLINFO_FILETIME, &changed);
+                        index_record(prefix, path, 200, (time_t)changed, dl.etag,
+                                     (uint64_t)dl.length, url_mirror(url));
+                        ret = 200;
+                        goto out;
+                }
+#endif
+                curl_easy_getinfo(curl, CURLINFO_FILETIME, &changed);
+                if (parallel_wanted((off_t)dl.length) &&
+                    parallel_fetch(url, fd, (off_t)dl.length, (time_t)changed)) {
+                        code = CURLE_OK;
+                } else {
+                        /* download the whole thing in one go after all */
+                        if (ftruncate(fd, 0) != 0) {
+                                ret = 418;
+                                goto out;
+                        }
+                        rewind(file);
+                        curl_easy_setopt(curl, CURLOPT_RANGE, NULL);
+                        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+                        dl.resume_from = 0;
+                        dl.abort_min = 0;
+                        dl.aborted = false;
+                        dl.checked = false;
+                        code = curl_easy_perform(curl);
+                        note_transfer(curl, url, code);
+                }
         }
 
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &ret);
         fflush(file);
         //        printf("HTTP return code is %i\n", ret);
 
+        /* can't trust the file if we get an error back, but what arrived
+         * intact can be resumed from on the next attempt */
+        if (code != 0) {
+                if ((ret == 200 || ret == 206) && meta && access(meta, F_OK) == 0) {
+                        keep = true;
+                        forget_dupe(url);
+                }
+        }
+        if (ret == 206) {
+                /* the rest of a resumed download */
+                ret = 200;
+        } else if (ret == 416) {
+                /* whatever was staged doesn't fit the object anymore */
+                forget_dupe(url);
+        }
+
         /* HTTP 304 is returned if (a) the cached debuginfo has the same
          * timestamp or is newer than that on the server and (b) we haven't
          * already added the URL to the hash table. So, the first crash for a
@@ -299,7 +912,6 @@ static int curl_get_file(const char *url, const char *prefix, time_t timestamp)
         }
 
         if (ret == 200) {
-                autofree(char) *command = NULL;
                 struct stat statbuf;
 
                 /* get timestamp, if any */
@@ -313,61 +925,224 @@ static int curl_get_file(const char *url, const char *prefix, time_t timestamp)
                         futimens(fd, times);
                 }
 
-                memset(&statbuf, 0, sizeof(statbuf));
-                stat(filename, &statbuf);
-                if (statbuf.st_size <= 0) {
+                if (code != 0) {
                         ret = 418;
                         goto out;
                 }
+                if (dl.mem) {
+                        size = dl.mem_len;
+                        ret = dl.mem_len ? extract_buffer(dl.mem, dl.mem_len, prefix) : 418;
+                } else {
+                        memset(&statbuf, 0, sizeof(statbuf));
+                        if (stat(filename, &statbuf) != 0 || statbuf.st_size <= 0) {
+                                ret = 418;
+                                goto out;
+                        }
+                        size = (uint64_t)statbuf.st_size;
+                        ret = extract_tarball(filename, prefix, false);
+                }
+        } else if (ret == 304) {
+                /* the file we have was current as of the timestamp asked with */
+                changed = (long)timestamp;
+        }
+        if (path) {
+                index_record(prefix, path, (int)ret, (time_t)changed, dl.etag, size,
+                             url_mirror(url));
+        }
 
-                /* test extraction first */
-                if (asprintf(&command,
-                             "tar -C %s/%s --no-same-owner "
-                             "--no-same-permissions -tf %s",
-                             CACHE_DIR,
-                             prefix,
-                             filename) < 0) {
-                        ret = 418;
-                        goto out;
+out:
+        stats_download(false);
+        if (!keep) {
+                unlink(filename);
+                if (meta) {
+                        unlink(meta);
                 }
+        }
+        curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
+        buffer_pool_put(dl.mem);
+        fclose(file);
+        return ret;
+}
 
-                if (system(command) != 0) {
-                        ret = 418;
-                        fprintf(stderr, "Error: tar validation failed\n");
-                        goto out;
+/* Largest response curl_get_buffer() holds in memory, larger deltas are
+ * left to a full download */
+#define BUFFER_MAX (64 * 1024 * 1024)
+
+/**
+ * Accumulates a response body in memory, see curl_get_range()
+ */
+typedef struct CurlBuffer {
+        CURL *curl;
+        char *data;
+        size_t len;
+        size_t alloc;
+        size_t max; /**<Abort responses larger than this, 0 for never */
+        bool checked;
+} CurlBuffer;
+
+static size_t curl_buffer_write(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+        CurlBuffer *buf = userdata;
+        size_t n = size * nmemb;
+        char *data;
+
+        if (!buf->checked) {
+                curl_off_t length = -1;
+
+                buf->checked = true;
+                curl_easy_getinfo(buf->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+                if (buf->max && length > (curl_off_t)buf->max) {
+                        return 0;
+                }
+                /* sized up front when known, so one allocation is enough */
+                if (length > 0 && (curl_off_t)(size_t)length == length) {
+                        data = realloc(buf->data, (size_t)length + 1);
+                        if (data) {
+                                buf->data = data;
+                                buf->alloc = (size_t)length + 1;
+                        }
                 }
+        }
+        if (buf->max && n > buf->max - buf->len) {
+                return 0;
+        }
+        if (buf->len + n + 1 > buf->alloc) {
+                size_t alloc = buf->alloc ? buf->alloc * 2 : 16384;
 
-                free(command); /* reuse */
-                if (asprintf(&command,
-                             "tar -C %s/%s --no-same-owner "
-                             "--no-same-permissions -xf %s",
-                             CACHE_DIR,
-                             prefix,
-                             filename) < 0) {
-                        ret = 418;
-                        goto out;
+                while (alloc < buf->len + n + 1) {
+                        alloc *= 2;
+                }
+                data = realloc(buf->data, alloc);
+                if (!data) {
+                        return 0;
                 }
+                buf->data = data;
+                buf->alloc = alloc;
+        }
+        memcpy(buf->data + buf->len, ptr, n);
+        buf->len += n;
+        buf->data[buf->len] = '\0';
+        return n;
+}
 
-                if (system(command) != 0) {
-                        ret = 418;
-                        fprintf(stderr, "Error: tar extraction failed\n");
-                        goto out;
+void format_http_date(time_t t, char *buf, size_t len)
+{
+        struct tm tm;
+
+        strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm));
+}
+
+/**
+ * curl_get_range(), aborting responses larger than @max unless it is 0
+ */
+static int curl_get_memory(const char *url, const char *range, time_t if_range, size_t max,
+                           char **data, size_t *len, time_t *filetime)
+{
+        CURLcode code;
+        long ret = 0;
+        CURL *curl = NULL;
+        CurlBuffer buf = { .data = NULL, .len = 0, .max = max };
+        struct curl_slist *headers = NULL;
+
+        curl = curl_easy_init();
+        if (curl == NULL) {
+                return 418;
+        }
+        buf.curl = curl;
+
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_buffer_write);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+        curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+
+        if (range) {
+                curl_easy_setopt(curl, CURLOPT_RANGE, range);
+                if (if_range) {
+                        char date[64];
+                        autofree(char) *header = NULL;
+
+                        format_http_date(if_range, date, sizeof(date));
+                        if (asprintf(&header, "If-Range: %s", date) < 0) {
+                                curl_easy_cleanup(curl);
+                                return 418;
+                        }
+                        headers = curl_slist_append(NULL, header);
+                        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
                 }
         }
 
-out:
-        unlink(filename);
+        code = curl_easy_perform(curl);
+        note_transfer(curl, url, code);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &ret);
+        if (filetime) {
+                long changed = -1;
+                curl_easy_getinfo(curl, CURLINFO_FILETIME, &changed);
+                *filetime = changed >= 0 ? (time_t)changed : 0;
+        }
         curl_easy_cleanup(curl);
-        fclose(file);
+        curl_slist_free_all(headers);
+
+        if (code != 0) {
+                ret = 418;
+        }
+        if ((ret != 200 && ret != 206) || !buf.data) {
+                free(buf.data);
+                return (ret == 200 || ret == 206) ? 418 : ret;
+        }
+
+        *data = buf.data;
+        *len = buf.len;
         return ret;
 }
 
-double timedelta(struct timeval before, struct timeval after)
+int curl_get_range(const char *url, const char *range, time_t if_range, char **data, size_t *len,
+                   time_t *filetime)
 {
-        double d;
-        d = 1.0 * (after.tv_sec - before.tv_sec) +
-            (1.0 * after.tv_usec - before.tv_usec) / 1000000.0;
-        return d;
+        return curl_get_memory(url, range, if_range, 0, data, len, filetime);
+}
+
+int curl_get_buffer(const char *url, char **data, size_t *len, time_t *filetime)
+{
+        return curl_get_memory(url, NULL, 0, BUFFER_MAX, data, len, filetime);
+}
+
+/**
+ * Handle a control command: "pin" and "unpin" take the object or directory
+ * @path below @prefix, "pins" lists all pins. The reply is a NUL terminated
+ * string, "ok" or the list on success.
+ */
+static void server_control(int fd, const char *command, const char *prefix, const char *path)
+{
+        autofree(char) *key = NULL;
+        autofree(char) *list = NULL;
+        const char *reply = "failed";
+        __nc_unused__ ssize_t wr;
+
+        if (asprintf(&key, "%s%s", prefix, path) < 0) {
+                return;
+        }
+        if (strcmp(command, "pin") == 0) {
+                if (pins_add(key)) {
+                        reply = "ok";
+                }
+        } else if (strcmp(command, "unpin") == 0) {
+                if (pins_remove(key)) {
+                        reply = "ok";
+                }
+        } else if (strcmp(command, "pins") == 0) {
+                list = pins_list();
+                if (list) {
+                        reply = list;
+                }
+        } else {
+                reply = "unknown command";
+        }
+        wr = write(fd, reply, strlen(reply) + 1);
 }
 
 static void *server_thread(void *arg)
@@ -377,7 +1152,11 @@ static void *server_thread(void *arg)
         int ret;
         char *prefix, *path, *c = NULL;
         autofree(char) *url = NULL;
-        time_t timestamp;
+        time_t timestamp = 0;
+        unsigned long long range_offset = 0, range_size = 0;
+        unsigned long long id = 0;
+        bool range = false;
+        StatsClass class = STATS_N_CLASSES;
         struct timeval before, after;
         __nc_unused__ size_t wr = -1;
 
@@ -398,7 +1177,25 @@ static void *server_thread(void *arg)
                 goto thread_end;
         }
         *c = 0;
-        timestamp = strtoull(buf, NULL, 10);
+        /* "@<offset>+<size>" asks for a byte range of a partial file; both it and
+         * the timestamp of a lookup may be followed by "/<request ID>" */
+        if (buf[0] == '!') {
+                /* control command, see server_control() */
+        } else if (buf[0] == '@') {
+                if (sscanf(buf, "@%llu+%llu/%llu", &range_offset, &range_size, &id) < 2) {
+                        goto thread_end;
+                }
+                range = true;
+        } else {
+                char *end = NULL;
+
+                timestamp = strtoull(buf, &end, 10);
+                if (*end == '/') {
+                        id = strtoull(end + 1, NULL, 10);
+                }
+        }
+        /* from a client that doesn't trace */
+        trace_request = id ? id : trace_new_id();
         c++;
         prefix = c;
         path = strchr(c, ':');
@@ -408,6 +1205,24 @@ static void *server_thread(void *arg)
         *path = 0;
         path++;
 
+        if (strstr(path, "..") || strstr(prefix, "..") || strstr(path, "'") || strstr(path, ";")) {
+                goto thread_end;
+        }
+
+        if (strcmp(prefix, "lib") != 0 && strcmp(prefix, "src") != 0) {
+                /* invalid prefix */
+                goto thread_end;
+        }
+
+        TRACE(request__start, trace_request, fd, prefix, path);
+
+        /* "!<command>" comes from clr_debug_ctl rather than a lookup */
+        if (buf[0] == '!') {
+                class = STATS_CONTROL;
+                server_control(fd, buf + 1, prefix, path);
+                goto thread_end;
+        }
+
         /* GDB and elfutils both stat /usr/lib/debug directly when looking up
          * debuginfo, so avoid the download for "/.tar"; the associated cache
          * directories already exist by this point.
@@ -416,21 +1231,31 @@ static void *server_thread(void *arg)
                 goto thread_end;
         }
 
-        if (strstr(path, "..") || strstr(prefix, "..") || strstr(path, "'") || strstr(path, ";")) {
+        if (range) {
+                class = STATS_RANGE;
+#ifdef HAVE_ZSTD
+                ret = lazy_fetch_range(prefix, path, range_offset, range_size);
+                if (ret != 200) {
+                        fprintf(stderr, "Range request for %s%s resulted in error %i\n", prefix,
+                                path, ret);
+                }
+#endif
+                wr = write(fd, "ok", 3);
                 goto thread_end;
         }
 
-        if (strcmp(prefix, "lib") != 0 && strcmp(prefix, "src") != 0) {
-                /* invalid prefix */
-                goto thread_end;
-        }
+        prefetch_note_hit(prefix, path);
+
         url = NULL;
         if (asprintf(&url, "%s%s%s.tar", urls[urlcounter % urls_size], prefix, path) < 0) {
                 goto thread_end;
         }
 
         //        printf("Getting url %s    %i:%06i\n", url, before.tv_sec, before.tv_usec);
-        ret = curl_get_file(url, prefix, timestamp);
+        class = STATS_LOOKUP;
+        ret = curl_get_file(url, prefix, path, timestamp);
+        cache_note_access(prefix, path);
+        stats_lookup(ret);
 
         switch (ret) {
         case 200:
@@ -444,16 +1269,6 @@ static void *server_thread(void *arg)
                 break;
         }
 
-        gettimeofday(&after, NULL);
-#if 0
-        if (timedelta(before, after) > 0.6)
-                printf("Request for %s took %5.2f seconds (%i - %i)\n",
-                       url,
-                       after.tv_sec - before.tv_sec +
-                           (1.0 * after.tv_usec - before.tv_usec) / 1000000.0,
-                       ret,
-                       (int)timestamp);
-#endif
         /* tell the other side we're done with the download */
         wr = write(fd, "ok", 3);
 
@@ -461,20 +1276,69 @@ thread_end:
         if (fd >= 0) {
                 close(fd);
         }
+        if (class != STATS_N_CLASSES) {
+                gettimeofday(&after, NULL);
+                stats_request(class, timedelta(before, after));
+                TRACE(request__done, trace_request, class, ret);
+        }
         dec_connection_count();
         return NULL;
 }
 
+/**
+ * Create a unix socket listening at @path
+ *
+ * @return The socket, or -1
+ */
+static int listen_unix(const char *path)
+{
+        struct sockaddr_un sun;
+        int sockfd;
+
+        sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd < 0) {
+                return -1;
+        }
+
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, path);
+
+        if (bind(sockfd,
+                 (struct sockaddr *)&sun,
+                 offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1) < 0) {
+                fprintf(stderr, "Failed to bind %s:%s \n", path, strerror(errno));
+                close(sockfd);
+                return -1;
+        }
+
+        if (listen(sockfd, 16) < 0) {
+                fprintf(stderr, "Failed to listen on %s:%s \n", path, strerror(errno));
+                close(sockfd);
+                return -1;
+        }
+        return sockfd;
+}
+
 int main(__nc_unused__ int argc, __nc_unused__ char **argv)
 {
         int sockfd;
-        struct sockaddr_un sun;
-        int ret;
+        int stats_fd = -1;
+        int n_fds;
         int curl_done = 0;
+        struct timespec last_active;
         uid_t dbg_user = 0;
         gid_t dbg_group = 0;
         struct passwd *passwdentry;
-        const char *required_paths[] = { CACHE_DIR "/lib", CACHE_DIR "/src" };
+        unsigned long long quota;
+        int pins;
+        bool indexed;
+        const char *required_paths[] = { CACHE_DIR "/lib",
+                                         CACHE_DIR "/src",
+                                         CACHE_DIR "/" PARTIAL_SUBDIR,
+                                         CACHE_DIR "/" STAGING_SUBDIR,
+                                         CACHE_DIR "/" PINS_SUBDIR,
+                                         CACHE_DIR "/" INDEX_SUBDIR,
+                                         CACHE_DIR "/" CAS_SUBDIR };
 
         if (configure_urls()) {
                 fprintf(stderr, "Using urls from environment\n");
@@ -484,6 +1348,22 @@ int main(__nc_unused__ int argc, __nc_unused__ char **argv)
         for (int i = 0; i < urls_size; i++) {
                 fprintf(stderr, "url: %s\n", urls[i]);
         }
+        dupes = nc_shardmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!dupes) {
+                fprintf(stderr, "Failed to allocate the request table\n");
+                return EXIT_FAILURE;
+        }
+        if (parallel_init() > 1) {
+                fprintf(stderr, "Fetching large objects in parallel ranges\n");
+        }
+        if (prefetch_init()) {
+                fprintf(stderr, "Prefetching of source directories enabled\n");
+        }
+#ifdef HAVE_ZSTD
+        if (compress_init()) {
+                fprintf(stderr, "Storing extracted files compressed\n");
+        }
+#endif
 
         umask(0);
         passwdentry = getpwnam("dbginfo");
@@ -531,34 +1411,29 @@ int main(__nc_unused__ int argc, __nc_unused__ char **argv)
 
         signal(SIGPIPE, SIG_IGN);
 
-        if (sd_listen_fds(0) == 1) {
-                /* systemd socket activation */
+        n_fds = sd_listen_fds(0);
+        if (n_fds == 1 || n_fds == 2) {
+                /* systemd socket activation, the stats socket being optional */
                 sockfd = SD_LISTEN_FDS_START + 0;
-        } else if (sd_listen_fds(0) > 1) {
+                if (n_fds == 2) {
+                        stats_fd = SD_LISTEN_FDS_START + 1;
+                        if (sd_is_socket_unix(sockfd, SOCK_STREAM, 1, STATS_SOCKET_PATH, 0) > 0) {
+                                stats_fd = sockfd;
+                                sockfd = SD_LISTEN_FDS_START + 1;
+                        }
+                }
+        } else if (n_fds > 2) {
                 fprintf(stderr, "Too many file descriptors received.\n");
                 exit(EXIT_FAILURE);
         } else {
-                sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+                sockfd = listen_unix(SOCKET_PATH);
                 if (sockfd < 0) {
                         exit(EXIT_FAILURE);
                 }
-
-                sun.sun_family = AF_UNIX;
-                strcpy(sun.sun_path, SOCKET_PATH);
-
-                ret = bind(sockfd,
-                           (struct sockaddr *)&sun,
-                           offsetof(struct sockaddr_un, sun_path) + strlen(SOCKET_PATH) + 1);
-                if (ret < 0) {
-                        fprintf(stderr, "Failed to bind:%s \n", strerror(errno));
-                        exit(EXIT_FAILURE);
-                }
-
-                if (listen(sockfd, 16) < 0) {
-                        fprintf(stderr, "Failed to listen:%s \n", strerror(errno));
-                        exit(EXIT_FAILURE);
-                }
+                /* statistics are nice to have, lookups are what matters */
+                stats_fd = listen_unix(STATS_SOCKET_PATH);
         }
+        stats_init();
 
         if (setgid(dbg_group)) {
                 fprintf(stderr, "Unable to drop privileges setgid %s\n", strerror(errno));
@@ -573,33 +1448,98 @@ int main(__nc_unused__ int argc, __nc_unused__ char **argv)
                 exit(EXIT_FAILURE);
         }
 
+        indexed = index_init();
+        if (!indexed) {
+                fprintf(stderr, "Validator index unavailable, revalidating every lookup\n");
+        }
+
+        quota = cache_init();
+        if (quota) {
+                fprintf(stderr, "Cache quota is %llu MiB\n", quota / (1024 * 1024));
+        }
+
+#ifdef HAVE_ZSTD
+        /* partial files left by a previous run are filled in right away */
+        curl_global_init(CURL_GLOBAL_ALL);
+        curl_done = 1;
+        if (!lazy_init()) {
+                fprintf(stderr, "Failed to start filling in partial files\n");
+        }
+#endif
+
+        /* pinned objects are fetched in the background, shortly after startup */
+        if (!curl_done) {
+                curl_global_init(CURL_GLOBAL_ALL);
+                curl_done = 1;
+        }
+        pins = pins_init();
+        if (pins) {
+                fprintf(stderr, "Keeping %i pinned objects\n", pins);
+        }
+        if (indexed) {
+                changes_init();
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &last_active);
         while (1) {
                 fd_set rfds;
                 struct timeval tv;
+                struct timespec now;
                 int ret;
                 int clientsock;
                 pthread_t thread;
 
                 malloc_trim(0);
 
-                /* use select() to timeout and exit gracefully */
+                /* use select() to timeout and exit gracefully; asking for
+                 * statistics doesn't keep the daemon running */
+                clock_gettime(CLOCK_MONOTONIC, &now);
                 FD_ZERO(&rfds);
                 FD_SET(sockfd, &rfds);
-                tv.tv_sec = TIMEOUT;
+                tv.tv_sec = now.tv_sec - last_active.tv_sec < TIMEOUT
+                                    ? TIMEOUT - (now.tv_sec - last_active.tv_sec)
+                                    : 0;
                 tv.tv_usec = 0;
-                ret = select(sockfd + 1, &rfds, NULL, NULL, &tv);
+                if (stats_fd >= 0) {
+                        FD_SET(stats_fd, &rfds);
+                }
+                ret = select((stats_fd > sockfd ? stats_fd : sockfd) + 1, &rfds, NULL, NULL, &tv);
                 if (ret == -1) {
                         perror("select()");
                         exit(EXIT_FAILURE);
                 } else if (ret == 0) {
+                        clock_gettime(CLOCK_MONOTONIC, &last_active);
+#ifdef HAVE_ZSTD
+                        if (lazy_busy()) {
+                                continue;
+                        }
+#endif
+                        if (pins_busy() || prefetch_busy() || changes_busy()) {
+                                continue;
+                        }
                         break;
                 }
 
+                /* cheap enough to answer right here */
+                if (stats_fd >= 0 && FD_ISSET(stats_fd, &rfds)) {
+                        clientsock = accept(stats_fd, NULL, NULL);
+                        if (clientsock >= 0) {
+                                stats_serve(clientsock, get_current_connection_count());
+                                close(clientsock);
+                        }
+                }
+                if (!FD_ISSET(sockfd, &rfds)) {
+                        continue;
+                }
+
+                clock_gettime(CLOCK_MONOTONIC, &last_active);
                 clientsock = accept(sockfd, NULL, NULL);
+                TRACE(accept, clientsock);
 
                 /* Too many connections, wait for the next loop/retry */
                 if (get_current_connection_count() >= MAX_CONNECTIONS) {
                         /* printf("Too many connections!\n"); */
+                        stats_rejected();
                         shutdown(clientsock, SHUT_RDWR);
                         close(clientsock);
                         continue;
@@ -616,9 +1556,7 @@ int main(__nc_unused__ int argc, __nc_unused__ char **argv)
                 pthread_detach(thread);
         }
 
-        if (hash) {
-                nc_hashmap_free(hash);
-        }
+        nc_shardmap_free(dupes);
 
         free_urls();
 }
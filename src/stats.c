@@ -0,0 +1,334 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Live statistics
+ *
+ * Counters and latency histograms are updated with relaxed atomic
+ * operations wherever something happens, and written in the Prometheus
+ * text exposition format to every client of STATS_SOCKET_PATH, which is
+ * then hung up on. clr_debug_ctl stats prints them, and anything that can
+ * read a unix socket can feed them to a scraper.
+ *
+ * They cover the life of the daemon process, which exits when idle; the
+ * process_start_time metric tells when counting started.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "nica/util.h"
+
+#include "config.h"
+
+/* Mirrors beyond this many are counted together */
+#define STATS_MAX_MIRRORS 8
+
+/* Upper bounds of the latency buckets, in seconds */
+static const double buckets[] = { 0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+                                  0.5,   1,     2.5,  5,     10,   30,  60 };
+#define N_BUCKETS ARRAY_SIZE(buckets)
+
+typedef struct Histogram {
+        uint64_t counts[N_BUCKETS + 1]; /**<Per bucket, the last one for anything slower */
+        uint64_t sum_us;                /**<Sum of all observations in microseconds */
+} Histogram;
+
+static const char *class_names[STATS_N_CLASSES] = { "lookup", "range", "control" };
+
+static const char *result_names[STATS_N_RESULTS] = { "downloaded", "current", "missing",
+                                                     "failed" };
+
+/* Response codes counted individually, the others are "other" */
+static const long codes[] = { 200, 206, 304, 404, 416 };
+#define N_CODES ARRAY_SIZE(codes)
+#define CODE_OTHER N_CODES
+#define CODE_ERROR (N_CODES + 1)
+
+static time_t start_time = 0;
+static uint64_t requests[STATS_N_CLASSES];
+static Histogram request_latency[STATS_N_CLASSES];
+static uint64_t lookups[STATS_N_RESULTS];
+static uint64_t index_answers = 0;
+static uint64_t responses[STATS_MAX_MIRRORS + 1][N_CODES + 2];
+static uint64_t downloaded_bytes[STATS_MAX_MIRRORS + 1];
+static Histogram extract_latency;
+static uint64_t downloads_in_flight = 0;
+static uint64_t rejected = 0;
+
+static inline void counter_add(uint64_t *counter, uint64_t n)
+{
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t counter_get(const uint64_t *counter)
+{
+        return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void histogram_observe(Histogram *histogram, double seconds)
+{
+        size_t i = 0;
+
+        while (i < N_BUCKETS && seconds > buckets[i]) {
+                i++;
+        }
+        counter_add(&histogram->counts[i], 1);
+        counter_add(&histogram->sum_us, seconds > 0 ? (uint64_t)(seconds * 1e6) : 0);
+}
+
+void stats_init(void)
+{
+        start_time = time(NULL);
+}
+
+void stats_request(StatsClass class, double seconds)
+{
+        counter_add(&requests[class], 1);
+        histogram_observe(&request_latency[class], seconds);
+}
+
+void stats_lookup(int ret)
+{
+        StatsResult result;
+
+        switch (ret) {
+        case 200:
+                result = STATS_DOWNLOADED;
+                break;
+        case 300:
+        case 304:
+                result = STATS_CURRENT;
+                break;
+        case 404:
+                result = STATS_MISSING;
+                break;
+        default:
+                result = STATS_FAILED;
+                break;
+        }
+        counter_add(&lookups[result], 1);
+}
+
+void stats_index_answer(void)
+{
+        counter_add(&index_answers, 1);
+}
+
+void stats_response(int mirror, long code, bool failed, uint64_t bytes)
+{
+        size_t m = mirror >= 0 && mirror < STATS_MAX_MIRRORS ? (size_t)mirror : STATS_MAX_MIRRORS;
+        size_t c = CODE_OTHER;
+
+        if (failed && code != 200 && code != 206) {
+                c = CODE_ERROR;
+        } else {
+                for (size_t i = 0; i < N_CODES; i++) {
+                        if (codes[i] == code) {
+                                c = i;
+                                break;
+                        }
+                }
+        }
+        counter_add(&responses[m][c], 1);
+        counter_add(&downloaded_bytes[m], bytes);
+}
+
+void stats_extract(double seconds)
+{
+        histogram_observe(&extract_latency, seconds);
+}
+
+void stats_download(bool begin)
+{
+        if (begin) {
+                __atomic_fetch_add(&downloads_in_flight, 1, __ATOMIC_RELAXED);
+        } else {
+                __atomic_fetch_sub(&downloads_in_flight, 1, __ATOMIC_RELAXED);
+        }
+}
+
+void stats_rejected(void)
+{
+        counter_add(&rejected, 1);
+}
+
+static void write_histogram(FILE *f, const char *name, const char *labels, const Histogram *h)
+{
+        uint64_t total = 0;
+
+        for (size_t i = 0; i < N_BUCKETS; i++) {
+                total += counter_get(&h->counts[i]);
+                fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, labels[0] ? "," : "",
+                        buckets[i], (unsigned long long)total);
+        }
+        total += counter_get(&h->counts[N_BUCKETS]);
+        fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, labels[0] ? "," : "",
+                (unsigned long long)total);
+        fprintf(f, "%s_sum%s%s%s %.6f\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+                (double)counter_get(&h->sum_us) / 1e6);
+        fprintf(f, "%s_count%s%s%s %llu\n", name, labels[0] ? "{" : "", labels,
+                labels[0] ? "}" : "", (unsigned long long)total);
+}
+
+/**
+ * The label value for mirror @m
+ */
+static const char *mirror_name(size_t m)
+{
+        return (int)m < urls_size && m < STATS_MAX_MIRRORS ? urls[m] : "other";
+}
+
+char *stats_format(int connections)
+{
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *f;
+
+        f = open_memstream(&buf, &len);
+        if (!f) {
+                return NULL;
+        }
+
+        fprintf(f, "# HELP clr_debug_process_start_time_seconds When counting started\n");
+        fprintf(f, "# TYPE clr_debug_process_start_time_seconds gauge\n");
+        fprintf(f, "clr_debug_process_start_time_seconds %lld\n", (long long)start_time);
+
+        fprintf(f, "# HELP clr_debug_requests_total Requests received on the socket\n");
+        fprintf(f, "# TYPE clr_debug_requests_total counter\n");
+        for (int i = 0; i < STATS_N_CLASSES; i++) {
+                fprintf(f, "clr_debug_requests_total{class=\"%s\"} %llu\n", class_names[i],
+                        (unsigned long long)counter_get(&requests[i]));
+        }
+        fprintf(f, "# HELP clr_debug_request_duration_seconds Time to answer a request\n");
+        fprintf(f, "# TYPE clr_debug_request_duration_seconds histogram\n");
+        for (int i = 0; i < STATS_N_CLASSES; i++) {
+                autofree(char) *labels = NULL;
+
+                if (asprintf(&labels, "class=\"%s\"", class_names[i]) < 0) {
+                        continue;
+                }
+                write_histogram(f, "clr_debug_request_duration_seconds", labels,
+                                &request_latency[i]);
+        }
+
+        fprintf(f, "# HELP clr_debug_lookups_total Lookups by outcome: downloaded is a cache "
+                   "miss, current a hit\n");
+        fprintf(f, "# TYPE clr_debug_lookups_total counter\n");
+        for (int i = 0; i < STATS_N_RESULTS; i++) {
+                fprintf(f, "clr_debug_lookups_total{result=\"%s\"} %llu\n", result_names[i],
+                        (unsigned long long)counter_get(&lookups[i]));
+        }
+        fprintf(f, "# HELP clr_debug_index_answers_total Lookups answered from the validator "
+                   "index without a request\n");
+        fprintf(f, "# TYPE clr_debug_index_answers_total counter\n");
+        fprintf(f, "clr_debug_index_answers_total %llu\n",
+                (unsigned long long)counter_get(&index_answers));
+
+        fprintf(f, "# HELP clr_debug_responses_total HTTP responses by mirror and status\n");
+        fprintf(f, "# TYPE clr_debug_responses_total counter\n");
+        for (size_t m = 0; m <= STATS_MAX_MIRRORS; m++) {
+                for (size_t c = 0; c < N_CODES + 2; c++) {
+                        uint64_t n = counter_get(&responses[m][c]);
+                        char code[16];
+
+                        if (!n) {
+                                continue;
+                        }
+                        if (c < N_CODES) {
+                                snprintf(code, sizeof(code), "%ld", codes[c]);
+                        } else {
+                                snprintf(code, sizeof(code), "%s",
+                                         c == CODE_ERROR ? "error" : "other");
+                        }
+                        fprintf(f, "clr_debug_responses_total{mirror=\"%s\",code=\"%s\"} %llu\n",
+                                mirror_name(m), code, (unsigned long long)n);
+                }
+        }
+        fprintf(f, "# HELP clr_debug_downloaded_bytes_total Response bodies received by mirror\n");
+        fprintf(f, "# TYPE clr_debug_downloaded_bytes_total counter\n");
+        for (size_t m = 0; m <= STATS_MAX_MIRRORS; m++) {
+                uint64_t n = counter_get(&downloaded_bytes[m]);
+
+                if (n || ((int)m < urls_size && m < STATS_MAX_MIRRORS)) {
+                        fprintf(f, "clr_debug_downloaded_bytes_total{mirror=\"%s\"} %llu\n",
+                                mirror_name(m), (unsigned long long)n);
+                }
+        }
+
+        fprintf(f, "# HELP clr_debug_extract_duration_seconds Time to extract a tarball\n");
+        fprintf(f, "# TYPE clr_debug_extract_duration_seconds histogram\n");
+        write_histogram(f, "clr_debug_extract_duration_seconds", "", &extract_latency);
+
+        fprintf(f, "# HELP clr_debug_connections Requests being answered\n");
+        fprintf(f, "# TYPE clr_debug_connections gauge\n");
+        fprintf(f, "clr_debug_connections %i\n", connections);
+        fprintf(f, "# HELP clr_debug_downloads_in_flight Objects being downloaded or extracted\n");
+        fprintf(f, "# TYPE clr_debug_downloads_in_flight gauge\n");
+        fprintf(f, "clr_debug_downloads_in_flight %llu\n",
+                (unsigned long long)counter_get(&downloads_in_flight));
+        fprintf(f, "# HELP clr_debug_prefetch_queue_length Directories waiting to be prefetched\n");
+        fprintf(f, "# TYPE clr_debug_prefetch_queue_length gauge\n");
+        fprintf(f, "clr_debug_prefetch_queue_length %i\n", prefetch_queued());
+        fprintf(f, "# HELP clr_debug_rejected_total Connections refused while at the limit\n");
+        fprintf(f, "# TYPE clr_debug_rejected_total counter\n");
+        fprintf(f, "clr_debug_rejected_total %llu\n", (unsigned long long)counter_get(&rejected));
+
+        if (fclose(f) != 0) {
+                free(buf);
+                return NULL;
+        }
+        return buf;
+}
+
+void stats_serve(int fd, int connections)
+{
+        autofree(char) *text = stats_format(connections);
+        size_t len, done = 0;
+
+        if (!text) {
+                return;
+        }
+        len = strlen(text);
+        while (done < len) {
+                ssize_t r = write(fd, text + done, len - done);
+                if (r <= 0) {
+                        break;
+                }
+                done += (size_t)r;
+        }
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
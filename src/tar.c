@@ -0,0 +1,74 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Running tar on downloaded archives, either files or buffers in memory
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daemon.h"
+#include "nica/util.h"
+
+/* Magic number at the start of every zstd frame */
+static const char zstd_magic[] = { 0x28, (char)0xb5, 0x2f, (char)0xfd };
+
+bool run_tar(const char *args, const char *filename, const char *data, size_t len)
+{
+        autofree(char) *command = NULL;
+        FILE *pipe;
+        bool ret;
+
+        /* tar detects compression of files, but not on a pipe; published
+         * tarballs are zstd, plain ones are still accepted */
+        if (asprintf(&command, "tar %s%s -f %s", args,
+                     data && len >= sizeof(zstd_magic) &&
+                             memcmp(data, zstd_magic, sizeof(zstd_magic)) == 0
+                         ? " --zstd"
+                         : "",
+                     data ? "-" : filename) < 0) {
+                return false;
+        }
+        if (!data) {
+                return system(command) == 0;
+        }
+
+        pipe = popen(command, "w");
+        if (!pipe) {
+                return false;
+        }
+        ret = fwrite(data, 1, len, pipe) == len;
+        return pclose(pipe) == 0 && ret;
+}
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
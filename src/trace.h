@@ -0,0 +1,75 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/*
+ * Request tracing
+ *
+ * Every lookup and range request gets an ID in clr_debug_fuse, which is
+ * passed to the daemon along with the request, so the phases of one
+ * request can be followed across both processes. Each phase is marked by a
+ * USDT probe of the clr_debug provider, whose first argument is the ID; the
+ * tracer supplies the timestamps. scripts/clr_debug_trace turns them
+ * into a waterfall per request.
+ *
+ * Without sys/sdt.h the probes compile to nothing. With it, they cost a nop
+ * until a tracer attaches.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE(name, ...) STAP_PROBEV(clr_debug, name, __VA_ARGS__)
+#else
+#define TRACE(name, ...)                                                                           \
+        do {                                                                                       \
+        } while (0)
+#endif
+
+/**
+ * Make up the ID of a new request, unique across processes for as long as
+ * a trace runs. Only fuse.c and server.c make up IDs, so one counter per
+ * translation unit is one per process.
+ */
+static inline uint64_t trace_new_id(void)
+{
+        static uint32_t counter = 0;
+
+        return (uint64_t)getpid() << 32 | __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
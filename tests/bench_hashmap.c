@@ -0,0 +1,423 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * bench_hashmap -- microbenchmark of NcHashmap with string keys
+ *
+ * Keys are shaped like the URLs the daemon tracks its downloads by: a
+ * long common mirror prefix, then a debuginfo path below lib or src. For
+ * each map size it times inserting every key, looking each up in random
+ * order, looking up as many absent keys, iterating and removing every
+ * key, and reports nanoseconds per operation. It also reports the heap
+ * the map takes per entry, not counting the keys, and the longest single
+ * insert, which is where the table resizes. It fails if any lookup,
+ * iteration or remove gives a wrong result.
+ *
+ * With -H it compares string hashes on the same keys instead: DJB2, which
+ * nc_string_hash used to be, nc_string_hash and nc_string_hash_len given
+ * the lengths. It reports nanoseconds per key, throughput, how many keys
+ * share their 32-bit hash with another against the number expected of a
+ * random function, and the longest chain when bucketing the keys by the
+ * low bits of their hash into a power of two of buckets at least as many.
+ */
+
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/nica/hashmap.h"
+
+#define MIRROR "https://cdn.download.clearlinux.org/debuginfo/"
+
+/* An insert taking this long is counted as a pause */
+#define PAUSE_NS 100000
+
+/* Bytes of keys to hash at least per hash function */
+#define HASH_BYTES (256 * 1024 * 1024)
+
+static const char *lib_dirs[] = { "usr/lib64", "usr/lib64/haswell", "usr/bin", "usr/libexec",
+                                  "usr/lib64/python3.8/lib-dynload", "usr/lib64/gconv" };
+static const char *src_dirs[] = { "src", "lib", "include", "tools", "test", "src/common" };
+static const char *src_exts[] = { "c", "h", "cc", "hpp", "S" };
+
+static volatile uintptr_t sink;
+
+/**
+ * A string hash to compare
+ */
+typedef struct StringHash {
+        const char *name;
+        unsigned (*hash)(const char *key, size_t len);
+} StringHash;
+
+/* What nc_string_hash used to be */
+static unsigned hash_djb2(const char *key, size_t len)
+{
+        unsigned hash = 5381;
+
+        (void)len;
+        for (const signed char *c = (const signed char *)key; *c != '\0'; c++) {
+                hash = (hash << 5) + hash + (unsigned)*c;
+        }
+        return hash;
+}
+
+static unsigned hash_nc_string(const char *key, size_t len)
+{
+        (void)len;
+        return nc_string_hash(key);
+}
+
+static unsigned hash_nc_string_len(const char *key, size_t len)
+{
+        return nc_string_hash_len(key, len);
+}
+
+static const StringHash string_hashes[] = {
+        { "djb2", hash_djb2 },
+        { "nc_string_hash", hash_nc_string },
+        { "nc_string_hash_len", hash_nc_string_len },
+};
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t splitmix64(uint64_t x)
+{
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+}
+
+/**
+ * Make up the @n-th key, from a different set if @absent
+ */
+static char *make_key(size_t n, bool absent)
+{
+        uint64_t r = splitmix64(n * 2 + absent);
+        char *key = NULL;
+        int ret;
+
+        if (r & 1) {
+                ret = asprintf(&key, MIRROR "lib/%s/lib%s%zu.so.%u.debug.tar",
+                               lib_dirs[(r >> 8) % ARRAY_SIZE(lib_dirs)],
+                               absent ? "absent" : "pkg", n, (unsigned)(r >> 16) % 10);
+        } else {
+                ret = asprintf(&key, MIRROR "src/pkg%zu-%u.%u/%s/file%u.%s.tar", n / 64,
+                               (unsigned)(r >> 8) % 20, (unsigned)(r >> 16) % 100,
+                               src_dirs[(r >> 24) % ARRAY_SIZE(src_dirs)],
+                               (unsigned)(n % 64) + (absent ? 1000 : 0),
+                               src_exts[(r >> 32) % ARRAY_SIZE(src_exts)]);
+        }
+        return ret < 0 ? NULL : key;
+}
+
+static size_t heap_used(void)
+{
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+        struct mallinfo2 info = mallinfo2();
+#else
+        struct mallinfo info = mallinfo();
+#endif
+        return (size_t)info.uordblks + (size_t)info.hblkhd;
+}
+
+static bool bench(size_t n)
+{
+        char **keys = calloc(n, sizeof(char *));
+        char **absent = calloc(n, sizeof(char *));
+        size_t *order = calloc(n, sizeof(size_t));
+        uint64_t start, insert, hit, miss, iterate, remove, pause = 0, paused = 0;
+        size_t heap, per_entry, pauses = 0, wrong = 0, visited = 0;
+        NcHashmap *map;
+        NcHashmapIter iter;
+        void *value;
+        bool ret = false;
+
+        if (!keys || !absent || !order) {
+                goto out;
+        }
+        for (size_t i = 0; i < n; i++) {
+                keys[i] = make_key(i, false);
+                absent[i] = make_key(i, true);
+                if (!keys[i] || !absent[i]) {
+                        goto out;
+                }
+                order[i] = i;
+        }
+        for (size_t i = n - 1; i > 0; i--) {
+                size_t j = splitmix64(i) % (i + 1), tmp = order[i];
+
+                order[i] = order[j];
+                order[j] = tmp;
+        }
+
+        heap = heap_used();
+        map = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+                if (!nc_hashmap_put(map, keys[i], NC_HASH_VALUE(i + 1))) {
+                        fprintf(stderr, "Insert failed\n");
+                        nc_hashmap_free(map);
+                        goto out;
+                }
+        }
+        insert = now_ns() - start;
+        per_entry = (heap_used() - heap) / n;
+
+        start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+                if (nc_hashmap_get(map, keys[order[i]]) != NC_HASH_VALUE(order[i] + 1)) {
+                        wrong++;
+                }
+        }
+        hit = now_ns() - start;
+
+        start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+                if (nc_hashmap_get(map, absent[order[i]])) {
+                        wrong++;
+                }
+        }
+        miss = now_ns() - start;
+
+        start = now_ns();
+        nc_hashmap_iter_init(map, &iter);
+        while (nc_hashmap_iter_next(&iter, NULL, &value)) {
+                sink += (uintptr_t)value;
+                visited++;
+        }
+        iterate = now_ns() - start;
+
+        start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+                if (!nc_hashmap_remove(map, keys[order[i]])) {
+                        wrong++;
+                }
+        }
+        remove = now_ns() - start;
+        if (wrong || visited != n || nc_hashmap_size(map) != 0) {
+                fprintf(stderr, "Wrong results: %zu lookups or removes, %zu of %zu visited, "
+                                "%d left\n",
+                        wrong, visited, n, nc_hashmap_size(map));
+                nc_hashmap_free(map);
+                goto out;
+        }
+        nc_hashmap_free(map);
+
+        /* again, timing each insert on its own to catch the resizes */
+        map = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        for (size_t i = 0; i < n; i++) {
+                uint64_t took;
+
+                start = now_ns();
+                nc_hashmap_put(map, keys[i], NC_HASH_VALUE(i + 1));
+                took = now_ns() - start;
+                if (took > pause) {
+                        pause = took;
+                }
+                if (took >= PAUSE_NS) {
+                        pauses++;
+                        paused += took;
+                }
+        }
+        nc_hashmap_free(map);
+
+        printf("%9zu %8.1f %8.1f %8.1f %8.1f %8.1f %10zu %10.3f %7zu %9.3f\n", n,
+               (double)insert / (double)n, (double)hit / (double)n, (double)miss / (double)n,
+               (double)iterate / (double)n, (double)remove / (double)n, per_entry,
+               (double)pause / 1e6, pauses, (double)paused / 1e6);
+        fflush(stdout);
+        ret = true;
+
+out:
+        for (size_t i = 0; keys && absent && i < n; i++) {
+                free(keys[i]);
+                free(absent[i]);
+        }
+        free(keys);
+        free(absent);
+        free(order);
+        return ret;
+}
+
+static int compare_unsigned(const void *l, const void *r)
+{
+        unsigned a = *(const unsigned *)l, b = *(const unsigned *)r;
+
+        return (a > b) - (a < b);
+}
+
+static bool bench_hash(size_t n)
+{
+        char **keys = calloc(n, sizeof(char *));
+        size_t *lens = calloc(n, sizeof(size_t));
+        unsigned *hashes = calloc(n, sizeof(unsigned));
+        size_t n_buckets = 1, bytes = 0, rounds;
+        uint32_t *buckets = NULL;
+        bool ret = false;
+
+        while (n_buckets < n) {
+                n_buckets *= 2;
+        }
+        buckets = calloc(n_buckets, sizeof(uint32_t));
+        if (!keys || !lens || !hashes || !buckets) {
+                goto out;
+        }
+        for (size_t i = 0; i < n; i++) {
+                keys[i] = make_key(i, false);
+                if (!keys[i]) {
+                        goto out;
+                }
+                lens[i] = strlen(keys[i]);
+                bytes += lens[i];
+        }
+        rounds = HASH_BYTES / bytes + 1;
+
+        for (size_t h = 0; h < ARRAY_SIZE(string_hashes); h++) {
+                const StringHash *hash = &string_hashes[h];
+                size_t collisions = 0, longest = 0;
+                uint64_t start, took;
+                unsigned sum = 0;
+
+                start = now_ns();
+                for (size_t r = 0; r < rounds; r++) {
+                        for (size_t i = 0; i < n; i++) {
+                                sum += hash->hash(keys[i], lens[i]);
+                        }
+                }
+                took = now_ns() - start;
+                sink += sum;
+
+                memset(buckets, 0, n_buckets * sizeof(uint32_t));
+                for (size_t i = 0; i < n; i++) {
+                        hashes[i] = hash->hash(keys[i], lens[i]);
+                        if (++buckets[hashes[i] & (n_buckets - 1)] > longest) {
+                                longest = buckets[hashes[i] & (n_buckets - 1)];
+                        }
+                }
+                qsort(hashes, n, sizeof(unsigned), compare_unsigned);
+                for (size_t i = 1; i < n; i++) {
+                        if (hashes[i] == hashes[i - 1]) {
+                                collisions++;
+                        }
+                }
+
+                printf("%9zu %-20s %8.1f %8.2f %10zu %10.1f %8zu\n", n, hash->name,
+                       (double)took / (double)(rounds * n), (double)(rounds * bytes) / (double)took,
+                       collisions, (double)n * (double)(n - 1) / 2.0 / 4294967296.0, longest);
+        }
+        fflush(stdout);
+        ret = true;
+
+out:
+        for (size_t i = 0; keys && i < n; i++) {
+                free(keys[i]);
+        }
+        free(keys);
+        free(lens);
+        free(hashes);
+        free(buckets);
+        return ret;
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr,
+                "Usage: %s [-H] [-m MAX] [SIZE...]\n"
+                "Benchmarks NcHashmap with SIZE URL-shaped keys, by default with each power of\n"
+                "ten from 1000 to MAX (10000000).\n"
+                "  -H  Compare the string hash functions on the keys instead\n",
+                name);
+}
+
+int main(int argc, char **argv)
+{
+        bool (*run)(size_t n) = bench;
+        size_t max = 10000000;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "Hm:h")) != -1) {
+                switch (opt) {
+                case 'H':
+                        run = bench_hash;
+                        break;
+                case 'm':
+                        max = strtoul(optarg, NULL, 10);
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (run == bench_hash) {
+                printf("%9s %-20s %8s %8s %10s %10s %8s\n", "keys", "hash", "ns/key", "GB/s",
+                       "collisions", "expected", "longest");
+        } else {
+                printf("%9s %8s %8s %8s %8s %8s %10s %10s %7s %9s\n", "", "insert", "get", "miss",
+                       "iterate", "remove", "bytes per", "longest", "", "paused");
+                printf("%9s %8s %8s %8s %8s %8s %10s %10s %7s %9s\n", "entries", "ns", "ns", "ns",
+                       "ns", "ns", "entry", "insert ms", "pauses", "ms");
+        }
+        if (optind < argc) {
+                for (int i = optind; i < argc; i++) {
+                        size_t n = strtoul(argv[i], NULL, 10);
+
+                        if (n && !run(n)) {
+                                return EXIT_FAILURE;
+                        }
+                }
+                return EXIT_SUCCESS;
+        }
+        for (size_t n = 1000; n <= max; n *= 10) {
+                if (!run(n)) {
+                        return EXIT_FAILURE;
+                }
+        }
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,719 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * bench_replay -- end-to-end benchmark of lookups through the FUSE mounts
+ *
+ * Starts clr_debug_daemon and clr_debug_fuse from the build directory
+ * against a fake CDN in this process, replays access traces written with
+ * CLR_DEBUGINFO_ACCESS_TRACE, or a synthetic one, with a number of workers,
+ * and reports the throughput and latency percentiles per operation.
+ *
+ * It mounts /usr/lib/debug and /usr/src/debug and uses the configured
+ * socket and cache, so it must run as root with the installed services
+ * stopped. The files it replays are removed from the cache before and
+ * after, unless -k is given, as their content is made up.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "fake_cdn.h"
+#include "src/access_trace.h"
+#include "src/nica/hashmap.h"
+#include "src/nica/util.h"
+
+#define FUSE_SUPER_MAGIC 0x65735546
+
+/* Where the synthetic files are, below /usr/lib/debug */
+#define BENCH_DIR "/usr/lib64/clr-debug-bench"
+#define SYNTHETIC_MIN_SIZE 4096
+
+static const struct {
+        const char *dir;
+        const char *prefix;
+} mounts[] = {
+        { "/usr/lib/debug", "lib" },
+        { "/usr/src/debug", "src" },
+};
+
+/**
+ * One operation to replay, and how it went
+ */
+typedef struct Op {
+        AccessOp op;
+        const char *prefix;
+        char *path; /**<Below the mount */
+        uint64_t offset;
+        uint64_t size;
+} Op;
+
+typedef struct Result {
+        uint32_t us;
+        int32_t ret;
+} Result;
+
+static Op *ops = NULL;
+static size_t n_ops = 0, ops_alloc = 0;
+static Result *results = NULL;
+static size_t total_ops = 0;
+static size_t next_op = 0;
+static uint64_t bytes_read = 0;
+
+/* Files to serve, from prefix and path to the largest extent accessed */
+static NcHashmap *files = NULL;
+
+static void usage(const char *name)
+{
+        fprintf(stderr,
+                "Usage: %s [OPTION...] [TRACE...]\n"
+                "Replays TRACEs, or a synthetic trace, through the FUSE mounts with a local\n"
+                "fake CDN. Needs root, and the installed services stopped.\n"
+                "  -c N     Workers replaying at the same time (8)\n"
+                "  -r N     Replay everything N times, the first time with a cold cache (1)\n"
+                "  -k       Keep what is cached, before and after\n"
+                "  -v       Show the output of the daemon and the FUSE processes\n"
+                "Synthetic trace, of a getattr, open and 4 KiB read per lookup:\n"
+                "  -n N     Lookups (10000)\n"
+                "  -f N     Files (1000)\n"
+                "  -s S     Exponent of the Zipf distribution of lookups over files (1.0)\n"
+                "  -z KIB   Largest file, sizes are spread log-uniformly below (16384)\n"
+                "Fake CDN:\n"
+                "  -l MS    Latency of every response (20)\n"
+                "  -b KIBS  Bandwidth per connection, in KiB/s (no limit)\n"
+                "  -e RATE  Fraction of requests failing with 503 (0)\n"
+                "  -d RATE  Fraction of responses cut off halfway through (0)\n",
+                name);
+}
+
+static uint64_t now_us(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static const char *mount_dir(const char *prefix)
+{
+        for (size_t i = 0; i < ARRAY_SIZE(mounts); i++) {
+                if (strcmp(prefix, mounts[i].prefix) == 0) {
+                        return mounts[i].dir;
+                }
+        }
+        return NULL;
+}
+
+static bool add_op(AccessOp op, const char *prefix, const char *path, uint64_t offset,
+                   uint64_t size)
+{
+        if (n_ops == ops_alloc) {
+                size_t alloc = ops_alloc ? ops_alloc * 2 : 4096;
+                Op *grown = realloc(ops, alloc * sizeof(Op));
+
+                if (!grown) {
+                        return false;
+                }
+                ops = grown;
+                ops_alloc = alloc;
+        }
+        ops[n_ops] = (Op){ op, prefix, strdup(path), offset, size };
+        if (!ops[n_ops].path) {
+                return false;
+        }
+        n_ops++;
+        return true;
+}
+
+/**
+ * Remember that @extent bytes of @path below @prefix were accessed
+ */
+static bool note_file(const char *prefix, const char *path, uint64_t extent)
+{
+        char *key = NULL;
+        uint64_t *value;
+
+        if (asprintf(&key, "%s%s", prefix, path) < 0) {
+                return false;
+        }
+        value = nc_hashmap_get(files, key);
+        if (value) {
+                if (extent > *value) {
+                        *value = extent;
+                }
+                free(key);
+                return true;
+        }
+        value = malloc(sizeof(uint64_t));
+        if (!value) {
+                free(key);
+                return false;
+        }
+        *value = extent;
+        if (!nc_hashmap_put(files, key, value)) {
+                free(key);
+                free(value);
+                return false;
+        }
+        return true;
+}
+
+static uint64_t splitmix64(uint64_t x)
+{
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+}
+
+/**
+ * A number in [0, 1) made up from @x
+ */
+static double uniform(uint64_t x)
+{
+        return (double)(splitmix64(x) >> 11) / (double)(1ULL << 53);
+}
+
+static bool make_synthetic(size_t lookups, unsigned n_files, double skew, uint64_t max_size)
+{
+        autofree(char) *path = NULL;
+        double *cdf = calloc(n_files, sizeof(double));
+        uint64_t *sizes = calloc(n_files, sizeof(uint64_t));
+        double total = 0;
+        bool ret = false;
+
+        if (!cdf || !sizes) {
+                goto out;
+        }
+        for (unsigned i = 0; i < n_files; i++) {
+                total += 1.0 / pow(i + 1, skew);
+                cdf[i] = total;
+                sizes[i] = (uint64_t)(SYNTHETIC_MIN_SIZE *
+                                      pow((double)max_size / SYNTHETIC_MIN_SIZE, uniform(i)));
+        }
+
+        for (size_t n = 0; n < lookups; n++) {
+                double u = uniform(n_files + n) * total;
+                unsigned lo = 0, hi = n_files - 1;
+                uint64_t offset;
+
+                while (lo < hi) {
+                        unsigned mid = (lo + hi) / 2;
+
+                        if (cdf[mid] < u) {
+                                lo = mid + 1;
+                        } else {
+                                hi = mid;
+                        }
+                }
+                free(path);
+                path = NULL;
+                if (asprintf(&path, BENCH_DIR "/lib%05u.so.debug", lo) < 0) {
+                        goto out;
+                }
+                offset = (uint64_t)(uniform(~n) * (double)sizes[lo]) & ~4095ULL;
+                if (!add_op(ACCESS_GETATTR, "lib", path, 0, 0) ||
+                    !add_op(ACCESS_OPEN, "lib", path, 0, 0) ||
+                    !add_op(ACCESS_READ, "lib", path, offset, 4096)) {
+                        goto out;
+                }
+        }
+        for (unsigned i = 0; i < n_files; i++) {
+                free(path);
+                path = NULL;
+                if (asprintf(&path, BENCH_DIR "/lib%05u.so.debug", i) < 0 ||
+                    !note_file("lib", path, sizes[i])) {
+                        goto out;
+                }
+        }
+        ret = true;
+out:
+        free(cdf);
+        free(sizes);
+        return ret;
+}
+
+static bool load_record(const AccessRecord *record, void *data)
+{
+        const char *prefix = *(char **)data;
+        uint64_t extent = 0;
+
+        if (!add_op(record->op, prefix, record->path, record->offset, record->size)) {
+                return false;
+        }
+        if (record->result < 0) {
+                return true;
+        }
+        if (record->op == ACCESS_READ) {
+                extent = record->offset + (uint64_t)record->result;
+        }
+        return note_file(prefix, record->path, extent);
+}
+
+static bool load_trace(const char *file)
+{
+        char *prefix = NULL;
+        bool ret;
+        FILE *f;
+
+        f = fopen(file, "re");
+        if (!f) {
+                fprintf(stderr, "Cannot open %s: %s\n", file, strerror(errno));
+                return false;
+        }
+        /* the prefix outlives the trace, the operations point to it */
+        ret = access_trace_parse(f, &prefix, load_record, &prefix);
+        fclose(f);
+        if (!ret || !prefix || !mount_dir(prefix)) {
+                fprintf(stderr, "%s: not an access trace, or cut short\n", file);
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Hand the files accessed to the fake CDN, leaving out those that are the
+ * directories of others
+ */
+static bool serve_files(void)
+{
+        autofree(NcHashmap) *dirs = NULL;
+        NcHashmapIter iter;
+        void *key, *value;
+
+        dirs = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!dirs) {
+                return false;
+        }
+        nc_hashmap_iter_init(files, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, NULL)) {
+                for (const char *c = strchr((char *)key + 4, '/'); c; c = strchr(c + 1, '/')) {
+                        char *dir = strndup(key, (size_t)(c - (char *)key));
+
+                        if (!dir || nc_hashmap_contains(dirs, dir) ||
+                            !nc_hashmap_put(dirs, dir, dir)) {
+                                free(dir);
+                        }
+                }
+        }
+
+        nc_hashmap_iter_init(files, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, &value)) {
+                char prefix[4] = { 0 };
+                uint64_t size = *(uint64_t *)value;
+
+                if (nc_hashmap_contains(dirs, key)) {
+                        continue;
+                }
+                memcpy(prefix, key, 3);
+                if (!fake_cdn_add(prefix, (char *)key + 3,
+                                  size > SYNTHETIC_MIN_SIZE ? size : SYNTHETIC_MIN_SIZE)) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/**
+ * Drop the files of the trace from the cache, so they are fetched again
+ */
+static void forget_files(void)
+{
+        NcHashmapIter iter;
+        void *key;
+
+        nc_hashmap_iter_init(files, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, NULL)) {
+                autofree(char) *path = NULL;
+
+                if (asprintf(&path, "%s/%s", CACHE_DIR, (char *)key) >= 0) {
+                        unlink(path);
+                }
+        }
+}
+
+static bool wait_for_daemon(void)
+{
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+        strcpy(sun.sun_path, SOCKET_PATH);
+        for (int i = 0; i < 200; i++) {
+                int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+                if (sockfd >= 0 &&
+                    connect(sockfd,
+                            (struct sockaddr *)&sun,
+                            offsetof(struct sockaddr_un, sun_path) + strlen(SOCKET_PATH) + 1) ==
+                        0) {
+                        close(sockfd);
+                        return true;
+                }
+                if (sockfd >= 0) {
+                        close(sockfd);
+                }
+                usleep(50000);
+        }
+        return false;
+}
+
+static bool mounted(void)
+{
+        for (size_t i = 0; i < ARRAY_SIZE(mounts); i++) {
+                struct statfs st;
+
+                if (statfs(mounts[i].dir, &st) != 0 || st.f_type != FUSE_SUPER_MAGIC) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/**
+ * Run @program from the build directory in a process group of its own
+ *
+ * @return The pid, or -1
+ */
+static pid_t spawn(const char *program, bool verbose)
+{
+        pid_t pid = fork();
+
+        if (pid == 0) {
+                setpgid(0, 0);
+                if (!verbose && (!freopen("/dev/null", "w", stdout) ||
+                                 !freopen("/dev/null", "w", stderr))) {
+                        _exit(1);
+                }
+                execl(program, program, NULL);
+                _exit(1);
+        }
+        return pid;
+}
+
+static void stop(pid_t pid)
+{
+        if (pid > 0) {
+                kill(-pid, SIGTERM);
+                waitpid(pid, NULL, 0);
+        }
+}
+
+static void *worker(__nc_unused__ void *data)
+{
+        for (;;) {
+                size_t i = __atomic_fetch_add(&next_op, 1, __ATOMIC_RELAXED);
+                autofree(char) *path = NULL;
+                const Op *op;
+                char buf[PATH_MAX];
+                uint64_t start;
+                ssize_t ret;
+                int fd;
+
+                if (i >= total_ops) {
+                        break;
+                }
+                op = &ops[i % n_ops];
+                if (asprintf(&path, "%s%s", mount_dir(op->prefix), op->path) < 0) {
+                        continue;
+                }
+
+                start = now_us();
+                switch (op->op) {
+                case ACCESS_GETATTR: {
+                        struct stat st;
+
+                        ret = lstat(path, &st);
+                        break;
+                }
+                case ACCESS_READLINK:
+                        ret = readlink(path, buf, sizeof(buf));
+                        break;
+                case ACCESS_OPEN:
+                        ret = fd = open(path, O_RDONLY);
+                        if (fd >= 0) {
+                                close(fd);
+                                ret = 0;
+                        }
+                        break;
+                case ACCESS_READ: {
+                        autofree(char) *data = malloc(op->size ? op->size : 1);
+
+                        /* only the read itself is timed, as the open is an operation of its own */
+                        fd = open(path, O_RDONLY);
+                        if (fd < 0 || !data) {
+                                ret = -1;
+                                if (fd >= 0) {
+                                        close(fd);
+                                }
+                                break;
+                        }
+                        start = now_us();
+                        ret = pread(fd, data, op->size, (off_t)op->offset);
+                        close(fd);
+                        if (ret > 0) {
+                                __atomic_fetch_add(&bytes_read, (uint64_t)ret, __ATOMIC_RELAXED);
+                        }
+                        break;
+                }
+                default:
+                        ret = 0;
+                        break;
+                }
+                results[i].us = (uint32_t)(now_us() - start);
+                results[i].ret = ret < 0 ? -errno : 0;
+        }
+        return NULL;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+        uint32_t l = *(const uint32_t *)a, r = *(const uint32_t *)b;
+
+        return l < r ? -1 : l > r;
+}
+
+static double percentile(const uint32_t *sorted, size_t n, double p)
+{
+        size_t i = (size_t)ceil(p * (double)n);
+
+        return sorted[i ? i - 1 : 0] / 1000.0;
+}
+
+static void report(uint64_t elapsed_us, int workers)
+{
+        double seconds = (double)elapsed_us / 1e6;
+        uint32_t *latencies = malloc(total_ops * sizeof(uint32_t));
+
+        if (!latencies) {
+                return;
+        }
+        printf("Replayed %zu operations with %d workers in %.2f s: %.0f ops/s, %.1f MiB/s read\n",
+               total_ops, workers, seconds, (double)total_ops / seconds,
+               (double)bytes_read / (1024 * 1024) / seconds);
+        printf("%-10s %9s %8s %9s %9s %9s %9s  (ms)\n", "operation", "count", "errors", "p50",
+               "p99", "p999", "max");
+
+        for (int op = 0; op < ACCESS_N_OPS; op++) {
+                size_t n = 0, errors = 0;
+
+                for (size_t i = 0; i < total_ops; i++) {
+                        if ((int)ops[i % n_ops].op != op) {
+                                continue;
+                        }
+                        latencies[n++] = results[i].us;
+                        if (results[i].ret < 0) {
+                                errors++;
+                        }
+                }
+                if (!n) {
+                        continue;
+                }
+                qsort(latencies, n, sizeof(uint32_t), compare_u32);
+                printf("%-10s %9zu %8zu %9.3f %9.3f %9.3f %9.3f\n", access_op_name(op), n, errors,
+                       percentile(latencies, n, 0.5), percentile(latencies, n, 0.99),
+                       percentile(latencies, n, 0.999), latencies[n - 1] / 1000.0);
+        }
+        free(latencies);
+        fake_cdn_report(stdout);
+}
+
+int main(int argc, char **argv)
+{
+        FakeCdnConfig config = { .latency_ms = 20 };
+        size_t lookups = 10000;
+        unsigned n_files = 1000;
+        double skew = 1.0;
+        uint64_t max_size = 16384 * 1024;
+        int workers = 8, rounds = 1;
+        bool keep = false, verbose = false;
+        pthread_t *threads = NULL;
+        pid_t daemon_pid = -1, fuse_pid = -1;
+        autofree(char) *urls = NULL;
+        uint64_t start;
+        int ret = EXIT_FAILURE;
+        int port;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "c:r:kvn:f:s:z:l:b:e:d:h")) != -1) {
+                switch (opt) {
+                case 'c':
+                        workers = atoi(optarg);
+                        break;
+                case 'r':
+                        rounds = atoi(optarg);
+                        break;
+                case 'k':
+                        keep = true;
+                        break;
+                case 'v':
+                        verbose = true;
+                        break;
+                case 'n':
+                        lookups = strtoul(optarg, NULL, 10);
+                        break;
+                case 'f':
+                        n_files = (unsigned)strtoul(optarg, NULL, 10);
+                        break;
+                case 's':
+                        skew = atof(optarg);
+                        break;
+                case 'z':
+                        max_size = strtoull(optarg, NULL, 10) * 1024;
+                        break;
+                case 'l':
+                        config.latency_ms = (unsigned)atoi(optarg);
+                        break;
+                case 'b':
+                        config.bandwidth = strtoul(optarg, NULL, 10) * 1024;
+                        break;
+                case 'e':
+                        config.error_rate = atof(optarg);
+                        break;
+                case 'd':
+                        config.drop_rate = atof(optarg);
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (workers < 1 || rounds < 1 || n_files < 1 || max_size < SYNTHETIC_MIN_SIZE) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+        if (geteuid() != 0) {
+                fprintf(stderr, "Mounting the FUSE filesystems needs root\n");
+                return EXIT_FAILURE;
+        }
+        signal(SIGPIPE, SIG_IGN);
+
+        files = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        if (!files) {
+                return EXIT_FAILURE;
+        }
+        if (optind < argc) {
+                for (int i = optind; i < argc; i++) {
+                        if (!load_trace(argv[i])) {
+                                return EXIT_FAILURE;
+                        }
+                }
+        } else if (!make_synthetic(lookups, n_files, skew, max_size)) {
+                return EXIT_FAILURE;
+        }
+        if (n_ops == 0) {
+                fprintf(stderr, "Nothing to replay\n");
+                return EXIT_FAILURE;
+        }
+        total_ops = n_ops * (size_t)rounds;
+        results = calloc(total_ops, sizeof(Result));
+        threads = calloc((size_t)workers, sizeof(pthread_t));
+        if (!results || !threads || !serve_files()) {
+                return EXIT_FAILURE;
+        }
+
+        port = fake_cdn_start(&config);
+        if (port < 0) {
+                fprintf(stderr, "Cannot start the fake CDN: %s\n", strerror(errno));
+                return EXIT_FAILURE;
+        }
+        if (!keep) {
+                forget_files();
+        }
+
+        /* the daemon binds the sockets itself when not started by systemd */
+        unlink(SOCKET_PATH);
+        unlink(STATS_SOCKET_PATH);
+        if (asprintf(&urls, "http://127.0.0.1:%d/", port) < 0 ||
+            setenv("CLR_DEBUGINFO_URLS", urls, 1) != 0) {
+                return EXIT_FAILURE;
+        }
+        daemon_pid = spawn("./clr_debug_daemon", verbose);
+        if (daemon_pid < 0 || !wait_for_daemon()) {
+                fprintf(stderr, "clr_debug_daemon didn't come up\n");
+                goto out;
+        }
+        fuse_pid = spawn("./clr_debug_fuse", verbose);
+        for (int i = 0; fuse_pid > 0 && i < 300 && !mounted(); i++) {
+                usleep(50000);
+        }
+        if (!mounted()) {
+                fprintf(stderr, "clr_debug_fuse didn't mount %s and %s\n", mounts[0].dir,
+                        mounts[1].dir);
+                goto out;
+        }
+
+        start = now_us();
+        for (int i = 0; i < workers; i++) {
+                if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+                        workers = i;
+                        break;
+                }
+        }
+        for (int i = 0; i < workers; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        report(now_us() - start, workers);
+        ret = EXIT_SUCCESS;
+
+out:
+        /* both mounts are in the process group of clr_debug_fuse */
+        stop(fuse_pid);
+        for (int i = 0; i < 100 && mounted(); i++) {
+                usleep(50000);
+        }
+        stop(daemon_pid);
+        unlink(SOCKET_PATH);
+        unlink(STATS_SOCKET_PATH);
+        if (!keep) {
+                forget_files();
+        }
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
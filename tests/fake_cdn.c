@@ -0,0 +1,526 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Tarballs are never stored: each one is a ustar header, content made up
+ * from the path and the offset, and the end-of-archive blocks. They are
+ * served as zstd, like clr_debug_prepare publishes them, but in raw blocks
+ * holding the tarball as is, so any byte range can still be produced
+ * directly. One thread serves each connection, keeping it alive the way
+ * curl expects.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fake_cdn.h"
+#include "src/nica/hashmap.h"
+#include "src/nica/util.h"
+
+#define REQUEST_MAX 8192
+#define CHUNK_SIZE (16 * 1024)
+
+/* A single segment zstd frame: magic, descriptor and 8 byte content size */
+#define ZSTD_HEADER_SIZE 13
+#define ZSTD_BLOCK_HEADER_SIZE 3
+#define ZSTD_BLOCK_MAX (128 * 1024)
+
+/* All objects claim to have been built at the same time */
+#define LAST_MODIFIED "Tue, 01 Sep 2020 00:00:00 GMT"
+
+static FakeCdnConfig cdn_config;
+static NcHashmap *objects = NULL;
+
+static struct {
+        uint64_t requests;
+        uint64_t served;
+        uint64_t not_modified;
+        uint64_t not_found;
+        uint64_t failed; /**<Answered with 503 on purpose */
+        uint64_t dropped;
+        uint64_t bytes;
+} counts;
+
+/**
+ * The tarball of one object
+ */
+typedef struct Tarball {
+        char header[512];
+        char frame[ZSTD_HEADER_SIZE];
+        uint64_t seed;     /**<Of the content */
+        size_t size;       /**<Of the content */
+        size_t tar_length; /**<Of the whole tarball */
+        size_t length;     /**<Of the zstd frame holding it */
+} Tarball;
+
+static inline void count(uint64_t *counter, uint64_t n)
+{
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t splitmix64(uint64_t x)
+{
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+}
+
+bool fake_cdn_add(const char *prefix, const char *path, size_t size)
+{
+        char *key = NULL;
+        size_t *value;
+
+        if (!objects) {
+                objects = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+                if (!objects) {
+                        return false;
+                }
+        }
+        if (asprintf(&key, "%s%s", prefix, path) < 0) {
+                return false;
+        }
+        if (nc_hashmap_contains(objects, key)) {
+                free(key);
+                return true;
+        }
+        value = malloc(sizeof(size_t));
+        if (!value) {
+                free(key);
+                return false;
+        }
+        *value = size;
+        if (!nc_hashmap_put(objects, key, value)) {
+                free(key);
+                free(value);
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Describe the tarball of @path, with PREFIX/ already stripped, of an
+ * object of @size bytes
+ *
+ * @return false if the path doesn't fit in a ustar header
+ */
+static bool tarball_init(Tarball *tar, const char *path, size_t size)
+{
+        char name[257];
+        const char *split = NULL;
+        unsigned sum = 0;
+        size_t len;
+
+        /* members are relative to the prefix directory, like the real ones */
+        if (strlen(path) > 255) {
+                return false;
+        }
+        snprintf(name, sizeof(name), ".%s", path);
+        len = strlen(name);
+
+        memset(tar, 0, sizeof(*tar));
+        if (len > 100) {
+                /* ustar keeps up to 155 more bytes before a slash apart */
+                for (const char *c = name + len - 101; c < name + len; c++) {
+                        if (*c == '/' && c - name <= 155) {
+                                split = c;
+                                break;
+                        }
+                }
+                if (!split) {
+                        return false;
+                }
+                memcpy(tar->header + 345, name, (size_t)(split - name));
+                memcpy(tar->header, split + 1, strlen(split + 1));
+        } else {
+                memcpy(tar->header, name, len);
+        }
+        snprintf(tar->header + 100, 8, "%07o", 0644);
+        snprintf(tar->header + 108, 8, "%07o", 0);
+        snprintf(tar->header + 116, 8, "%07o", 0);
+        snprintf(tar->header + 124, 12, "%011llo", (unsigned long long)size);
+        snprintf(tar->header + 136, 12, "%011llo", 1598918400ULL);
+        tar->header[156] = '0';
+        memcpy(tar->header + 257, "ustar", 6);
+        memcpy(tar->header + 263, "00", 2);
+
+        memset(tar->header + 148, ' ', 8);
+        for (size_t i = 0; i < sizeof(tar->header); i++) {
+                sum += (unsigned char)tar->header[i];
+        }
+        snprintf(tar->header + 148, 8, "%06o", sum);
+        tar->header[155] = ' ';
+
+        tar->seed = splitmix64(nc_string_hash(path));
+        tar->size = size;
+        tar->tar_length = 512 + (size + 511) / 512 * 512 + 1024;
+
+        /* single segment, so the whole content size is the window */
+        memcpy(tar->frame, "\x28\xb5\x2f\xfd\xe0", 5);
+        for (int i = 0; i < 8; i++) {
+                tar->frame[5 + i] = (char)((uint64_t)tar->tar_length >> (i * 8));
+        }
+        tar->length = ZSTD_HEADER_SIZE + tar->tar_length +
+                      (tar->tar_length + ZSTD_BLOCK_MAX - 1) / ZSTD_BLOCK_MAX *
+                              ZSTD_BLOCK_HEADER_SIZE;
+        return true;
+}
+
+/**
+ * The byte of the uncompressed tarball @tar at @pos
+ */
+static char tarball_byte(const Tarball *tar, size_t pos)
+{
+        if (pos < 512) {
+                return tar->header[pos];
+        } else if (pos - 512 < tar->size) {
+                size_t at = pos - 512;
+
+                return (char)(splitmix64(tar->seed + at / 8) >> (at % 8 * 8));
+        }
+        return 0;
+}
+
+/**
+ * Produce the @len bytes of the zstd frame of @tar at @offset
+ */
+static void tarball_fill(const Tarball *tar, size_t offset, char *buf, size_t len)
+{
+        for (size_t i = 0; i < len; i++) {
+                size_t pos = offset + i;
+                size_t block, at, start, n;
+                uint32_t header;
+
+                if (pos < ZSTD_HEADER_SIZE) {
+                        buf[i] = tar->frame[pos];
+                        continue;
+                }
+                block = (pos - ZSTD_HEADER_SIZE) / (ZSTD_BLOCK_HEADER_SIZE + ZSTD_BLOCK_MAX);
+                at = (pos - ZSTD_HEADER_SIZE) % (ZSTD_BLOCK_HEADER_SIZE + ZSTD_BLOCK_MAX);
+                start = block * ZSTD_BLOCK_MAX;
+                if (at >= ZSTD_BLOCK_HEADER_SIZE) {
+                        buf[i] = tarball_byte(tar, start + at - ZSTD_BLOCK_HEADER_SIZE);
+                        continue;
+                }
+                /* raw block type is 0, the lowest bit marks the last block */
+                n = tar->tar_length - start < ZSTD_BLOCK_MAX ? tar->tar_length - start
+                                                             : ZSTD_BLOCK_MAX;
+                header = (uint32_t)n << 3 | (start + n == tar->tar_length);
+                buf[i] = (char)(header >> (at * 8));
+        }
+}
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = write(fd, buf, len);
+
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        return false;
+                }
+                buf += n;
+                len -= (size_t)n;
+        }
+        return true;
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Send @len bytes of @tar at @offset within the bandwidth limit, or only
+ * half of them if @drop
+ */
+static bool send_body(int fd, const Tarball *tar, size_t offset, size_t len, bool drop)
+{
+        char buf[CHUNK_SIZE];
+        double start = now();
+        size_t sent = 0;
+
+        if (drop) {
+                len /= 2;
+        }
+        while (sent < len) {
+                size_t n = len - sent < sizeof(buf) ? len - sent : sizeof(buf);
+
+                tarball_fill(tar, offset + sent, buf, n);
+                if (!write_all(fd, buf, n)) {
+                        return false;
+                }
+                sent += n;
+                count(&counts.bytes, n);
+
+                if (cdn_config.bandwidth) {
+                        double ahead = (double)sent / (double)cdn_config.bandwidth -
+                                       (now() - start);
+
+                        if (ahead > 0) {
+                                usleep((useconds_t)(ahead * 1e6));
+                        }
+                }
+        }
+        return !drop;
+}
+
+/**
+ * Find the value of the header @name in @headers
+ *
+ * @return The value, up to the end of the line, or NULL
+ */
+static const char *find_header(const char *headers, const char *name)
+{
+        const char *line = strcasestr(headers, name);
+
+        while (line) {
+                if (line[-1] == '\n') {
+                        return line + strlen(name);
+                }
+                line = strcasestr(line + 1, name);
+        }
+        return NULL;
+}
+
+/**
+ * Answer the request in @headers
+ *
+ * @return Whether the connection can take another request
+ */
+static bool respond(int fd, char *headers, unsigned *seed)
+{
+        char method[16], target[PATH_MAX + 16], reply[512];
+        const char *range, *etag_match;
+        size_t offset = 0, len, *size;
+        unsigned long long first, last;
+        bool partial = false, drop;
+        char etag[32];
+        Tarball tar;
+        char *ext;
+
+        count(&counts.requests, 1);
+        if (sscanf(headers, "%15s %4111s", method, target) != 2) {
+                return false;
+        }
+        if (cdn_config.latency_ms) {
+                usleep(cdn_config.latency_ms * 1000);
+        }
+        if ((double)rand_r(seed) / RAND_MAX < cdn_config.error_rate) {
+                count(&counts.failed, 1);
+                snprintf(reply, sizeof(reply),
+                         "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n");
+                return write_all(fd, reply, strlen(reply));
+        }
+
+        ext = strrchr(target, '.');
+        size = NULL;
+        if (ext && strcmp(ext, ".tar") == 0 && target[0] == '/') {
+                *ext = '\0';
+                size = nc_hashmap_get(objects, target + 1);
+        }
+        /* PREFIX/ is 4 bytes */
+        if (!size || strlen(target) < 5 || !tarball_init(&tar, target + 4, *size)) {
+                count(&counts.not_found, 1);
+                snprintf(reply, sizeof(reply),
+                         "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+                return write_all(fd, reply, strlen(reply));
+        }
+
+        snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)tar.seed);
+        etag_match = find_header(headers, "If-None-Match: ");
+        if (etag_match && strncmp(etag_match, etag, strlen(etag)) == 0) {
+                count(&counts.not_modified, 1);
+                snprintf(reply, sizeof(reply),
+                         "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nContent-Length: 0\r\n\r\n",
+                         etag);
+                return write_all(fd, reply, strlen(reply));
+        }
+
+        len = tar.length;
+        range = find_header(headers, "Range: bytes=");
+        if (range) {
+                int n = sscanf(range, "%llu-%llu", &first, &last);
+
+                if (n < 1 || first >= tar.length) {
+                        snprintf(reply, sizeof(reply),
+                                 "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                 "Content-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n",
+                                 tar.length);
+                        return write_all(fd, reply, strlen(reply));
+                }
+                if (n < 2 || last >= tar.length) {
+                        last = tar.length - 1;
+                }
+                offset = (size_t)first;
+                len = (size_t)(last - first + 1);
+                partial = true;
+        }
+
+        count(&counts.served, 1);
+        if (partial) {
+                snprintf(reply, sizeof(reply),
+                         "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %zu-%zu/%zu\r\n"
+                         "Content-Length: %zu\r\nLast-Modified: " LAST_MODIFIED "\r\n"
+                         "ETag: %s\r\nAccept-Ranges: bytes\r\n\r\n",
+                         offset, offset + len - 1, tar.length, len, etag);
+        } else {
+                snprintf(reply, sizeof(reply),
+                         "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n"
+                         "Last-Modified: " LAST_MODIFIED "\r\nETag: %s\r\n"
+                         "Accept-Ranges: bytes\r\n\r\n",
+                         len, etag);
+        }
+        if (!write_all(fd, reply, strlen(reply))) {
+                return false;
+        }
+        if (strcmp(method, "HEAD") == 0) {
+                return true;
+        }
+        drop = (double)rand_r(seed) / RAND_MAX < cdn_config.drop_rate;
+        if (drop) {
+                count(&counts.dropped, 1);
+        }
+        return send_body(fd, &tar, offset, len, drop);
+}
+
+static void *serve_connection(void *data)
+{
+        int fd = (int)(intptr_t)data;
+        unsigned seed = (unsigned)fd ^ (unsigned)time(NULL);
+        char buf[REQUEST_MAX + 1];
+        size_t used = 0;
+
+        for (;;) {
+                char *end;
+                size_t len;
+
+                buf[used] = '\0';
+                while (!(end = strstr(buf, "\r\n\r\n"))) {
+                        ssize_t n;
+
+                        if (used == REQUEST_MAX) {
+                                goto out;
+                        }
+                        n = read(fd, buf + used, REQUEST_MAX - used);
+                        if (n <= 0) {
+                                goto out;
+                        }
+                        used += (size_t)n;
+                        buf[used] = '\0';
+                }
+
+                /* requests are GETs without a body */
+                len = (size_t)(end - buf) + 4;
+                end[2] = '\0';
+                if (!respond(fd, buf, &seed)) {
+                        break;
+                }
+                memmove(buf, buf + len, used - len);
+                used -= len;
+        }
+out:
+        close(fd);
+        return NULL;
+}
+
+static void *serve(void *data)
+{
+        int sockfd = (int)(intptr_t)data;
+
+        for (;;) {
+                pthread_t thread;
+                int fd = accept(sockfd, NULL, NULL);
+
+                if (fd < 0) {
+                        continue;
+                }
+                if (pthread_create(&thread, NULL, serve_connection, (void *)(intptr_t)fd) != 0) {
+                        close(fd);
+                        continue;
+                }
+                pthread_detach(thread);
+        }
+        return NULL;
+}
+
+int fake_cdn_start(const FakeCdnConfig *config)
+{
+        struct sockaddr_in addr = { .sin_family = AF_INET };
+        socklen_t len = sizeof(addr);
+        pthread_t thread;
+        int sockfd;
+
+        cdn_config = *config;
+        if (!objects) {
+                objects = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        }
+
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sockfd < 0) {
+                return -1;
+        }
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(sockfd, 128) < 0 || getsockname(sockfd, (struct sockaddr *)&addr, &len) < 0 ||
+            pthread_create(&thread, NULL, serve, (void *)(intptr_t)sockfd) != 0) {
+                close(sockfd);
+                return -1;
+        }
+        pthread_detach(thread);
+        return ntohs(addr.sin_port);
+}
+
+void fake_cdn_report(FILE *f)
+{
+        fprintf(f,
+                "CDN: %llu requests, %llu served, %llu not modified, %llu not found, "
+                "%llu failed, %llu dropped, %.1f MiB sent\n",
+                (unsigned long long)counts.requests, (unsigned long long)counts.served,
+                (unsigned long long)counts.not_modified, (unsigned long long)counts.not_found,
+                (unsigned long long)counts.failed, (unsigned long long)counts.dropped,
+                (double)counts.bytes / (1024 * 1024));
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
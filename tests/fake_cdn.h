@@ -0,0 +1,71 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Local stand-in for the debuginfo CDN
+ *
+ * Serves PREFIX/PATH.tar for every file added with fake_cdn_add(), as a zstd
+ * tarball generated on the fly holding PATH with made up content, and 404
+ * for everything else. Responses can be slowed down and made to fail.
+ */
+
+typedef struct FakeCdnConfig {
+        unsigned latency_ms; /**<Added before every response */
+        size_t bandwidth;    /**<Bytes per second per connection, 0 for no limit */
+        double error_rate;   /**<Fraction of requests answered with 503 */
+        double drop_rate;    /**<Fraction of responses cut off halfway through */
+} FakeCdnConfig;
+
+/**
+ * Serve the file @path of @size bytes below @prefix, "lib" or "src"
+ *
+ * @note Only before fake_cdn_start()
+ */
+bool fake_cdn_add(const char *prefix, const char *path, size_t size);
+
+/**
+ * Start serving on a port of 127.0.0.1 from a thread of its own
+ *
+ * @return The port, or -1 on failure
+ */
+int fake_cdn_start(const FakeCdnConfig *config);
+
+/**
+ * Print what was served
+ */
+void fake_cdn_report(FILE *f);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Clear Linux -- automatic debuginfo extraction test
+#
+# Copyright 2020 Intel Corporation
+#
+# This program is free software: you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, version 3 or later of the License.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+#
+# Publishes a small and a large file with clr_debug_prepare, then has
+# test_tar unpack each tarball both from a file and from memory through a
+# pipe, the two ways the daemon does, and checks both give the originals.
+
+srcdir=$(cd "${srcdir:-.}" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+if ! tar --zstd -cf /dev/null --files-from /dev/null 2> /dev/null; then
+  echo "tar without zstd support, skipping"
+  exit 77
+fi
+
+raw="$tmp/raw/usr/lib/debug/usr/lib64"
+mkdir -p "$raw"
+head -c 4096 /dev/urandom > "$raw/libsmall.so.debug"
+head -c $((1024 * 1024)) /dev/urandom > "$raw/liblarge.so.debug"
+
+if command -v gawk > /dev/null && command -v parallel > /dev/null; then
+  (cd "$tmp" && bash "$srcdir/scripts/clr_debug_prepare" "$tmp/raw" "$tmp/pub") \
+    > /dev/null || exit 1
+else
+  # what clr_debug_prepare runs for a file, without its gawk/parallel driver
+  mkdir -p "$tmp/pub/lib/usr/lib64"
+  for name in libsmall.so.debug liblarge.so.debug; do
+    tar --no-recursion -C "$tmp/raw/usr/lib/debug" --zstd \
+      -cf "$tmp/pub/lib/usr/lib64/$name.tar" "./usr/lib64/$name" || exit 1
+  done
+fi
+
+ret=0
+for name in libsmall.so.debug liblarge.so.debug; do
+  out="$tmp/out-$name"
+  mkdir -p "$out"
+  if ! ./test_tar "$tmp/pub/lib/usr/lib64/$name.tar" "$out"; then
+    ret=1
+    continue
+  fi
+  for how in file pipe; do
+    if ! cmp "$raw/$name" "$out/$how/usr/lib64/$name"; then
+      echo "$name extracted from a $how differs"
+      ret=1
+    fi
+  done
+done
+exit $ret
@@ -0,0 +1,284 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * test_hashmap -- check NcHashmap against a plain array
+ *
+ * Runs random puts, gets, removes and steals on small integer keys and
+ * compares every answer, and every iteration, with an array indexed by
+ * the key. Then it fills and empties the map a few times over, iterating
+ * after every insert the first time, so also at every step of migrating
+ * the old table each time it grows. Last it checks string keys which all
+ * hash the same, and that replacing and removing free exactly what they
+ * should.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/nica/hashmap.h"
+
+#define KEYS 5000
+#define OPS 2000000
+#define CYCLES 5
+#define COLLIDING 500
+
+#define check(cond)                                                                       \
+        do {                                                                              \
+                if (!(cond)) {                                                            \
+                        fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+                        exit(EXIT_FAILURE);                                               \
+                }                                                                         \
+        } while (0)
+
+static size_t freed_keys;
+static size_t freed_values;
+
+static uint64_t splitmix64(uint64_t x)
+{
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+}
+
+static void free_key(void *p)
+{
+        freed_keys++;
+        free(p);
+}
+
+static void free_value(void *p)
+{
+        freed_values++;
+        free(p);
+}
+
+static unsigned same_hash(const void *key)
+{
+        (void)key;
+        return 42;
+}
+
+/**
+ * Check that iterating @map visits exactly what @expect holds, where key
+ * i + 1 has value expect[i] or is absent if that is 0
+ */
+static void check_iteration(NcHashmap *map, const unsigned *expect)
+{
+        static unsigned char seen[KEYS];
+        NcHashmapIter iter;
+        void *key, *value;
+        size_t visited = 0, present = 0;
+
+        memset(seen, 0, sizeof(seen));
+        nc_hashmap_iter_init(map, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, &value)) {
+                unsigned k = NC_UNHASH_KEY(key);
+
+                check(k >= 1 && k <= KEYS);
+                check(!seen[k - 1]);
+                check(expect[k - 1] == NC_UNHASH_VALUE(value));
+                seen[k - 1] = 1;
+                visited++;
+        }
+        for (size_t i = 0; i < KEYS; i++) {
+                present += expect[i] != 0;
+        }
+        check(visited == present);
+        check((size_t)nc_hashmap_size(map) == present);
+}
+
+static void test_random(void)
+{
+        static unsigned expect[KEYS];
+        NcHashmap *map = nc_hashmap_new(NULL, NULL);
+        int size = 0;
+
+        check(map);
+        for (unsigned op = 0; op < OPS; op++) {
+                uint64_t r = splitmix64(op);
+                unsigned k = (unsigned)(r % KEYS);
+                void *value;
+
+                switch ((r >> 32) % 8) {
+                case 0:
+                case 1:
+                case 2:
+                        check(nc_hashmap_put(map, NC_HASH_KEY(k + 1), NC_HASH_VALUE(op + 1)));
+                        size += !expect[k];
+                        expect[k] = op + 1;
+                        break;
+                case 3:
+                case 4:
+                        check(nc_hashmap_remove(map, NC_HASH_KEY(k + 1)) == (expect[k] != 0));
+                        size -= expect[k] != 0;
+                        expect[k] = 0;
+                        break;
+                case 5:
+                        check(nc_hashmap_steal(map, NC_HASH_KEY(k + 1)) == (expect[k] != 0));
+                        size -= expect[k] != 0;
+                        expect[k] = 0;
+                        break;
+                case 6:
+                        check(nc_hashmap_ensure_get(map, NC_HASH_KEY(k + 1), &value) ==
+                              (expect[k] != 0));
+                        check(!expect[k] || NC_UNHASH_VALUE(value) == expect[k]);
+                        break;
+                default:
+                        check(NC_UNHASH_VALUE(nc_hashmap_get(map, NC_HASH_KEY(k + 1))) ==
+                              expect[k]);
+                        check(nc_hashmap_contains(map, NC_HASH_KEY(k + 1)) == (expect[k] != 0));
+                        break;
+                }
+                check(nc_hashmap_size(map) == size);
+                if (op % (OPS / 16) == 0) {
+                        check_iteration(map, expect);
+                }
+        }
+        check_iteration(map, expect);
+        nc_hashmap_free(map);
+}
+
+static void test_cycles(void)
+{
+        static unsigned expect[KEYS];
+        NcHashmap *map = nc_hashmap_new(NULL, NULL);
+
+        check(map);
+        for (unsigned cycle = 0; cycle < CYCLES; cycle++) {
+                for (unsigned k = 0; k < KEYS; k++) {
+                        check(nc_hashmap_put(map, NC_HASH_KEY(k + 1), NC_HASH_VALUE(cycle + 1)));
+                        expect[k] = cycle + 1;
+                        /* at every step of each migration as the new map grows */
+                        if (cycle == 0) {
+                                check_iteration(map, expect);
+                        }
+                }
+                check_iteration(map, expect);
+                for (unsigned k = 0; k < KEYS; k++) {
+                        check(nc_hashmap_get(map, NC_HASH_KEY(k + 1)) == NC_HASH_VALUE(cycle + 1));
+                }
+                for (unsigned k = 0; k < KEYS; k++) {
+                        check(nc_hashmap_remove(map, NC_HASH_KEY(KEYS - k)));
+                        check(!nc_hashmap_contains(map, NC_HASH_KEY(KEYS - k)));
+                        expect[KEYS - k - 1] = 0;
+                }
+                check(nc_hashmap_size(map) == 0);
+                check_iteration(map, expect);
+        }
+        nc_hashmap_free(map);
+}
+
+static char *make_key(unsigned n)
+{
+        char *key = NULL;
+
+        check(asprintf(&key, "key%u", n) >= 0);
+        return key;
+}
+
+static int *make_value(int n)
+{
+        int *value = malloc(sizeof(int));
+
+        check(value);
+        *value = n;
+        return value;
+}
+
+static void test_colliding(void)
+{
+        NcHashmap *map = nc_hashmap_new_full(same_hash, nc_string_compare, free_key, free_value);
+        char *stolen;
+        int *value;
+        char name[16];
+
+        check(map);
+        for (unsigned i = 0; i < COLLIDING; i++) {
+                check(nc_hashmap_put(map, make_key(i), make_value((int)i)));
+        }
+        /* replacing with an equal key frees the old key and value */
+        for (unsigned i = 0; i < COLLIDING; i += 2) {
+                check(nc_hashmap_put(map, make_key(i), make_value(-(int)i)));
+        }
+        check(nc_hashmap_size(map) == COLLIDING);
+        check(freed_keys == COLLIDING / 2 && freed_values == COLLIDING / 2);
+
+        for (unsigned i = 0; i < COLLIDING; i++) {
+                snprintf(name, sizeof(name), "key%u", i);
+                value = nc_hashmap_get(map, name);
+                check(value && *value == (i % 2 ? (int)i : -(int)i));
+        }
+        check(!nc_hashmap_get(map, "key"));
+        check(!nc_hashmap_remove(map, "absent"));
+
+        check(nc_hashmap_remove(map, "key3"));
+        check(!nc_hashmap_contains(map, "key3"));
+        check(freed_keys == COLLIDING / 2 + 1 && freed_values == COLLIDING / 2 + 1);
+
+        /* stealing frees nothing, the caller still owns what it put */
+        stolen = make_key(COLLIDING);
+        value = make_value(COLLIDING);
+        check(nc_hashmap_put(map, stolen, value));
+        check(nc_hashmap_steal(map, stolen));
+        check(!nc_hashmap_contains(map, stolen));
+        check(freed_keys == COLLIDING / 2 + 1 && freed_values == COLLIDING / 2 + 1);
+        free(value);
+        free(stolen);
+
+        /* the probe chain is one long run, removes in its middle must not break it */
+        for (unsigned i = 0; i < COLLIDING; i += 3) {
+                snprintf(name, sizeof(name), "key%u", i);
+                nc_hashmap_remove(map, name);
+        }
+        for (unsigned i = 0; i < COLLIDING; i++) {
+                snprintf(name, sizeof(name), "key%u", i);
+                check(nc_hashmap_contains(map, name) == (i % 3 != 0));
+        }
+
+        nc_hashmap_free(map);
+        check(freed_keys == COLLIDING + COLLIDING / 2);
+        check(freed_values == COLLIDING + COLLIDING / 2);
+}
+
+int main(void)
+{
+        test_random();
+        test_cycles();
+        test_colliding();
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
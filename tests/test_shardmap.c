@@ -0,0 +1,224 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * test_shardmap -- check NcShardmap from several threads at once
+ *
+ * Each thread runs random inserts through nc_shardmap_with, the way the
+ * daemon dedupes requests, removes and gets on keys of its own, and
+ * compares every answer with an array of what it expects. Meanwhile all
+ * of them count up a few shared keys through nc_shardmap_with, which must
+ * add up to the number of increments once they are done. Last the size and
+ * contents of the map are checked against what the threads expect.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/nica/shardmap.h"
+
+#define THREADS 8
+#define KEYS_PER_THREAD 1000
+#define OPS 200000
+#define SHARED 16
+
+#define check(cond)                                                                       \
+        do {                                                                              \
+                if (!(cond)) {                                                            \
+                        fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+                        exit(EXIT_FAILURE);                                               \
+                }                                                                         \
+        } while (0)
+
+static NcShardmap *map;
+
+/**
+ * What one thread expects of its keys: key i is present with value
+ * expect[i], or absent if that is 0
+ */
+typedef struct Worker {
+        pthread_t thread;
+        unsigned id;
+        unsigned expect[KEYS_PER_THREAD];
+        unsigned increments;
+} Worker;
+
+/**
+ * A key and the value to give it, for the callbacks
+ */
+typedef struct Insert {
+        const char *key;
+        unsigned value;
+} Insert;
+
+static uint64_t splitmix64(uint64_t x)
+{
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+}
+
+static void make_key(char *buf, size_t len, unsigned thread, unsigned n)
+{
+        snprintf(buf, len, "thread%u/key%u", thread, n);
+}
+
+/**
+ * Insert the key unless it is there already, like avoid_dupes()
+ *
+ * @return 1 if the key was there, 0 if inserted, -1 if out of memory
+ */
+static int insert_absent(NcHashmap *shard, void *data)
+{
+        Insert *insert = data;
+        char *key;
+
+        if (nc_hashmap_contains(shard, insert->key)) {
+                return 1;
+        }
+        key = strdup(insert->key);
+        if (!key || !nc_hashmap_put(shard, key, NC_HASH_VALUE(insert->value))) {
+                free(key);
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * Add one to the value of the key, starting from 0 if absent
+ */
+static int increment(NcHashmap *shard, void *data)
+{
+        Insert *insert = data;
+        void *value = NULL;
+        char *key;
+
+        nc_hashmap_ensure_get(shard, insert->key, &value);
+        /* an equal key replaces the stored one, which the map frees */
+        key = strdup(insert->key);
+        if (!key || !nc_hashmap_put(shard, key, NC_HASH_VALUE(NC_UNHASH_VALUE(value) + 1))) {
+                free(key);
+                return -1;
+        }
+        return 0;
+}
+
+static void *worker_run(void *arg)
+{
+        Worker *worker = arg;
+        char key[64];
+
+        for (unsigned op = 0; op < OPS; op++) {
+                uint64_t r = splitmix64((uint64_t)worker->id << 32 | op);
+                unsigned k = (unsigned)(r % KEYS_PER_THREAD);
+                Insert insert = { .key = key, .value = op + 1 };
+                void *value = NULL;
+
+                make_key(key, sizeof(key), worker->id, k);
+                switch ((r >> 32) % 4) {
+                case 0:
+                        check(nc_shardmap_with(map, key, insert_absent, &insert) ==
+                              (worker->expect[k] ? 1 : 0));
+                        if (!worker->expect[k]) {
+                                worker->expect[k] = op + 1;
+                        }
+                        break;
+                case 1:
+                        check(nc_shardmap_remove(map, key) == (worker->expect[k] != 0));
+                        worker->expect[k] = 0;
+                        break;
+                case 2:
+                        check(nc_shardmap_ensure_get(map, key, &value) ==
+                              (worker->expect[k] != 0));
+                        check(!worker->expect[k] || NC_UNHASH_VALUE(value) == worker->expect[k]);
+                        check(nc_shardmap_contains(map, key) == (worker->expect[k] != 0));
+                        break;
+                default:
+                        snprintf(key, sizeof(key), "shared%u", k % SHARED);
+                        check(nc_shardmap_with(map, key, increment, &insert) == 0);
+                        worker->increments++;
+                        break;
+                }
+        }
+        return NULL;
+}
+
+int main(void)
+{
+        static Worker workers[THREADS];
+        unsigned present = 0, increments = 0, counted = 0;
+        char key[64];
+
+        map = nc_shardmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        check(map);
+
+        for (unsigned t = 0; t < THREADS; t++) {
+                workers[t].id = t;
+                check(pthread_create(&workers[t].thread, NULL, worker_run, &workers[t]) == 0);
+        }
+        for (unsigned t = 0; t < THREADS; t++) {
+                check(pthread_join(workers[t].thread, NULL) == 0);
+        }
+
+        for (unsigned t = 0; t < THREADS; t++) {
+                for (unsigned k = 0; k < KEYS_PER_THREAD; k++) {
+                        void *value = NULL;
+                        bool expected = workers[t].expect[k] != 0;
+
+                        make_key(key, sizeof(key), t, k);
+                        check(nc_shardmap_ensure_get(map, key, &value) == expected);
+                        check(!expected || NC_UNHASH_VALUE(value) == workers[t].expect[k]);
+                        present += expected;
+                }
+                increments += workers[t].increments;
+        }
+        for (unsigned s = 0; s < SHARED; s++) {
+                void *value = NULL;
+
+                snprintf(key, sizeof(key), "shared%u", s);
+                if (nc_shardmap_ensure_get(map, key, &value)) {
+                        counted += NC_UNHASH_VALUE(value);
+                        present++;
+                }
+        }
+        check(counted == increments);
+        check((unsigned)nc_shardmap_size(map) == present);
+
+        nc_shardmap_free(map);
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,106 @@
+/*
+ *   Clear Linux -- automatic debug information installation
+ *
+ *      Copyright (C) 2020  Intel Corporation
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * test_tar -- feed a tarball through both ways the daemon runs tar
+ *
+ * Validates and extracts TARBALL into OUTDIR/file as a file, the way large
+ * objects are, and into OUTDIR/pipe from memory, the way objects up to
+ * MEMORY_MAX are. tests/test_extract.sh compares both with the originals.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "src/daemon.h"
+#include "src/nica/util.h"
+
+static bool extract_to(const char *tarball, const char *data, size_t len, const char *dir)
+{
+        autofree(char) *validate = NULL;
+        autofree(char) *unpack = NULL;
+
+        if (mkdir(dir, 00755) != 0 && errno != EEXIST) {
+                fprintf(stderr, "Failed to create %s: %s\n", dir, strerror(errno));
+                return false;
+        }
+        if (asprintf(&validate, "-C %s --no-same-owner --no-same-permissions -t", dir) < 0 ||
+            asprintf(&unpack, "-C %s --no-same-owner --no-same-permissions -x", dir) < 0) {
+                return false;
+        }
+        if (!run_tar(validate, tarball, data, len)) {
+                fprintf(stderr, "Validating %s %s failed\n", tarball, data ? "from memory" : "");
+                return false;
+        }
+        if (!run_tar(unpack, tarball, data, len)) {
+                fprintf(stderr, "Extracting %s %s failed\n", tarball, data ? "from memory" : "");
+                return false;
+        }
+        return true;
+}
+
+int main(int argc, char **argv)
+{
+        autofree(char) *file_dir = NULL;
+        autofree(char) *pipe_dir = NULL;
+        autofree(char) *data = NULL;
+        struct stat st;
+        FILE *f;
+
+        if (argc != 3) {
+                fprintf(stderr, "Usage: %s TARBALL OUTDIR\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+        if (asprintf(&file_dir, "%s/file", argv[2]) < 0 ||
+            asprintf(&pipe_dir, "%s/pipe", argv[2]) < 0) {
+                return EXIT_FAILURE;
+        }
+
+        f = fopen(argv[1], "r");
+        if (!f || fstat(fileno(f), &st) != 0 || !(data = malloc((size_t)st.st_size + 1)) ||
+            fread(data, 1, (size_t)st.st_size, f) != (size_t)st.st_size) {
+                fprintf(stderr, "Failed to read %s\n", argv[1]);
+                return EXIT_FAILURE;
+        }
+        fclose(f);
+
+        if (!extract_to(argv[1], NULL, 0, file_dir) ||
+            !extract_to(argv[1], data, (size_t)st.st_size, pipe_dir)) {
+                return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */